@@ -1,8 +1,42 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <setjmp.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <sys/un.h>
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
+#ifdef __linux__
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "hq9x.h"
 
 const char HQ9X_VERSION[] = "EHQI 0.9.2 - An extensible HQ9+ interpreter\n";
 
@@ -23,22 +57,112 @@ static char * strdupto(const char * text, size_t size)
 	return result;
 }
 
-static char * readall(FILE * input)
+/* Memory accounting */
+
+/* what each kind of data has allocated, by the sizes the allocator reports for the blocks */
+/* so that freeing needs no size, these are shared by all the states of the process */
+enum
 {
-	size_t size, count;
-	char * buff;
-	char * end;
-	end = buff = malloc(1 + (size = 16));
+	HQ9X_MEMORY_TEXT, /* program text and its preprocessed form */
+	HQ9X_MEMORY_LINES, /* the text cut into lines for grid programs */
+	HQ9X_MEMORY_INPUT, /* input read by the program */
+	HQ9X_MEMORY_TAPE, /* BF */
+	HQ9X_MEMORY_STACK, /* Befunge */
+	HQ9X_MEMORY_OBJECTS, /* HQ9++ classes and objects */
+	HQ9X_MEMORY_FRAMES, /* nested programs of I and B */
+	HQ9X_MEMORY_HOST, /* manifests, requests and output buffers of the command line modes */
+	HQ9X_MEMORY_KINDS
+};
 
-	while((count = fread(end, 1, 16, input)) == 16)
-	{
-		buff = realloc(buff, 1 + (size += 16));
-		end += 16;
-	}
+static const char * const hq9x_memory_names[HQ9X_MEMORY_KINDS + 1] =
+	{ "text", "lines", "input", "tape", "stack", "objects", "frames", "host", "total" };
 
-	buff[size - 16 + count] = '\0';
+static struct
+{
+	long long current, peak;
+} hq9x_memory[HQ9X_MEMORY_KINDS + 1]; /* the last one is the total */
+
+static size_t hq9x_block_size(void * pointer)
+{
+#if defined(__linux__)
+	return malloc_usable_size(pointer);
+#elif defined(__APPLE__)
+	return malloc_size(pointer);
+#else
+	return 0; /* not accounted */
+#endif
+}
+
+static void hq9x_account_one(int kind, long long change)
+{
+	long long current = __atomic_add_fetch(&hq9x_memory[kind].current, change, __ATOMIC_RELAXED);
+	long long peak = __atomic_load_n(&hq9x_memory[kind].peak, __ATOMIC_RELAXED);
+	while(current > peak && !__atomic_compare_exchange_n(&hq9x_memory[kind].peak, &peak, current, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void hq9x_account(int kind, long long change)
+{
+	if(change == 0)
+		return;
+	hq9x_account_one(kind, change);
+	hq9x_account_one(HQ9X_MEMORY_KINDS, change);
+}
+
+static void * hq9x_malloc(int kind, size_t size)
+{
+	void * pointer = malloc(size);
+	if(pointer)
+		hq9x_account(kind, hq9x_block_size(pointer));
+	return pointer;
+}
+
+static void * hq9x_clear_alloc(int kind, size_t size)
+{
+	void * pointer = clear_alloc(size);
+	if(pointer)
+		hq9x_account(kind, hq9x_block_size(pointer));
+	return pointer;
+}
+
+static void * hq9x_realloc(int kind, void * pointer, size_t size)
+{
+	long long before = pointer ? hq9x_block_size(pointer) : 0;
+	pointer = realloc(pointer, size);
+	if(pointer)
+		hq9x_account(kind, (long long)hq9x_block_size(pointer) - before);
+	return pointer;
+}
+
+static char * hq9x_strdupto(int kind, const char * text, size_t size)
+{
+	char * result = strdupto(text, size);
+	hq9x_account(kind, hq9x_block_size(result));
+	return result;
+}
+
+static char * hq9x_strdup(int kind, const char * text)
+{
+	return hq9x_strdupto(kind, text, strlen(text));
+}
+
+static void hq9x_free(int kind, void * pointer)
+{
+	if(!pointer)
+		return;
+	hq9x_account(kind, -(long long)hq9x_block_size(pointer));
+	free(pointer);
+}
 
-	return realloc(buff, 1 + size - 16 + count);
+/* a block now holding another kind of data */
+static void hq9x_retag(void * pointer, int from, int to)
+{
+	long long size;
+	if(!pointer || from == to)
+		return;
+	size = hq9x_block_size(pointer);
+	hq9x_account(from, -size);
+	hq9x_account(to, size);
 }
 
 static char ** getlines(char * text, size_t * countp)
@@ -51,18 +175,44 @@ static char ** getlines(char * text, size_t * countp)
 		size += 1;
 	if(countp)
 		*countp = size;
-	arr = malloc((size + 1) * sizeof(char *));
+	arr = hq9x_malloc(HQ9X_MEMORY_LINES, (size + 1) * sizeof(char *));
 	last = text;
 	while((ptr = strchr(last, '\n')))
 	{
-		arr[count++] = strdupto(last, ptr - last);
+		arr[count++] = hq9x_strdupto(HQ9X_MEMORY_LINES, last, ptr - last);
 		last = ptr + 1;
 	}
-	arr[count++] = strdup(last);
+	arr[count++] = hq9x_strdup(HQ9X_MEMORY_LINES, last);
 	arr[count] = NULL;
 	return arr;
 }
 
+static double hq9x_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* the time stamp counter where there is one, nanoseconds elsewhere */
+static uint64_t hq9x_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+/* for code that must be specialized for each value of a constant argument */
+#ifdef __GNUC__
+#define HQ9X_INLINE inline __attribute__((always_inline))
+#else
+#define HQ9X_INLINE inline
+#endif
+
 typedef struct hq9x_state hq9x_state_t;
 typedef void (*function_ptr_t)(hq9x_state_t *);
 
@@ -70,44 +220,125 @@ typedef void (*function_ptr_t)(hq9x_state_t *);
 
 typedef struct source_t
 {
-	FILE * file;
+	hq9x_read_t read;
+	void * user;
 
 	char * text; /* the whole text in one string */
 	char * pointer; /* a pointer into either the text or the current line */
 
 	char ** lines; /* a null-terminated array of strings that are the lines */
 	size_t count; /* size of the array */
+	size_t * widths; /* cells of each line, as a cell may be a 0 put there by the program */
 
 	char ** line; /* the current line */
 	int dir, out_of_bound; /* the direction, and whether the pointer is out of bounds */
 
-	char * last_nl; /* last newline, for easier change from freeform to grid-like control */
+	/* preprocessed form, only valid while the text is not cut into lines */
+	unsigned char * ops; /* the text with the case sensitivity already applied */
+	int32_t * jumps; /* offset of the matching bracket for each '[' and ']' */
+	size_t size; /* length of the text */
+	size_t capacity; /* allocated for the text while it is being read */
+	int partial; /* not all of the text has been read yet */
+
+	void * map; /* cache file the text, the preprocessed form and the lines may point into */
+	size_t map_size;
+
+	char * rot13; /* the text as R writes it, once R has run */
+	size_t * sorted; /* offsets of the lines of the text in sorted order, once S has sorted them */
+	size_t sorted_count;
+
+	unsigned char * dirty; /* lines changed since the snapshot, NULL unless tracked */
+	size_t dirty_size;
+
+	size_t grown; /* bytes added to the grid while running, counted against the memory limit */
+	int memory; /* what the text is accounted as, the program or input */
 } source_t;
 
-static void source_init(source_t * source, FILE * file)
+static void source_init(source_t * source, hq9x_read_t read, void * user)
 {
 	memset(source, 0, sizeof(source_t));
-	source->file = stdin;
+	source->read = read;
+	source->user = user;
 	source->dir = '>';
+	source->memory = HQ9X_MEMORY_INPUT;
+}
+
+static int source_is_mapped(source_t * source, const void * pointer)
+{
+	return source->map && (const char *)source->map <= (const char *)pointer && (const char *)pointer < (const char *)source->map + source->map_size;
+}
+
+/* the text is the program now, or input again */
+static void source_retag(source_t * source, int memory)
+{
+	if(source->text && !source_is_mapped(source, source->text))
+		hq9x_retag(source->text, source->memory, memory);
+	source->memory = memory;
 }
 
 static void source_free(source_t * source)
 {
-	if(source->text)
-		free(source->text);
+	if(source->text && !source_is_mapped(source, source->text))
+		hq9x_free(source->memory, source->text);
 	if(source->lines)
 	{
 		char ** current;
 		for(current = source->lines; *current; current++)
-			free(*current);
-		free(source->lines);
+			if(!source_is_mapped(source, *current))
+				hq9x_free(HQ9X_MEMORY_LINES, *current);
+		hq9x_free(HQ9X_MEMORY_LINES, source->lines);
+		hq9x_free(HQ9X_MEMORY_LINES, source->widths);
 	}
+	if(source->ops && !source_is_mapped(source, source->ops))
+		hq9x_free(HQ9X_MEMORY_TEXT, source->ops);
+	if(source->jumps && !source_is_mapped(source, source->jumps))
+		hq9x_free(HQ9X_MEMORY_TEXT, source->jumps);
+	if(source->sorted)
+		hq9x_free(HQ9X_MEMORY_LINES, source->sorted);
+	if(source->rot13)
+		hq9x_free(HQ9X_MEMORY_INPUT, source->rot13);
+	if(source->map)
+		munmap(source->map, source->map_size);
+	free(source->dirty);
 }
 
-static char * source_get_text(source_t * source)
+/* marks a line to be restored from the snapshot */
+static void source_touch(source_t * source, size_t lineno)
+{
+	if(source->dirty && lineno < source->dirty_size)
+		source->dirty[lineno] = 1;
+}
+
+/* reads what is available, returns 0 if the reader would block before the end of the text */
+static int source_fill(source_t * source)
 {
 	if(!source->text)
-		source->text = readall(source->file);
+	{
+		source->text = hq9x_malloc(source->memory, source->capacity = 4096);
+		source->text[0] = '\0';
+		source->size = 0;
+		source->partial = source->read != NULL;
+	}
+	while(source->partial)
+	{
+		size_t count;
+		if(source->size + 1 == source->capacity)
+			source->text = hq9x_realloc(source->memory, source->text, source->capacity *= 2);
+		count = source->read(source->user, source->text + source->size, source->capacity - source->size - 1);
+		if(count == HQ9X_WOULD_BLOCK)
+			return 0;
+		if(count == 0)
+			source->partial = 0;
+		source->size += count;
+		source->text[source->size] = '\0';
+	}
+	return 1;
+}
+
+static char * source_get_text(source_t * source)
+{
+	if(!source->text || source->partial)
+		source_fill(source);
 	return source->text;
 }
 
@@ -116,7 +347,11 @@ static char * source_get_pointer(source_t * source)
 	if(!source->pointer)
 	{
 		if(source->lines)
+		{
+			/* a grid entered again starts on its first line */
+			source->line = &source->lines[0];
 			source->pointer = source->lines[0];
+		}
 		else
 			source->pointer = source_get_text(source);
 	}
@@ -125,19 +360,31 @@ static char * source_get_pointer(source_t * source)
 
 static char * source_get_line(source_t * source)
 {
-	return source->line ? *source->line : /*source->last_nl ? source->last_nl + 1 :*/ source->text;
-	/* if not parsed into lines, give back character after last newline, otherwise give whole text */
+	return source->line ? *source->line : source->text;
+	/* if parsed into lines, give back the current line, otherwise the whole text */
 }
 
 static char ** source_get_lines(source_t * source)
 {
 	if(!source->lines)
 	{
-		source->lines = getlines(source_get_text(source), &source->count);
-		/* since the text is cut into lines, the pointer must point into the first line instead of the whole text */
-		source->line = &source->lines[0];
+		char * text = source_get_text(source);
+		size_t row = 0, column = 0, i;
+		/* the pointer may have got to where it is by a jump or a nested program, so its line is counted from the start */
+		for(i = 0; source->pointer && text + i < source->pointer; i++)
+		{
+			column++;
+			if(text[i] == '\n')
+				row++, column = 0;
+		}
+		source->lines = getlines(text, &source->count);
+		source->widths = hq9x_malloc(HQ9X_MEMORY_LINES, (source->count + 1) * sizeof(size_t));
+		for(i = 0; i < source->count; i++)
+			source->widths[i] = strlen(source->lines[i]);
+		/* since the text is cut into lines, the pointer must point into its line instead of the whole text */
+		source->line = &source->lines[row];
 		if(source->pointer)
-			source->pointer += *source->line - (source->last_nl ? source->last_nl + 1 : source->text);
+			source->pointer = *source->line + column;
 	}
 	return source->lines;
 }
@@ -149,9 +396,14 @@ static void source_ensure_line(source_t * source, int lineno, int pos)
 	{
 		int tmp = source->line - source->lines;
 		int i;
-		source->lines = realloc(source->lines, (lineno + 2) * sizeof(char *));
+		source->lines = hq9x_realloc(HQ9X_MEMORY_LINES, source->lines, (lineno + 2) * sizeof(char *));
+		source->widths = hq9x_realloc(HQ9X_MEMORY_LINES, source->widths, (lineno + 2) * sizeof(size_t));
 		for(i = source->count; i < lineno + 1; i++)
-			source->lines[i] = strdup("");
+		{
+			source->lines[i] = hq9x_strdup(HQ9X_MEMORY_LINES, "");
+			source->widths[i] = 0;
+		}
+		source->grown += (lineno + 1 - source->count) * (sizeof(char *) + 1);
 		source->count = lineno + 1;
 		source->lines[source->count] = NULL;
 		source->line = source->lines + tmp;
@@ -160,11 +412,22 @@ static void source_ensure_line(source_t * source, int lineno, int pos)
 	if(strlen(source->lines[lineno]) < pos)
 	{
 		size_t size = strlen(source->lines[lineno]);
-		int tmp = source->pointer - *source->line;
-		int iscurrent = source->line == &source->lines[lineno];
-		source->lines[lineno] = realloc(source->line[lineno], pos + 2);
+		int iscurrent = source->pointer && source->line == &source->lines[lineno];
+		int tmp = iscurrent ? source->pointer - *source->line : 0;
+		source_touch(source, lineno);
+		if(source_is_mapped(source, source->lines[lineno]))
+		{
+			/* lines loaded from the cache cannot grow in place */
+			char * copy = hq9x_malloc(HQ9X_MEMORY_LINES, pos + 2);
+			memcpy(copy, source->lines[lineno], size);
+			source->lines[lineno] = copy;
+		}
+		else
+			source->lines[lineno] = hq9x_realloc(HQ9X_MEMORY_LINES, source->lines[lineno], pos + 2);
 		memset(source->lines[lineno] + size, ' ', pos + 1 - size);
+		source->grown += pos + 1 - size;
 		source->lines[lineno][pos + 1] = '\0';
+		source->widths[lineno] = pos + 1;
 		if(iscurrent)
 		{
 			source->line = &source->lines[lineno];
@@ -179,8 +442,6 @@ static void source_advance(source_t * source)
 {
 	if(!source->lines && source->dir == '>')
 	{
-		if(!source->lines && *source_get_pointer(source) == '\n')
-			source->last_nl = source_get_pointer(source);
 		if(source_get_pointer(source)[0] && source_get_pointer(source)[1])
 			source->pointer ++;
 		else
@@ -223,7 +484,8 @@ static void source_advance(source_t * source)
 		}
 		else
 			source->out_of_bound = 1;
-		source_ensure_line(source, 0, source->pointer - source->line[0]);
+		/* the line moved to may be shorter than the column */
+		source_ensure_line(source, source->line - source->lines, source->pointer - source->line[0]);
 	break;
 	case '^':
 		if(source->line && source->line != source->lines)
@@ -238,7 +500,8 @@ static void source_advance(source_t * source)
 		}
 		else
 			source->out_of_bound = 1;
-		source_ensure_line(source, source->count - 1, source->pointer - source->line[0]);
+		/* the line moved to may be shorter than the column */
+		source_ensure_line(source, source->line - source->lines, source->pointer - source->line[0]);
 	break;
 	}
 }
@@ -251,6 +514,63 @@ static void source_ensure_grid(source_t * source, int height, int width)
 		source_ensure_line(source, i, width - 1);
 }
 
+/* Program preparation */
+
+static unsigned char source_fold(int charcase, unsigned char op)
+{
+	switch(charcase)
+	{
+	case 0:
+		if('A' <= op && op <= 'Z')
+			op += 'a' - 'A';
+	break;
+	case 'A':
+		if('A' <= op && op <= 'Z')
+			op += 'a' - 'A';
+		else if('a' <= op && op <= 'z')
+			op = 0;
+	break;
+	case 'a':
+	break;
+	}
+	return op;
+}
+
+/* builds the opcode stream and the bracket jump table of a freeform program */
+static void source_compile(source_t * source, int charcase)
+{
+	char * text = source_get_text(source);
+	size_t * stack;
+	size_t depth = 0, i;
+
+	source->size = strlen(text);
+	source->ops = hq9x_malloc(HQ9X_MEMORY_TEXT, source->size + 1);
+	source->jumps = hq9x_malloc(HQ9X_MEMORY_TEXT, (source->size + 1) * sizeof(int32_t));
+	stack = malloc((source->size + 1) * sizeof(size_t));
+	for(i = 0; i <= source->size; i++)
+	{
+		source->ops[i] = source_fold(charcase, text[i]);
+		source->jumps[i] = -1;
+		if(text[i] == '[')
+		{
+			stack[depth++] = i;
+		}
+		else if(text[i] == ']')
+		{
+			if(depth > 0)
+			{
+				source->jumps[i] = stack[--depth];
+				source->jumps[stack[depth]] = i;
+			}
+			else
+				source->jumps[i] = 0; /* same as scanning back to the beginning */
+		}
+	}
+	while(depth > 0)
+		source->jumps[stack[--depth]] = source->size; /* same as scanning forward to the end */
+	free(stack);
+}
+
 /* The BF interpreter state */
 
 typedef char bf_cell_t;
@@ -260,6 +580,7 @@ typedef struct bf_state
 	bf_cell_t * cells;
 	size_t count;
 	size_t pointer;
+	size_t used; /* cells from here on are still zero */
 } bf_state_t;
 
 /* The Befunge interpreter state */
@@ -272,6 +593,7 @@ typedef struct bef_state
 	size_t capacity;
 	size_t pointer;
 	int stringmode;
+	size_t version; /* bumped each time p changes the grid */
 } bef_state_t;
 
 /* OO extensions */
@@ -301,13 +623,61 @@ typedef struct hq9x_oo_state
 	hq9x_object_t * current_object;
 } hq9x_oo_state_t;
 
+/* Compiled program and result caches */
+
+typedef struct hq9x_cache
+{
+	const char * directory; /* NULL if caching is disabled */
+	size_t limit; /* maximum total size of the cache files */
+} hq9x_cache_t;
+
+/* Captured output of a run, for the result cache */
+
+typedef struct hq9x_result
+{
+	hq9x_cache_t * cache;
+	uint64_t key;
+	const char * text; /* the program, stored along with the output to rule out collisions */
+	size_t text_size;
+	char * data;
+	size_t size, capacity;
+	size_t limit; /* 0 if unlimited */
+	int overflow; /* the output exceeded the limit */
+} hq9x_result_t;
+
+/* Saved context of an outer program, while running a nested one */
+
+/* a prepared program kept to be run over many inputs, see hq9x_load */
+typedef struct hq9x_snapshot
+{
+	source_t source; /* lent to each run, then put back as it was */
+	char ** lines; /* the grid as it was prepared */
+	size_t count;
+	int deterministic;
+	uint64_t key; /* of the result cache, if deterministic */
+	int running;
+} hq9x_snapshot_t;
+
+typedef struct hq9x_frame
+{
+	source_t source;
+	char * input_pointer;
+	function_ptr_t op; /* the command that started the nested program */
+	function_ptr_t last_op;
+	const function_ptr_t * dispatch; /* table to restore, if the nested program has its own */
+	function_ptr_t pre_op, default_op;
+	struct hq9x_frame * parent;
+} hq9x_frame_t;
+
 /* The HQ9+ interpreter state */
 
 struct hq9x_state
 {
 	function_ptr_t ops[256];
+	const function_ptr_t * dispatch; /* ops, or the shared BF table while B runs a nested program */
 	function_ptr_t pre_op, default_op, op, last_op;
 	char charcase; /* 0, 'A' or 'a' */
+	int dialect;
 	source_t source;
 	source_t input;
 	char opchar;
@@ -315,30 +685,106 @@ struct hq9x_state
 	int accumulator;
 	enum { ERROR_QUIET, ERROR_SIGNAL, ERROR_HALT } on_error;
 	int exit_with_accumulator; /* on exit, use accumulator as program status */
+	int nondeterministic; /* set when the run depended on anything but the source and the flags */
+	hq9x_result_t * result;
+	hq9x_snapshot_t * snapshot;
+
+	hq9x_options_t options;
+	hq9x_cache_t cache;
+	hq9x_read_t read;
+	hq9x_write_t write;
+	void * user;
+	unsigned long random;
+
+	hq9x_frame_t * frame; /* innermost nested program */
+	jmp_buf halt; /* returns from the run */
+	int status;
+	enum { HOLD_NONE, HOLD_AGAIN, HOLD_BLOCKED, HOLD_RESUME } hold; /* do not advance after the current command, or retry it */
+	unsigned long long steps;
+	unsigned long long check_at; /* step at which the limits are checked next */
+	double deadline; /* 0 without a time limit */
+	size_t output_size;
+	int bf_enabled; /* as it was when the run started */
+	hq9x_result_t capture;
 
 	bf_state_t * bf;
 	bef_state_t * bef;
 	hq9x_oo_state_t * oo;
+	struct hq9x_loops * loops; /* NULL unless non-productive loops are detected */
+	struct hq9x_profile * profile; /* NULL unless profiling */
 };
 
-enum
+
+/* Output */
+
+static void hq9x_exceeded(hq9x_state_t * state, int status, const char * message);
+
+static void hq9x_write(hq9x_state_t * state, const char * data, size_t size)
 {
-	HQ9X_ORIGINAL,
-	HQ9X_DEFAULT,
-	HQ9X_CHIQRSX9X,
-	HQ9X_BRAINF,
-	HQ9X_OO,
-	HQ9X_OO_QC,
-	HQ9X_H9X,
-	HQ9X_HQ9XBF,
-	HQ9X_DEADFISH,
-	HQ9X_FISHQ9X,
-	HQ9X_2D,
-	HQ9X_BEFUNGE93,
-	HQ9X_NIL,
-	HQ9X_PLUS,
-	HQ9X_H9F,
-};
+	hq9x_result_t * result = state->result;
+	if(state->options.max_output && state->output_size + size > state->options.max_output)
+	{
+		state->write(state->user, data, state->options.max_output - state->output_size);
+		state->output_size = state->options.max_output;
+		hq9x_exceeded(state, HQ9X_EXIT_OUTPUT, "Output limit exceeded");
+	}
+	state->output_size += size;
+	state->write(state->user, data, size);
+	if(result && !result->overflow)
+	{
+		if(result->limit && result->size + size > result->limit)
+		{
+			result->overflow = 1;
+			return;
+		}
+		if(result->size + size > result->capacity)
+		{
+			while(result->size + size > result->capacity)
+				result->capacity = result->capacity ? 2 * result->capacity : 4096;
+			result->data = realloc(result->data, result->capacity);
+		}
+		memcpy(result->data + result->size, data, size);
+		result->size += size;
+	}
+}
+
+static void hq9x_putchar(hq9x_state_t * state, char c)
+{
+	hq9x_write(state, &c, 1);
+}
+
+static void hq9x_printf(hq9x_state_t * state, const char * format, ...)
+{
+	char buffer[256];
+	char * text = buffer;
+	va_list args;
+	int size;
+
+	va_start(args, format);
+	size = vsnprintf(buffer, sizeof buffer, format, args);
+	va_end(args);
+	if(size >= sizeof buffer)
+	{
+		text = malloc(size + 1);
+		va_start(args, format);
+		vsnprintf(text, size + 1, format, args);
+		va_end(args);
+	}
+	hq9x_write(state, text, size);
+	if(text != buffer)
+		free(text);
+}
+
+/* Input */
+
+/* checked first by commands that read input, if it would block the command is retried later */
+static int hq9x_input_ready(hq9x_state_t * state)
+{
+	if((state->input.text && !state->input.partial) || source_fill(&state->input))
+		return 1;
+	state->hold = HOLD_BLOCKED;
+	return 0;
+}
 
 /* BF interpreter */
 
@@ -349,9 +795,14 @@ static void bf_init(hq9x_state_t * state)
 	if(!state->bf)
 		state->bf = clear_alloc(sizeof(bf_state_t));
 	if(!state->bf->cells)
-		state->bf->cells = malloc(sizeof(bf_cell_t) * (state->bf->count = 100));
-	memset(state->bf->cells, 0, sizeof(bf_cell_t) * state->bf->count);
+	{
+		state->bf->cells = hq9x_malloc(HQ9X_MEMORY_TAPE, sizeof(bf_cell_t) * (state->bf->count = 100));
+		state->bf->used = state->bf->count;
+	}
+	/* only what the last run could have touched needs clearing */
+	memset(state->bf->cells, 0, sizeof(bf_cell_t) * state->bf->used);
 	state->bf->pointer = 0;
+	state->bf->used = 1;
 }
 
 /*static void bf_debug(hq9x_state_t * state)
@@ -359,16 +810,16 @@ static void bf_init(hq9x_state_t * state)
 	fprintf(stderr, "Codepoint %ld, BF pointer at %ld with value %d\n", state->source.pointer - state->source.text, state->bf->pointer, state->bf->cells[state->bf->pointer]);
 }*/
 
-/*static void bf_clear(hq9x_state_t * state)
+static void bf_clear(hq9x_state_t * state)
 {
 	if(state->bf)
 	{
 		if(state->bf->cells)
-			free(state->bf->cells);
+			hq9x_free(HQ9X_MEMORY_TAPE, state->bf->cells);
 		free(state->bf);
 		state->bf = NULL;
 	}
-}*/
+}
 
 void bf_left(hq9x_state_t * state)
 {
@@ -380,9 +831,11 @@ void bf_right(hq9x_state_t * state)
 {
 	if(state->bf->pointer < 30000)
 		state->bf->pointer ++;
-	if(state->bf->pointer > state->bf->count)
+	if(state->bf->pointer >= state->bf->used)
+		state->bf->used = state->bf->pointer + 1;
+	if(state->bf->pointer >= state->bf->count)
 	{
-		state->bf->cells = realloc(state->bf->cells, sizeof(bf_cell_t) * (state->bf->count + 100));
+		state->bf->cells = hq9x_realloc(HQ9X_MEMORY_TAPE, state->bf->cells, sizeof(bf_cell_t) * (state->bf->count + 100));
 		memset(state->bf->cells + sizeof(bf_cell_t) * state->bf->count, 0, sizeof(bf_cell_t) * 100);
 		state->bf->count += 100;
 	}
@@ -403,6 +856,11 @@ void bf_do(hq9x_state_t * state)
 	if(!state->bf->cells[state->bf->pointer])
 	{
 		int level = 0;
+		if(state->source.jumps && !state->source.lines)
+		{
+			state->source.pointer = state->source.text + state->source.jumps[state->source.pointer - state->source.text];
+			return;
+		}
 		state->source.pointer ++;
 		while(1)
 		{
@@ -422,8 +880,15 @@ void bf_loop(hq9x_state_t * state)
 	if(state->bf->cells[state->bf->pointer])
 	{
 		int level = 0;
+		if(state->source.jumps && !state->source.lines)
+		{
+			state->source.pointer = state->source.text + state->source.jumps[state->source.pointer - state->source.text];
+			return;
+		}
 		while(1)
 		{
+			if(state->source.lines && state->source.pointer == *state->source.line)
+				break; /* in a grid the search stops at the start of the line, like [ does at its end */
 			if(state->source.pointer == state->source.text)
 			{
 				state->source.pointer = 0;
@@ -440,13 +905,15 @@ void bf_loop(hq9x_state_t * state)
 
 void bf_read(hq9x_state_t * state)
 {
+	if(!hq9x_input_ready(state))
+		return;
 	if((((bf_cell_t *)state->bf->cells)[state->bf->pointer] = *source_get_pointer(&state->input)))
 		state->input.pointer ++;
 }
 
 void bf_write(hq9x_state_t * state)
 {
-	putchar(((bf_cell_t *)state->bf->cells)[state->bf->pointer]);
+	hq9x_putchar(state, ((bf_cell_t *)state->bf->cells)[state->bf->pointer]);
 }
 
 /* Befunge, HQ9+2D commands */
@@ -479,9 +946,11 @@ static void bef_init(hq9x_state_t * state)
 	if(!state->bef)
 		state->bef = clear_alloc(sizeof(bef_state_t));
 	if(!state->bef->stack)
-		state->bef->stack = malloc(sizeof(bef_cell_t) * (state->bef->capacity = 16));
+		state->bef->stack = hq9x_malloc(HQ9X_MEMORY_STACK, sizeof(bef_cell_t) * (state->bef->capacity = 16));
 	memset(state->bef->stack, 0, sizeof(bef_cell_t) * state->bef->capacity);
 	state->bef->pointer = 0;
+	state->bef->stringmode = 0;
+	state->bef->version = 0;
 }
 
 /*static void bef_debug(hq9x_state_t * state)
@@ -492,16 +961,16 @@ static void bef_init(hq9x_state_t * state)
 		printf("[%s]\n", *line);
 }*/
 
-/*static void bef_clear(hq9x_state_t * state)
+static void bef_clear(hq9x_state_t * state)
 {
 	if(state->bef)
 	{
 		if(state->bef->stack)
-			free(state->bef->stack);
+			hq9x_free(HQ9X_MEMORY_STACK, state->bef->stack);
 		free(state->bef);
 		state->bef = NULL;
 	}
-}*/
+}
 
 static bef_cell_t bef_peek(hq9x_state_t * state)
 {
@@ -526,7 +995,7 @@ static void bef_push(hq9x_state_t * state, bef_cell_t value)
 	if(state->bef->pointer <= 0)
 		state->bef->pointer = 0;
 	while(state->bef->capacity < state->bef->pointer + 1)
-		state->bef->stack = realloc(state->bef->stack, sizeof(bef_cell_t) * (state->bef->capacity += 16));
+		state->bef->stack = hq9x_realloc(HQ9X_MEMORY_STACK, state->bef->stack, sizeof(bef_cell_t) * (state->bef->capacity += 16));
 	state->bef->stack[state->bef->pointer++] = value;
 }
 
@@ -554,6 +1023,8 @@ void bef_mul(hq9x_state_t * state)
 	bef_push(state, a * b);
 }
 
+static bef_cell_t bef_read_int(hq9x_state_t * state);
+
 void bef_div(hq9x_state_t * state)
 {
 	bef_cell_t a, b;
@@ -565,10 +1036,14 @@ void bef_div(hq9x_state_t * state)
 	}
 	else if(b == 0)
 	{
-		printf("Division by zero; please specify result: ");
-		fflush(stdout);
-		scanf("%ld", &a);
-		bef_push(state, a);
+		if(!hq9x_input_ready(state))
+		{
+			bef_push(state, a);
+			bef_push(state, b);
+			return;
+		}
+		hq9x_printf(state, "Division by zero; please specify result: ");
+		bef_push(state, bef_read_int(state));
 	}
 	else
 	{
@@ -587,10 +1062,14 @@ void bef_mod(hq9x_state_t * state)
 	}
 	else if(b == 0)
 	{
-		printf("Modulo by zero; please specify result: ");
-		fflush(stdout);
-		scanf("%ld", &a);
-		bef_push(state, a);
+		if(!hq9x_input_ready(state))
+		{
+			bef_push(state, a);
+			bef_push(state, b);
+			return;
+		}
+		hq9x_printf(state, "Modulo by zero; please specify result: ");
+		bef_push(state, bef_read_int(state));
 	}
 	else
 	{
@@ -614,7 +1093,10 @@ void bef_greater(hq9x_state_t * state)
 void bef_random(hq9x_state_t * state)
 {
 	char dirs[] = ">^<v";
-	state->source.dir = dirs[rand() & 3];
+	state->nondeterministic = 1;
+	/* a per state generator, so that runs do not interfere */
+	state->random = state->random * 1103515245 + 12345;
+	state->source.dir = dirs[(state->random >> 16) & 3];
 }
 
 void bef_h_if(hq9x_state_t * state)
@@ -653,18 +1135,19 @@ void bef_drop(hq9x_state_t * state)
 
 void bef_print_int(hq9x_state_t * state)
 {
-	printf("%ld\n", bef_pop(state));
+	hq9x_printf(state, "%ld\n", bef_pop(state));
 }
 
 void bef_print_char(hq9x_state_t * state)
 {
-	printf("%c", (char)bef_pop(state));
+	hq9x_putchar(state, (char)bef_pop(state));
 }
 
-void bef_scan_int(hq9x_state_t * state)
+static bef_cell_t bef_read_int(hq9x_state_t * state)
 {
 	bef_cell_t v = 0, sgn = 1;
 	int c;
+	state->nondeterministic = 1;
 	if(*source_get_pointer(&state->input) == '-')
 	{
 		sgn = -1;
@@ -674,16 +1157,27 @@ void bef_scan_int(hq9x_state_t * state)
 	{
 		source_advance(&state->input);
 	}
-	while(isdigit((c = *source_get_pointer(&state->input))))
+	/* the input stays on its last character once it is read */
+	while(!state->input.out_of_bound && isdigit((c = *source_get_pointer(&state->input))))
 	{
-		v = 10 * v + c;
+		v = 10 * v + c - '0';
 		source_advance(&state->input);
 	}
-	bef_push(state, sgn * v);
+	return sgn * v;
+}
+
+void bef_scan_int(hq9x_state_t * state)
+{
+	if(!hq9x_input_ready(state))
+		return;
+	bef_push(state, bef_read_int(state));
 }
 
 void bef_scan_char(hq9x_state_t * state)
 {
+	if(!hq9x_input_ready(state))
+		return;
+	state->nondeterministic = 1;
 	bef_push(state, *source_get_pointer(&state->input));
 	source_advance(&state->input);
 }
@@ -710,8 +1204,12 @@ void bef_put(hq9x_state_t * state)
 	y = bef_pop(state);
 	x = bef_pop(state);
 	v = bef_pop(state);
-	if(0 <= y && y < state->source.count && 0 <= x && x < strlen(state->source.lines[y]))
+	if(0 <= y && y < state->source.count && 0 <= x && x < strlen(state->source.lines[y]) && state->source.lines[y][x] != (char)v)
+	{
 		state->source.lines[y][x] = v;
+		source_touch(&state->source, y);
+		state->bef->version++;
+	}
 }
 
 void bef_push_digit(hq9x_state_t * state)
@@ -731,804 +1229,6855 @@ void bef_preprocess(hq9x_state_t * state)
 
 /* The core HQ9+ runtime */
 
-static const char * hq9x_hello_message = "Hello, world!";
+/* stop the program, returning from hq9x_run */
+
+static void hq9x_halt(hq9x_state_t * state, int status)
+{
+	state->status = status;
+	longjmp(state->halt, 1);
+}
 
 /* halt on error */
 
 static void hq9x_error_halt(hq9x_state_t * state)
 {
 	if(state->on_error == ERROR_HALT)
-		exit(1);
+		hq9x_halt(state, 1);
 }
 
-/* comment (ignored character) */
+/* Execution limits */
 
-void hq9x_nop(hq9x_state_t * state)
+#define HQ9X_BUDGET_INTERVAL 4096 /* steps between checks of the time and memory limits */
+
+/* stop the program, a run cut short is not cached */
+
+static void hq9x_exceeded(hq9x_state_t * state, int status, const char * message)
 {
+	state->nondeterministic = 1;
+	fprintf(stderr, "%s\n", message);
+	hq9x_halt(state, status);
 }
 
-/* syntax error */
-
-void hq9x_unknown(hq9x_state_t * state)
+/* what the program has allocated while running */
+static size_t hq9x_heap_size(hq9x_state_t * state)
 {
-	if(state->on_error != ERROR_QUIET)
+	size_t size = state->source.grown;
+	if(state->bf)
+		size += state->bf->count * sizeof(bf_cell_t);
+	if(state->bef)
+		size += state->bef->capacity * sizeof(bef_cell_t);
+	if(state->oo)
 	{
-		fprintf(stderr, "Unknown command: `%c'\n", state->opchar);
-		hq9x_error_halt(state);
+		size += sizeof(hq9x_oo_state_t);
+		if(state->oo->current_class)
+			size += sizeof(hq9x_class_t);
+		if(state->oo->current_object)
+			size += sizeof(hq9x_object_t);
 	}
+	return size;
 }
 
-/* add newline, FISHQ9+ unknown command */
-
-void hq9x_newline(hq9x_state_t * state)
+static void hq9x_schedule_check(hq9x_state_t * state)
 {
-	putchar('\n');
+	hq9x_options_t * options = &state->options;
+	state->check_at = ULLONG_MAX;
+	if(state->deadline || options->max_memory)
+		state->check_at = state->steps + HQ9X_BUDGET_INTERVAL;
+	if(options->max_steps && options->max_steps < state->check_at)
+		state->check_at = options->max_steps;
 }
 
-/* HQ9+ command H */
-
-void hq9x_hello(hq9x_state_t * state)
+static void hq9x_check_budget(hq9x_state_t * state)
 {
-	printf("%s\n", hq9x_hello_message);
+	hq9x_options_t * options = &state->options;
+	/* a program that is just about to end is let to */
+	int ending = state->source.out_of_bound && !state->frame->parent;
+	if(options->max_steps && state->steps >= options->max_steps && !ending)
+		hq9x_exceeded(state, HQ9X_EXIT_STEPS, "Step limit exceeded");
+	if(state->deadline && hq9x_now() >= state->deadline)
+		hq9x_exceeded(state, HQ9X_EXIT_TIME, "Time limit exceeded");
+	if(options->max_memory && hq9x_heap_size(state) > options->max_memory)
+		hq9x_exceeded(state, HQ9X_EXIT_MEMORY, "Memory limit exceeded");
+	hq9x_schedule_check(state);
+	if(ending && state->check_at <= state->steps)
+		state->check_at = state->steps + 1;
 }
 
-/* HQ9+ command Q */
+/* Non-productive loop detection */
 
-void hq9x_quine(hq9x_state_t * state)
-{
-	printf("%s", state->source.text);
-}
+/* the state is compared at loop heads only: a BF ] jumping back, or a Befunge or HQ9+2D turn */
+/* and only at every 16th of those, which still repeats if the program does */
+/* with Brent's method, against a copy taken after 64, 128, 256 and so on compared states without I/O */
 
-/* HQ9+ command 9 */
+#define HQ9X_LOOP_WINDOW 8 /* tape cells on each side of the pointer and stack entries on top that are hashed */
+#define HQ9X_LOOP_STRIDE 16 /* loop heads per comparison */
+#define HQ9X_LOOP_QUIET 64 /* comparisons without input or output before the state is first saved */
 
-void hq9x_bottles(hq9x_state_t * state)
-{
-	int i;
-	for(i = 99; i > 0; i--)
-	{
-		printf("%d bottle%s of beer on the wall,\n", i, i == 1 ? "" : "s");
-		printf("%d bottle%s of beer.\n", i, i == 1 ? "" : "s");
-		printf("Take one down, pass it around,\n");
-		if(i != 1)
-			printf("%d bottle%s of beer on the wall.\n", i - 1, i == 2 ? "" : "s");
-		else
-			printf("No bottles of beer on the wall.\n");
-	}
-}
+static uint64_t hq9x_hash(uint64_t hash, const void * data, size_t size);
 
-/* HQ9+ command +; FISHQ9+, Deadfish command I (also X) */
+/* everything but the tape and the stack, which are only hashed around the pointer here */
+typedef struct hq9x_loop_key
+{
+	uint64_t hash;
+	hq9x_frame_t * frame;
+	const char * pointer;
+	char ** line;
+	int dir;
+	function_ptr_t last_op;
+	int accumulator;
+	unsigned long random;
+	size_t output_size;
+	const char * input;
+	int bf_enabled;
+	size_t bf_pointer, bf_used;
+	int stringmode;
+	size_t bef_pointer, bef_version;
+	const void * object;
+} hq9x_loop_key_t;
 
-void hq9x_inc(hq9x_state_t * state)
+typedef struct hq9x_loops
 {
-	state->accumulator ++;
+	hq9x_loop_key_t saved;
+	int valid;
+	char * cells; /* the tape and the stack when saved */
+	size_t size, capacity;
+	unsigned long long count, next; /* comparisons since the last save, and until the next one */
+	unsigned stride; /* loop heads until the next comparison */
+} hq9x_loops_t;
+
+static void hq9x_loops_reset(hq9x_loops_t * loops)
+{
+	loops->stride = HQ9X_LOOP_STRIDE;
+	loops->valid = 0;
+	loops->count = 0;
+	loops->next = HQ9X_LOOP_QUIET;
+	memset(&loops->saved, 0, sizeof loops->saved);
 }
 
-/* HQ9+- command --; FISHQ9+ command D/d */
-
-void hq9x_dec(hq9x_state_t * state)
+static void hq9x_loop_key(hq9x_state_t * state, hq9x_loop_key_t * key)
 {
-	state->accumulator --;
+	memset(key, 0, sizeof *key); /* compared as a whole, padding included */
+	key->frame = state->frame;
+	key->pointer = state->source.pointer;
+	key->line = state->source.line;
+	key->dir = state->source.dir;
+	key->last_op = state->last_op;
+	key->accumulator = state->accumulator;
+	key->random = state->random;
+	key->output_size = state->output_size;
+	key->input = state->input.pointer;
+	key->hash = 0xCBF29CE484222325ULL;
+	if(state->bf)
+	{
+		size_t first = state->bf->pointer > HQ9X_LOOP_WINDOW ? state->bf->pointer - HQ9X_LOOP_WINDOW : 0;
+		size_t last = state->bf->pointer + HQ9X_LOOP_WINDOW < state->bf->used ? state->bf->pointer + HQ9X_LOOP_WINDOW : state->bf->used;
+		key->bf_enabled = state->bf->enabled;
+		key->bf_pointer = state->bf->pointer;
+		key->bf_used = state->bf->used;
+		key->hash = hq9x_hash(key->hash, state->bf->cells + first, (last - first) * sizeof(bf_cell_t));
+	}
+	if(state->bef)
+	{
+		size_t top = state->bef->pointer < HQ9X_LOOP_WINDOW ? state->bef->pointer : HQ9X_LOOP_WINDOW;
+		key->stringmode = state->bef->stringmode;
+		key->bef_pointer = state->bef->pointer;
+		key->bef_version = state->bef->version;
+		key->hash = hq9x_hash(key->hash, state->bef->stack + state->bef->pointer - top, top * sizeof(bef_cell_t));
+	}
+	if(state->oo)
+		key->object = state->oo->current_object;
 }
 
-/* FISHQ9+, Deadfish command S/s (also k) */
-
-void hq9x_square(hq9x_state_t * state)
+static size_t hq9x_loop_cells(hq9x_state_t * state, size_t * tape)
 {
-	state->accumulator = state->accumulator * state->accumulator;
+	*tape = state->bf ? state->bf->used * sizeof(bf_cell_t) : 0;
+	return *tape + (state->bef ? state->bef->pointer * sizeof(bef_cell_t) : 0);
 }
 
-/* FISHQ9+, Deadfish command O/o (also c) */
-
-void hq9x_output(hq9x_state_t * state)
+/* called at each loop head, stops the program if it is exactly where it was before, with no I/O since */
+static void hq9x_loop_check(hq9x_state_t * state)
 {
-	printf("%d\n", state->accumulator);
-}
+	hq9x_loops_t * loops = state->loops;
+	hq9x_loop_key_t key;
+	size_t tape, size;
 
-/* FISHQ9+ command K/k; Deadfish command h */
+	if(--loops->stride)
+		return;
+	loops->stride = HQ9X_LOOP_STRIDE;
+	hq9x_loop_key(state, &key);
+	if(key.output_size != loops->saved.output_size || key.input != loops->saved.input)
+	{
+		/* it got somewhere, start over */
+		hq9x_loops_reset(loops);
+		loops->saved.output_size = key.output_size;
+		loops->saved.input = key.input;
+		return;
+	}
 
-void hq9x_kill(hq9x_state_t * state)
-{
-	exit(state->exit_with_accumulator ? state->accumulator : 0);
-}
+	size = hq9x_loop_cells(state, &tape);
+	if(loops->valid && memcmp(&key, &loops->saved, sizeof key) == 0 && size == loops->size
+	&& (!tape || memcmp(loops->cells, state->bf->cells, tape) == 0)
+	&& (size == tape || memcmp(loops->cells + tape, state->bef->stack, size - tape) == 0))
+		hq9x_exceeded(state, HQ9X_EXIT_LOOP, "Infinite loop detected");
 
-/* FISHQ9+, Deadfish operation before each statement */
+	if(++loops->count < loops->next)
+		return;
+	if(loops->capacity < size)
+	{
+		free(loops->cells);
+		loops->cells = malloc(loops->capacity = size);
+	}
+	if(tape)
+		memcpy(loops->cells, state->bf->cells, tape);
+	if(size > tape)
+		memcpy(loops->cells + tape, state->bef->stack, size - tape);
+	loops->size = size;
+	loops->saved = key;
+	loops->valid = 1;
+	loops->count = 0;
+	loops->next *= 2;
+}
 
-void hq9x_force_bound(hq9x_state_t * state)
+static void bf_loop_watched(hq9x_state_t * state)
 {
-	if(state->accumulator == -1 || state->accumulator == 256)
-		state->accumulator = 0;
+	if(state->bf->cells[state->bf->pointer])
+		hq9x_loop_check(state);
+	bf_loop(state);
 }
 
-/* CHIKRSX9+ command I */
-
-void hq9x_interpret(hq9x_state_t * state)
+static void bef_turn_watched(hq9x_state_t * state)
 {
-	source_t old;
-	char * old_input;
-	function_ptr_t old_op = state->last_op;
-
-	old = state->source;
-
-	/* store old source data, move input to source */
-	source_get_text(&state->input);
-	state->source = state->input;
-	old_input = state->input.pointer;
-	state->source.pointer = NULL;
-
-	source_init(&state->input, stdin);
-	state->last_op = NULL;
-
-	source_get_pointer(&state->source); /* ensure input is ready */
-	while(!state->source.out_of_bound)
+	hq9x_loop_check(state);
+	switch(state->opchar)
 	{
-		unsigned char op = *source_get_pointer(&state->source);
-		switch(state->charcase)
-		{
-		case 0:
-			if('A' <= op && op <= 'Z')
-				op += 'a' - 'A';
-		break;
-		case 'A':
-			if('A' <= op && op <= 'Z')
-				op += 'a' - 'A';
-			else if('a' <= op && op <= 'z')
-				op = 0;
-		break;
-		case 'a':
-		break;
-		}
-		state->opchar = op;
-		state->op = state->ops[op];
-
-		/* do any pre-operation (probably null) */
-		state->pre_op(state);
-		if(state->op)
-		{
-			state->op(state);
-			state->last_op = state->op;
-		}
-		else
-		{
-			state->op = state->default_op;
-			state->default_op(state);
-			//if(state->op)
-				state->last_op = state->op;
-		}
-		source_advance(&state->source);
+	case '<':
+		bef_left(state);
+	break;
+	case '>':
+		bef_right(state);
+	break;
+	case '^':
+		bef_up(state);
+	break;
+	case 'v':
+		bef_down(state);
+	break;
+	case '_':
+		bef_h_if(state);
+	break;
+	case '|':
+		bef_v_if(state);
+	break;
+	case '?':
+		bef_random(state);
+	break;
 	}
-
-	source_free(&state->input);
-	state->input = state->source;
-	state->input.pointer = old_input;
-	state->source = old;
-
-	state->last_op = old_op;
 }
 
-/* HQ9+B command B */
-
-void hq9x_interpret_bf(hq9x_state_t * state)
+/* the commands of the BF program B runs, shared by all the states as the nested program only ever reads them */
+static const function_ptr_t hq9x_bf_ops[256] =
+{
+	['<'] = bf_left, ['>'] = bf_right, ['+'] = bf_inc, ['-'] = bf_dec,
+	['['] = bf_do, [']'] = bf_loop, ['.'] = bf_write, [','] = bf_read,
+};
+static const function_ptr_t hq9x_bf_ops_watched[256] =
 {
-	function_ptr_t old_ops[256];
-	function_ptr_t old_pre_op, old_default_op;
+	['<'] = bf_left, ['>'] = bf_right, ['+'] = bf_inc, ['-'] = bf_dec,
+	['['] = bf_do, [']'] = bf_loop_watched, ['.'] = bf_write, [','] = bf_read,
+};
 
-	memcpy(old_ops, state->ops, sizeof(old_ops));
-	memset(state->ops, 0, sizeof(old_ops));
-	state->ops['<'] = bf_left;
-	state->ops['>'] = bf_right;
-	state->ops['+'] = bf_inc;
-	state->ops['-'] = bf_dec;
-	state->ops['['] = bf_do;
-	state->ops[']'] = bf_loop;
-	state->ops['.'] = bf_write;
-	state->ops[','] = bf_read;
-	bf_init(state);
-	state->bf->enabled = 1;
+/* puts the checks in front of the loop heads, so that nothing else pays for them */
+static void hq9x_watch_loops(hq9x_state_t * state)
+{
+	const char * turns = "<>^v_|?";
+	if(!state->loops)
+		state->loops = clear_alloc(sizeof(hq9x_loops_t));
+	hq9x_loops_reset(state->loops);
+	if(state->ops[']'] == bf_loop)
+		state->ops[']'] = bf_loop_watched;
+	if(state->dispatch == hq9x_bf_ops)
+		state->dispatch = hq9x_bf_ops_watched;
+	for(; *turns; turns++)
+	{
+		function_ptr_t op = state->ops[(unsigned char)*turns];
+		if(op == bef_left || op == bef_right || op == bef_up || op == bef_down
+		|| op == bef_h_if || op == bef_v_if || op == bef_random)
+			state->ops[(unsigned char)*turns] = bef_turn_watched;
+	}
+}
 
-	old_pre_op = state->pre_op;
-	state->pre_op = hq9x_nop;
+static void hq9x_loops_free(hq9x_loops_t * loops)
+{
+	if(loops)
+	{
+		free(loops->cells);
+		free(loops);
+	}
+}
 
-	old_default_op = state->default_op;
-	state->default_op = hq9x_nop;
+/* Profiler */
 
-	hq9x_interpret(state);
+#define HQ9X_PROFILE_SAMPLE 64 /* steps per cycle count sample, on average */
+#define HQ9X_PROFILE_TOP 10 /* entries of each ranking */
+#define HQ9X_SAMPLE_RATE 997 /* stack samples per second by default, off the beat of periodic work */
 
+/* a sampled guest stack, as a line of the folded format without the count */
+typedef struct hq9x_stack
+{
+	char * frames; /* NULL if unused */
+	uint64_t hash;
+	unsigned long long count;
+} hq9x_stack_t;
 
-	memcpy(state->ops, old_ops, sizeof(old_ops));
-	memset(state->ops, 0, sizeof(old_ops));
+/* a program around the current one */
+typedef struct hq9x_level
+{
+	const source_t * source;
+	const function_ptr_t * ops;
+} hq9x_level_t;
 
-	state->pre_op = old_pre_op;
+/* a position in the outermost program */
+typedef struct hq9x_profile_cell
+{
+	uint64_t key; /* line + 1 and column in a grid, or offset + 1 in the text, 0 if unused */
+	unsigned long long count, cycles, samples;
+	unsigned char op;
+} hq9x_profile_cell_t;
 
-	state->default_op = old_default_op;
+typedef struct hq9x_profile
+{
+	int cycles; /* sample the cycles taken as well */
+	unsigned sample; /* steps until the next sample */
+	unsigned long random; /* the intervals vary, not to keep hitting the same command of a loop */
+	unsigned long long counts[256], op_cycles[256], op_samples[256]; /* by command character */
+	hq9x_profile_cell_t * cells; /* open addressing by key */
+	size_t cell_count, capacity;
+	char * text; /* the outermost program, to find its loops */
+
+	/* guest stacks sampled on SIGPROF, see hq9x_profile_folded */
+	int rate; /* samples per second of processor time, 0 if not sampling */
+	hq9x_stack_t * stacks; /* open addressing by hash */
+	size_t stack_count, stack_capacity;
+	char * stack; /* the one being built */
+	size_t stack_size, stack_limit;
+	size_t * loops; /* enclosing [ of one program, innermost first */
+	size_t loop_limit;
+	hq9x_level_t * levels; /* programs around the current one, innermost first */
+	size_t level_limit;
+} hq9x_profile_t;
+
+/* the timer is shared by the whole process, the first profiled state to notice takes the sample */
+static volatile sig_atomic_t hq9x_sample_due = 0;
+static int hq9x_samplers = 0;
+
+static void hq9x_sample_signal(int signum)
+{
+	hq9x_sample_due = 1;
 }
 
-/* CHIKRSX9+ command C */
+static void hq9x_sampler_start(int rate)
+{
+	struct sigaction action;
+	struct itimerval timer;
+	if(__sync_fetch_and_add(&hq9x_samplers, 1) != 0)
+		return;
+	memset(&action, 0, sizeof action);
+	action.sa_handler = hq9x_sample_signal;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGPROF, &action, NULL);
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = rate < 1000000 ? 1000000 / rate : 1;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, NULL);
+}
 
-void hq9x_copy(hq9x_state_t * state)
+static void hq9x_sampler_stop(void)
 {
-	printf("%s", source_get_text(&state->input));
+	struct itimerval timer;
+	if(__sync_sub_and_fetch(&hq9x_samplers, 1) != 0)
+		return;
+	memset(&timer, 0, sizeof timer);
+	setitimer(ITIMER_PROF, &timer, NULL);
 }
 
-/* CHIKRSX9+ command R */
+static hq9x_profile_t * hq9x_profile_create(int cycles, int rate)
+{
+	hq9x_profile_t * profile = clear_alloc(sizeof(hq9x_profile_t));
+	profile->cycles = cycles;
+	profile->sample = HQ9X_PROFILE_SAMPLE;
+	profile->rate = rate;
+	if(rate > 0)
+		hq9x_sampler_start(rate);
+	return profile;
+}
 
-void hq9x_rot13(hq9x_state_t * state)
+static void hq9x_profile_free(hq9x_profile_t * profile)
 {
-	char * pointer = source_get_text(&state->input);
-	while(*pointer)
+	size_t i;
+	if(profile)
 	{
-		int c = *pointer++;
-		if(('A' <= c && c <= 'M') || ('a' <= c && c <= 'm'))
-			c += 13;
-		else if(('N' <= c && c <= 'Z') || ('n' <= c && c <= 'z'))
-			c -= 13;
-		putchar(c);
+		if(profile->rate > 0)
+			hq9x_sampler_stop();
+		for(i = 0; i < profile->stack_capacity; i++)
+			free(profile->stacks[i].frames);
+		free(profile->stacks);
+		free(profile->stack);
+		free(profile->loops);
+		free(profile->levels);
+		free(profile->cells);
+		free(profile->text);
+		free(profile);
 	}
 }
 
-static int strpcmp(const void * first, const void * second)
+/* positions are only kept for one program, counts for the commands across all runs */
+static void hq9x_profile_program(hq9x_profile_t * profile, const char * text)
 {
-	return strcmp(*(const char **)first, *(const char **)second);
+	if(profile->text && strcmp(profile->text, text) == 0)
+		return;
+	free(profile->text);
+	profile->text = strdup(text);
+	free(profile->cells);
+	profile->cells = NULL;
+	profile->cell_count = profile->capacity = 0;
 }
 
-/* CHIKRSX9+ command S */
+static size_t hq9x_profile_slot(hq9x_profile_cell_t * cells, size_t capacity, uint64_t key)
+{
+	size_t i = (key * 0x9E3779B97F4A7C15ULL >> 32) & (capacity - 1);
+	while(cells[i].key && cells[i].key != key)
+		i = (i + 1) & (capacity - 1);
+	return i;
+}
 
-void hq9x_sort(hq9x_state_t * state)
+static hq9x_profile_cell_t * hq9x_profile_cell(hq9x_profile_t * profile, uint64_t key)
 {
-	char ** arr = source_get_lines(&state->input);
-	size_t counter;
-	qsort(arr, state->input.count, sizeof(char *), strpcmp);
-	for(counter = 0; arr[counter]; counter++)
+	size_t i;
+	if(2 * (profile->cell_count + 1) > profile->capacity)
+	{
+		size_t capacity = profile->capacity ? 2 * profile->capacity : 1024;
+		hq9x_profile_cell_t * cells = clear_alloc(capacity * sizeof(hq9x_profile_cell_t));
+		for(i = 0; i < profile->capacity; i++)
+			if(profile->cells[i].key)
+				cells[hq9x_profile_slot(cells, capacity, profile->cells[i].key)] = profile->cells[i];
+		free(profile->cells);
+		profile->cells = cells;
+		profile->capacity = capacity;
+	}
+	i = hq9x_profile_slot(profile->cells, profile->capacity, key);
+	if(!profile->cells[i].key)
 	{
-		printf("%s\n", arr[counter]);
+		profile->cells[i].key = key;
+		profile->cell_count++;
 	}
+	return &profile->cells[i];
 }
 
-/* CHIKRSX9+ command X - implemented differently from reference implementation, parsing BF commands until next X */
+/* counts the command about to run, returns where it is, and the cycle counter if it is sampled */
+static hq9x_profile_cell_t * hq9x_profile_begin(hq9x_state_t * state, unsigned char op, uint64_t * start)
+{
+	hq9x_profile_t * profile = state->profile;
+	hq9x_profile_cell_t * cell = NULL;
+	source_t * source = &state->source;
 
-void hq9x_turing(hq9x_state_t * state)
+	profile->counts[op]++;
+	if(!state->frame->parent && profile->text)
+	{
+		if(source->lines && source->line)
+			cell = hq9x_profile_cell(profile, (uint64_t)(source->line - source->lines + 1) << 32 | (uint32_t)(source->pointer - *source->line));
+		else
+			cell = hq9x_profile_cell(profile, source->pointer - source->text + 1);
+		cell->count++;
+		cell->op = op;
+	}
+	*start = 0;
+	if(profile->cycles && --profile->sample == 0)
+	{
+		profile->random = profile->random * 1103515245 + 12345;
+		profile->sample = HQ9X_PROFILE_SAMPLE / 2 + ((profile->random >> 16) % HQ9X_PROFILE_SAMPLE);
+		*start = hq9x_cycles();
+	}
+	return cell;
+}
+
+static void hq9x_profile_end(hq9x_state_t * state, unsigned char op, hq9x_profile_cell_t * cell, uint64_t start)
 {
-	state->bf->enabled = !state->bf->enabled;
+	hq9x_profile_t * profile = state->profile;
+	uint64_t cycles;
+	if(!start)
+		return;
+	cycles = hq9x_cycles() - start;
+	profile->op_cycles[op] += cycles;
+	profile->op_samples[op]++;
+	if(cell)
+	{
+		cell->cycles += cycles;
+		cell->samples++;
+	}
 }
 
-/* CHIKRSX9+ command X subcommands */
+/* a command that did not get to run after all */
+static void hq9x_profile_undo(hq9x_state_t * state, unsigned char op, hq9x_profile_cell_t * cell)
+{
+	state->profile->counts[op]--;
+	if(cell)
+		cell->count--;
+}
 
-static void hq9x_pre_alter_bf(hq9x_state_t * state)
+/* Guest stack sampling */
+
+static void hq9x_stack_append(hq9x_profile_t * profile, const char * format, ...)
 {
-	if(state->bf && state->bf->enabled)
+	char frame[64];
+	va_list args;
+	int size;
+	va_start(args, format);
+	size = vsnprintf(frame, sizeof frame, format, args);
+	va_end(args);
+	if(size < 0)
+		return;
+	if(size >= (int)sizeof frame)
+		size = sizeof frame - 1;
+	if(profile->stack_size + size + 2 > profile->stack_limit)
 	{
-		switch(state->opchar)
-		{
-		case '<':
-			state->op = bf_left;
-		break;
-		case '>':
-			state->op = bf_right;
-		break;
-		case '+':
-			state->op = bf_inc;
-		break;
-		case '-':
-			state->op = bf_dec;
-		break;
-		case '[':
-			state->op = bf_do;
-		break;
-		case ']':
-			state->op = bf_loop;
-		break;
-		case ',':
-			state->op = bf_read;
-		break;
-		case '.':
-			state->op = bf_write;
-		break;
-		}
+		profile->stack_limit = 2 * (profile->stack_size + size + 2);
+		profile->stack = realloc(profile->stack, profile->stack_limit);
 	}
+	if(profile->stack_size)
+		profile->stack[profile->stack_size++] = ';';
+	memcpy(profile->stack + profile->stack_size, frame, size + 1);
+	profile->stack_size += size;
 }
 
-/* Object orientation */
+/* a command, as it appears in a frame name, where ; and spaces would split it */
+static void hq9x_stack_command(hq9x_profile_t * profile, const source_t * source, unsigned char op)
+{
+	char name[8];
+	if(isgraph(op) && op != ';')
+		snprintf(name, sizeof name, "%c", op);
+	else
+		snprintf(name, sizeof name, "0x%02X", op);
+	if(source->lines && source->line && source->pointer)
+		hq9x_stack_append(profile, "%s@%u,%u", name, (unsigned)(source->pointer - *source->line), (unsigned)(source->line - source->lines));
+	else if(source->lines)
+		hq9x_stack_append(profile, "%s", name);
+	else
+		hq9x_stack_append(profile, "%s@%zu", name, source->pointer ? (size_t)(source->pointer - source->text) : 0);
+}
 
-static void hq9x_destroy_object(hq9x_object_t * object, hq9x_state_t * state)
+/* the [ around the position in a freeform BF program, outermost first */
+static void hq9x_stack_loops(hq9x_profile_t * profile, const source_t * source)
 {
-	if(object != (hq9x_object_t *)&state->oo->meta_class && object != (hq9x_object_t *)&state->oo->generic_class)
-		free(object);
+	size_t count = 0, depth = 0, i;
+	if(source->lines || !source->pointer || !source->text)
+		return;
+	for(i = source->pointer - source->text; i-- > 0; )
+	{
+		if(source->text[i] == ']')
+		{
+			if(source->jumps && source->jumps[i] >= 0 && (size_t)source->jumps[i] < i)
+				i = source->jumps[i]; /* a loop closed before the position */
+			else
+				depth++;
+		}
+		else if(source->text[i] == '[')
+		{
+			if(depth > 0)
+			{
+				depth--;
+				continue;
+			}
+			if(count == profile->loop_limit)
+			{
+				profile->loop_limit = profile->loop_limit ? 2 * profile->loop_limit : 64;
+				profile->loops = realloc(profile->loops, profile->loop_limit * sizeof(size_t));
+			}
+			profile->loops[count++] = i;
+		}
+	}
+	while(count > 0)
+		hq9x_stack_append(profile, "[@%zu", profile->loops[--count]);
 }
 
-static void hq9x_raise_exception(hq9x_object_t * object, hq9x_state_t * state)
+static int hq9x_stack_bf(const function_ptr_t * ops)
 {
-	fprintf(stderr, "Unhandled virtual exception\n");
-	exit(1);
+	return ops[']'] == bf_loop || ops[']'] == bf_loop_watched;
 }
 
-static void hq9x_oo_init(hq9x_state_t * state)
+/* records where the guest program is: the nested programs started by I or B, */
+/* the BF loops in each, and the command about to run */
+static void hq9x_profile_sample(hq9x_state_t * state, unsigned char op)
 {
-	if(!state->oo)
+	hq9x_profile_t * profile = state->profile;
+	hq9x_frame_t * frame;
+	const function_ptr_t * ops = state->dispatch;
+	hq9x_stack_t * stack;
+	uint64_t hash;
+	size_t count = 0, i;
+
+	hq9x_sample_due = 0;
+	profile->stack_size = 0;
+	/* each frame but the outermost holds the program around the one it started */
+	/* with the commands it restores, or else the same as the one it started */
+	for(frame = state->frame; frame->parent; frame = frame->parent)
 	{
-		state->oo = clear_alloc(sizeof(hq9x_oo_state_t));
-		state->oo->meta_class.isa = &state->oo->meta_class;
-		state->oo->meta_class.superclass = &state->oo->generic_class;
-		state->oo->meta_class.destroy = hq9x_destroy_object;
-		state->oo->meta_class.exception = hq9x_raise_exception;
-		state->oo->generic_class.isa = &state->oo->meta_class;
-		state->oo->generic_class.superclass = &state->oo->generic_class;
-		state->oo->generic_class.destroy = hq9x_destroy_object;
-		state->oo->generic_class.exception = hq9x_raise_exception;
+		if(count == profile->level_limit)
+		{
+			profile->level_limit = profile->level_limit ? 2 * profile->level_limit : 16;
+			profile->levels = realloc(profile->levels, profile->level_limit * sizeof(hq9x_level_t));
+		}
+		if(frame->dispatch)
+			ops = frame->dispatch;
+		profile->levels[count].source = &frame->source;
+		profile->levels[count].ops = ops;
+		count++;
 	}
-	if(state->oo->current_object)
+	while(count > 0)
 	{
-		state->oo->current_object->isa->destroy(state->oo->current_object, state);
-		state->oo->current_object = NULL;
+		const source_t * source = profile->levels[--count].source;
+		if(hq9x_stack_bf(profile->levels[count].ops))
+			hq9x_stack_loops(profile, source);
+		hq9x_stack_command(profile, source, source->pointer ? (unsigned char)*source->pointer : 0);
 	}
-	if(state->oo->current_class)
+	if(hq9x_stack_bf(state->dispatch))
+		hq9x_stack_loops(profile, &state->source);
+	hq9x_stack_command(profile, &state->source, op);
+
+	if(2 * (profile->stack_count + 1) > profile->stack_capacity)
 	{
-		state->oo->current_class->isa->destroy((hq9x_object_t *)state->oo->current_class, state);
-		state->oo->current_class = NULL;
+		size_t capacity = profile->stack_capacity ? 2 * profile->stack_capacity : 256;
+		hq9x_stack_t * stacks = clear_alloc(capacity * sizeof(hq9x_stack_t));
+		for(i = 0; i < profile->stack_capacity; i++)
+		{
+			size_t j;
+			if(!profile->stacks[i].frames)
+				continue;
+			for(j = profile->stacks[i].hash & (capacity - 1); stacks[j].frames; j = (j + 1) & (capacity - 1))
+				;
+			stacks[j] = profile->stacks[i];
+		}
+		free(profile->stacks);
+		profile->stacks = stacks;
+		profile->stack_capacity = capacity;
 	}
+	hash = hq9x_hash(0, profile->stack, profile->stack_size);
+	for(i = hash & (profile->stack_capacity - 1); (stack = &profile->stacks[i])->frames; i = (i + 1) & (profile->stack_capacity - 1))
+		if(stack->hash == hash && strcmp(stack->frames, profile->stack) == 0)
+			break;
+	if(!stack->frames)
+	{
+		stack->frames = strdup(profile->stack);
+		stack->hash = hash;
+		profile->stack_count++;
+	}
+	stack->count++;
 }
 
-static hq9x_class_t * hq9x_new_class(hq9x_state_t * state)
+typedef struct hq9x_ranked
 {
-	hq9x_class_t * new_class = clear_alloc(sizeof(hq9x_class_t));
-	new_class->isa = &state->oo->meta_class;
-	new_class->superclass = &state->oo->generic_class;
-	new_class->destroy = hq9x_destroy_object;
-	new_class->exception = hq9x_raise_exception;
-	return new_class;
-}
-
-static hq9x_object_t * hq9x_new_object(hq9x_object_t * class_object, hq9x_state_t * state)
+	double weight;
+	unsigned long long count;
+	double cycles; /* per execution, 0 if not sampled */
+	uint64_t key;
+	unsigned char op;
+} hq9x_ranked_t;
+
+static int hq9x_ranked_compare(const void * first, const void * second)
 {
-	hq9x_object_t * new_object = clear_alloc(sizeof(hq9x_object_t));
-	new_object->isa = (hq9x_class_t *)class_object;
-	return new_object;
+	const hq9x_ranked_t * a = first, * b = second;
+	return a->weight < b->weight ? 1 : a->weight > b->weight ? -1 : 0;
 }
 
-static void hq9x_new(hq9x_state_t * state)
+static void hq9x_report(hq9x_write_t output, void * user, const char * format, ...)
 {
-	hq9x_oo_init(state);
-	state->oo->current_class = hq9x_new_class(state);
-	state->oo->current_object = hq9x_new_object((hq9x_object_t *)state->oo->current_class, state);
+	char line[512];
+	va_list args;
+	int size;
+	va_start(args, format);
+	size = vsnprintf(line, sizeof line, format, args);
+	va_end(args);
+	if(size > 0)
+		output(user, line, size < sizeof line ? size : sizeof line - 1);
 }
 
-/* HQ9++ command + and ++ */
-
-void hq9x_inc_or_alloc(hq9x_state_t * state)
+static void hq9x_report_op(hq9x_write_t output, void * user, unsigned char op)
 {
-	if(state->last_op != hq9x_inc)
-		state->op = hq9x_inc, hq9x_inc(state);
+	if(isgraph(op))
+		hq9x_report(output, user, "  '%c'\n", op);
 	else
-		state->op = hq9x_new, hq9x_new(state);
-}
-
-static void hq9x_io_error(hq9x_state_t * state)
-{
-	/* TODO */
-}
-
-static void hq9x_divide_by_zero(hq9x_state_t * state)
-{
-	state->accumulator -= state->accumulator;
-	state->accumulator = 1 / state->accumulator;
+		hq9x_report(output, user, "  0x%02X\n", op);
 }
 
-static void hq9x_out_of_stack(hq9x_state_t * state)
+/* per execution, blank if not sampled */
+static void hq9x_report_cycles(hq9x_write_t output, void * user, hq9x_profile_t * profile, double cycles)
 {
-	hq9x_out_of_stack(state);
-	hq9x_out_of_stack(state); /* to assure no optimization is done */
+	if(profile->cycles && cycles)
+		hq9x_report(output, user, "%12.1f", cycles);
+	else
+		hq9x_report(output, user, "%12s", profile->cycles ? "-" : "");
 }
 
-static void hq9x_infinite_loop(hq9x_state_t * state)
+/* ranked by the cycles estimated from the samples, or by the counts without them */
+/* entries never sampled are estimated with the average of all the samples */
+static void hq9x_rank(hq9x_ranked_t * entries, size_t count, double average)
 {
-	while(1);
+	size_t i;
+	for(i = 0; i < count; i++)
+		entries[i].weight = average ? (entries[i].cycles ? entries[i].cycles : average) * entries[i].count : entries[i].count;
+	qsort(entries, count, sizeof(hq9x_ranked_t), hq9x_ranked_compare);
 }
 
-/* HQ9+- command - */
-
-void hq9x_quality_control(hq9x_state_t * state)
+void hq9x_profile_report(const hq9x_state_t * state, hq9x_write_t output, void * user)
 {
-	if(state->bf && state->bf->enabled)
+	hq9x_profile_t * profile = state->profile;
+	hq9x_ranked_t * entries;
+	unsigned long long total = 0, cycles = 0, samples = 0, * counts;
+	double average;
+	size_t i, count = 0, size;
+	const char * unit = profile && profile->cycles ? "cycles" : "";
+
+#if !defined(__x86_64__) && !defined(__i386__)
+	unit = profile && profile->cycles ? "ns" : "";
+#endif
+	if(!profile)
+		return;
+	for(i = 0; i < 256; i++)
 	{
-		/* if BF commands are switched on, override "quality control" */
-		state->last_op = bf_dec;
-		bf_dec(state);
+		total += profile->counts[i];
+		cycles += profile->op_cycles[i];
+		samples += profile->op_samples[i];
+	}
+	average = samples ? (double)cycles / samples : 0;
+	hq9x_report(output, user, "Profile: %llu steps\n", total);
+	if(total == 0)
 		return;
+
+	entries = clear_alloc((profile->capacity > 256 ? profile->capacity : 256) * sizeof(hq9x_ranked_t));
+	for(i = 0; i < 256; i++)
+	{
+		if(!profile->counts[i])
+			continue;
+		entries[count].count = profile->counts[i];
+		entries[count].cycles = profile->op_samples[i] ? (double)profile->op_cycles[i] / profile->op_samples[i] : 0;
+		entries[count].op = i;
+		count++;
+	}
+	hq9x_rank(entries, count, average);
+	hq9x_report(output, user, "Commands:\n%14s %7s %12s  command\n", "count", "%", unit);
+	for(i = 0; i < count; i++)
+	{
+		hq9x_report(output, user, "%14llu %6.2f%% ", entries[i].count, 100.0 * entries[i].count / total);
+		hq9x_report_cycles(output, user, profile, entries[i].cycles);
+		hq9x_report_op(output, user, entries[i].op);
 	}
 
-	if(state->last_op == NULL)
+	/* BF loops, by the steps spent inside each, from the counts of the positions in the text */
+	size = profile->text ? strlen(profile->text) : 0;
+	counts = clear_alloc((size + 2) * sizeof(unsigned long long));
+	for(i = 0; i < profile->capacity; i++)
+		if(profile->cells[i].key && !(profile->cells[i].key >> 32) && profile->cells[i].key <= size)
+			counts[profile->cells[i].key] = profile->cells[i].count;
+	for(i = 1; i <= size + 1; i++)
+		counts[i] += counts[i - 1]; /* counts[i] is now the steps at offsets below i */
+	count = 0;
+	if(size)
 	{
-		unsigned char next = *state->source.pointer;
-		if(state->ops[next] == hq9x_quality_control)
+		size_t * stack = malloc(size * sizeof(size_t)), depth = 0;
+		for(i = 0; i < size; i++)
 		{
-			/* This is probably not how the author intended it, but this makes the most "sense" */
-			state->source.pointer ++;
-			state->op = hq9x_dec;
-			hq9x_dec(state);
+			if(profile->text[i] == '[')
+				stack[depth++] = i;
+			else if(profile->text[i] == ']' && depth > 0)
+			{
+				size_t start = stack[--depth];
+				if(counts[i + 1] == counts[start])
+					continue; /* never entered */
+				entries[count].count = counts[i + 1] - counts[start];
+				entries[count].key = start;
+				entries[count].cycles = 0;
+				count++;
+			}
 		}
-		else
+		free(stack);
+	}
+	free(counts);
+	if(count)
+	{
+		hq9x_rank(entries, count, 0);
+		hq9x_report(output, user, "Loops:\n%14s %7s  line:column of [\n", "steps inside", "%");
+		for(i = 0; i < count && i < HQ9X_PROFILE_TOP; i++)
 		{
-			if(state->on_error != ERROR_QUIET)
+			size_t line = 1, column = 1, j;
+			for(j = 0; j < entries[i].key; j++)
 			{
-				fprintf(stderr, "Syntax error\n");
-				hq9x_error_halt(state);
+				if(profile->text[j] == '\n')
+					line++, column = 1;
+				else
+					column++;
 			}
-			exit(1);
+			hq9x_report(output, user, "%14llu %6.2f%%  %zu:%zu\n", entries[i].count, 100.0 * entries[i].count / total, line, column);
 		}
 	}
-	else if(state->last_op == hq9x_hello)
+
+	/* grid cells, as in Befunge */
+	count = 0;
+	for(i = 0; i < profile->capacity; i++)
 	{
-		hq9x_io_error(state);
-		/* TODO */
-		fprintf(stderr, "I/O error\n");
-		exit(1);
+		if(!(profile->cells[i].key >> 32))
+			continue;
+		entries[count].count = profile->cells[i].count;
+		entries[count].cycles = profile->cells[i].samples ? (double)profile->cells[i].cycles / profile->cells[i].samples : 0;
+		entries[count].key = profile->cells[i].key;
+		entries[count].op = profile->cells[i].op;
+		count++;
 	}
-	else if(state->last_op == hq9x_quine)
+	if(count)
 	{
-		hq9x_out_of_stack(state);
-		/* unreachable */
-		fprintf(stderr, "Out of stack\n");
-		exit(1);
+		hq9x_rank(entries, count, average);
+		hq9x_report(output, user, "Cells:\n%14s %7s %12s  x,y command\n", "count", "%", unit);
+		for(i = 0; i < count && i < HQ9X_PROFILE_TOP; i++)
+		{
+			hq9x_report(output, user, "%14llu %6.2f%% ", entries[i].count, 100.0 * entries[i].count / total);
+			hq9x_report_cycles(output, user, profile, entries[i].cycles);
+			hq9x_report(output, user, "  %u,%u", (unsigned)(entries[i].key & 0xFFFFFFFF), (unsigned)(entries[i].key >> 32) - 1);
+			hq9x_report_op(output, user, entries[i].op);
+		}
 	}
-	else if(state->last_op == hq9x_bottles)
-	{
-		hq9x_infinite_loop(state);
-		/* unreachable */
-		fprintf(stderr, "Infinite loop\n");
-		exit(1);
+	free(entries);
+}
+
+void hq9x_profile_folded(const hq9x_state_t * state, hq9x_write_t output, void * user)
+{
+	hq9x_profile_t * profile = state->profile;
+	size_t i;
+	if(!profile)
+		return;
+	for(i = 0; i < profile->stack_capacity; i++)
+	{
+		if(!profile->stacks[i].frames)
+			continue;
+		output(user, profile->stacks[i].frames, strlen(profile->stacks[i].frames));
+		hq9x_report(output, user, " %llu\n", profile->stacks[i].count);
+	}
+}
+
+/* comment (ignored character) */
+
+void hq9x_nop(hq9x_state_t * state)
+{
+}
+
+/* syntax error */
+
+void hq9x_unknown(hq9x_state_t * state)
+{
+	if(state->on_error != ERROR_QUIET)
+	{
+		state->nondeterministic = 1; /* diagnostics are not part of the cached result */
+		fprintf(stderr, "Unknown command: `%c'\n", state->opchar);
+		hq9x_error_halt(state);
+	}
+}
+
+/* add newline, FISHQ9+ unknown command */
+
+void hq9x_newline(hq9x_state_t * state)
+{
+	hq9x_putchar(state, '\n');
+}
+
+/* HQ9+ command H */
+
+void hq9x_hello(hq9x_state_t * state)
+{
+	hq9x_printf(state, "%s\n", state->options.hello_message);
+}
+
+/* HQ9+ command Q */
+
+void hq9x_quine(hq9x_state_t * state)
+{
+	hq9x_write(state, state->source.text, strlen(state->source.text));
+}
+
+/* HQ9+ command 9 */
+
+void hq9x_bottles(hq9x_state_t * state)
+{
+	int i;
+	for(i = 99; i > 0; i--)
+	{
+		hq9x_printf(state, "%d bottle%s of beer on the wall,\n", i, i == 1 ? "" : "s");
+		hq9x_printf(state, "%d bottle%s of beer.\n", i, i == 1 ? "" : "s");
+		hq9x_printf(state, "Take one down, pass it around,\n");
+		if(i != 1)
+			hq9x_printf(state, "%d bottle%s of beer on the wall.\n", i - 1, i == 2 ? "" : "s");
+		else
+			hq9x_printf(state, "No bottles of beer on the wall.\n");
+	}
+}
+
+/* HQ9+ command +; FISHQ9+, Deadfish command I (also X) */
+
+void hq9x_inc(hq9x_state_t * state)
+{
+	state->accumulator ++;
+}
+
+/* HQ9+- command --; FISHQ9+ command D/d */
+
+void hq9x_dec(hq9x_state_t * state)
+{
+	state->accumulator --;
+}
+
+/* FISHQ9+, Deadfish command S/s (also k) */
+
+void hq9x_square(hq9x_state_t * state)
+{
+	state->accumulator = state->accumulator * state->accumulator;
+}
+
+/* FISHQ9+, Deadfish command O/o (also c) */
+
+void hq9x_output(hq9x_state_t * state)
+{
+	hq9x_printf(state, "%d\n", state->accumulator);
+}
+
+/* FISHQ9+ command K/k; Deadfish command h */
+
+void hq9x_kill(hq9x_state_t * state)
+{
+	hq9x_halt(state, state->exit_with_accumulator ? state->accumulator : 0);
+}
+
+/* FISHQ9+, Deadfish operation before each statement */
+
+void hq9x_force_bound(hq9x_state_t * state)
+{
+	if(state->accumulator == -1 || state->accumulator == 256)
+		state->accumulator = 0;
+}
+
+/* restores the outer program, also used to unwind after a halt */
+static void hq9x_leave(hq9x_state_t * state)
+{
+	hq9x_frame_t * frame = state->frame;
+
+	source_free(&state->input);
+	state->input = state->source;
+	state->input.pointer = frame->input_pointer;
+	source_retag(&state->input, HQ9X_MEMORY_INPUT);
+	state->source = frame->source;
+
+	if(frame->dispatch)
+	{
+		state->dispatch = frame->dispatch;
+		state->pre_op = frame->pre_op;
+		state->default_op = frame->default_op;
+	}
+
+	state->last_op = frame->last_op;
+	state->frame = frame->parent;
+	hq9x_free(HQ9X_MEMORY_FRAMES, frame);
+}
+
+/* starts running the input as a nested program, hq9x_step continues with the outer one once it ends */
+static hq9x_frame_t * hq9x_enter(hq9x_state_t * state)
+{
+	/* kept on the heap so that it can still be unwound after a halt */
+	hq9x_frame_t * frame = hq9x_clear_alloc(HQ9X_MEMORY_FRAMES, sizeof(hq9x_frame_t));
+
+	frame->source = state->source;
+	frame->op = state->op;
+	frame->last_op = state->last_op;
+	frame->parent = state->frame;
+	state->frame = frame;
+
+	/* store old source data, move input to source, the text is not copied */
+	source_get_text(&state->input);
+	state->source = state->input;
+	source_retag(&state->source, HQ9X_MEMORY_TEXT);
+	frame->input_pointer = state->input.pointer;
+	state->source.pointer = NULL;
+	/* a nested program, the opcode stream and jump table stay with the text when it goes back to being the input, */
+	/* for a later I or B on it; one that ran to its end stays ended, and a grid is left as it is */
+	if(frame->parent && !state->source.out_of_bound && !state->source.lines && !state->source.ops && !state->options.naive)
+		source_compile(&state->source, state->charcase);
+
+	source_init(&state->input, state->read, state->user);
+	state->last_op = NULL;
+	return frame;
+}
+
+/* the inner loop of hq9x_step, specialized with and without the profiler */
+static HQ9X_INLINE int hq9x_run_until(hq9x_state_t * state, unsigned long long stop, const int profiled)
+{
+	while(state->steps < stop)
+	{
+		hq9x_frame_t * frame = state->frame;
+		hq9x_profile_cell_t * cell = NULL;
+		uint64_t start = 0;
+		unsigned char op;
+
+		if(state->source.out_of_bound)
+		{
+			function_ptr_t entered_by = frame->op;
+			hq9x_leave(state);
+			if(!state->frame)
+			{
+				state->status = state->exit_with_accumulator ? state->accumulator : 0;
+				return HQ9X_FINISHED;
+			}
+			/* the command that started the nested program is complete now */
+			state->last_op = entered_by;
+			source_advance(&state->source);
+			continue;
+		}
+
+		if(state->hold == HOLD_RESUME)
+			op = state->opchar;
+		else if(state->source.ops && !state->source.lines)
+			op = state->source.ops[source_get_pointer(&state->source) - state->source.text];
+		else
+			op = source_fold(state->charcase, *source_get_pointer(&state->source));
+		if(profiled)
+		{
+			if(hq9x_sample_due && state->profile->rate)
+				hq9x_profile_sample(state, op);
+			cell = hq9x_profile_begin(state, op, &start);
+		}
+
+		if(state->hold == HOLD_RESUME)
+		{
+			/* a blocked command is retried as it was dispatched, its pre-operation has already run */
+			state->hold = HOLD_NONE;
+		}
+		else
+		{
+			state->opchar = op;
+			state->op = state->dispatch[op];
+			/* do any pre-operation (probably null) */
+			state->pre_op(state);
+			if(!state->op)
+				state->op = state->default_op;
+		}
+		state->op(state);
+		state->steps++;
+		if(profiled)
+			hq9x_profile_end(state, op, cell, start);
+
+		if(state->frame != frame)
+			continue; /* entered a nested program */
+		if(state->hold)
+		{
+			if(state->hold == HOLD_BLOCKED)
+			{
+				/* the command has not run, it is retried when the scheduler resumes the program */
+				state->hold = HOLD_RESUME;
+				state->steps--;
+				if(profiled)
+					hq9x_profile_undo(state, op, cell);
+				return HQ9X_BLOCKED;
+			}
+			state->hold = HOLD_NONE;
+			state->last_op = state->op;
+			continue;
+		}
+		state->last_op = state->op;
+		source_advance(&state->source);
+	}
+	return HQ9X_RUNNING;
+}
+
+/* runs at most steps commands, yielding when the budget is used up or the input would block */
+int hq9x_step(hq9x_state_t * state, unsigned long steps)
+{
+	unsigned long long limit = state->steps + steps;
+
+	if(limit < state->steps)
+		limit = ULLONG_MAX;
+	if(!state->frame)
+		return HQ9X_FINISHED;
+	if(setjmp(state->halt) != 0)
+	{
+		while(state->frame)
+			hq9x_leave(state);
+		return HQ9X_FINISHED;
+	}
+
+	while(state->steps < limit)
+	{
+		/* the limits are only looked at every so many steps, never in between */
+		unsigned long long stop = limit < state->check_at ? limit : state->check_at;
+		int result = state->profile ? hq9x_run_until(state, stop, 1) : hq9x_run_until(state, stop, 0);
+
+		if(result != HQ9X_RUNNING)
+			return result;
+		if(state->steps >= state->check_at)
+			hq9x_check_budget(state);
+	}
+	return HQ9X_RUNNING;
+}
+
+/* CHIKRSX9+ command I */
+
+void hq9x_interpret(hq9x_state_t * state)
+{
+	if(!hq9x_input_ready(state))
+		return;
+	hq9x_enter(state);
+}
+
+/* HQ9+B command B */
+
+void hq9x_interpret_bf(hq9x_state_t * state)
+{
+	hq9x_frame_t * frame;
+
+	if(!hq9x_input_ready(state))
+		return;
+	bf_init(state);
+	state->bf->enabled = 1;
+
+	/* the table, pre-operation and default are put back when the nested program ends */
+	frame = hq9x_enter(state);
+	frame->dispatch = state->dispatch;
+	frame->pre_op = state->pre_op;
+	frame->default_op = state->default_op;
+	state->dispatch = state->loops ? hq9x_bf_ops_watched : hq9x_bf_ops;
+	state->pre_op = hq9x_nop;
+	state->default_op = hq9x_nop;
+}
+
+/* CHIKRSX9+ command C */
+
+void hq9x_copy(hq9x_state_t * state)
+{
+	char * text;
+	if(!hq9x_input_ready(state))
+		return;
+	text = source_get_text(&state->input);
+	hq9x_write(state, text, strlen(text));
+}
+
+/* CHIKRSX9+ command R */
+
+#define HQ9X_ROT13_PARALLEL ((size_t)4 << 20) /* bytes below which R stays on one thread */
+#define HQ9X_ROT13_THREADS 8
+#define HQ9X_ROT13_BLOCK 65536 /* bytes written at a time when the result is not kept */
+
+static void hq9x_rot13_scalar(const char * from, char * to, size_t size)
+{
+	size_t i;
+	for(i = 0; i < size; i++)
+	{
+		int c = from[i];
+		if(('A' <= c && c <= 'M') || ('a' <= c && c <= 'm'))
+			c += 13;
+		else if(('N' <= c && c <= 'Z') || ('n' <= c && c <= 'z'))
+			c -= 13;
+		to[i] = c;
+	}
+}
+
+/* letters folded to lower case, then moved up 13 for a to m and down 13 for n to z, without branches */
+#if defined(__SSE2__)
+static size_t hq9x_rot13_sse2(const char * from, char * to, size_t size)
+{
+	const __m128i case_bit = _mm_set1_epi8(0x20), thirteen = _mm_set1_epi8(13);
+	const __m128i before_a = _mm_set1_epi8('a' - 1), after_m = _mm_set1_epi8('m' + 1);
+	const __m128i before_n = _mm_set1_epi8('n' - 1), after_z = _mm_set1_epi8('z' + 1);
+	size_t i;
+	for(i = 0; i + 16 <= size; i += 16)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *)(from + i));
+		__m128i lower = _mm_or_si128(c, case_bit);
+		__m128i up = _mm_and_si128(_mm_cmpgt_epi8(lower, before_a), _mm_cmpgt_epi8(after_m, lower));
+		__m128i down = _mm_and_si128(_mm_cmpgt_epi8(lower, before_n), _mm_cmpgt_epi8(after_z, lower));
+		c = _mm_add_epi8(c, _mm_and_si128(up, thirteen));
+		c = _mm_sub_epi8(c, _mm_and_si128(down, thirteen));
+		_mm_storeu_si128((__m128i *)(to + i), c);
+	}
+	return i;
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HQ9X_ROT13_AVX2 1
+__attribute__((target("avx2")))
+static size_t hq9x_rot13_avx2(const char * from, char * to, size_t size)
+{
+	const __m256i case_bit = _mm256_set1_epi8(0x20), thirteen = _mm256_set1_epi8(13);
+	const __m256i before_a = _mm256_set1_epi8('a' - 1), after_m = _mm256_set1_epi8('m' + 1);
+	const __m256i before_n = _mm256_set1_epi8('n' - 1), after_z = _mm256_set1_epi8('z' + 1);
+	size_t i;
+	for(i = 0; i + 32 <= size; i += 32)
+	{
+		__m256i c = _mm256_loadu_si256((const __m256i *)(from + i));
+		__m256i lower = _mm256_or_si256(c, case_bit);
+		__m256i up = _mm256_and_si256(_mm256_cmpgt_epi8(lower, before_a), _mm256_cmpgt_epi8(after_m, lower));
+		__m256i down = _mm256_and_si256(_mm256_cmpgt_epi8(lower, before_n), _mm256_cmpgt_epi8(after_z, lower));
+		c = _mm256_add_epi8(c, _mm256_and_si256(up, thirteen));
+		c = _mm256_sub_epi8(c, _mm256_and_si256(down, thirteen));
+		_mm256_storeu_si256((__m256i *)(to + i), c);
+	}
+	return i;
+}
+#endif
+
+/* the widest kernel the processor has, the scalar loop for what is left */
+static void hq9x_rot13_block(const char * from, char * to, size_t size)
+{
+	size_t done = 0;
+#ifdef HQ9X_ROT13_AVX2
+	if(__builtin_cpu_supports("avx2"))
+		done = hq9x_rot13_avx2(from, to, size);
+#endif
+#if defined(__SSE2__)
+	done += hq9x_rot13_sse2(from + done, to + done, size - done);
+#endif
+	hq9x_rot13_scalar(from + done, to + done, size - done);
+}
+
+typedef struct hq9x_rot13_task
+{
+	const char * from;
+	char * to;
+	size_t size;
+} hq9x_rot13_task_t;
+
+static void * hq9x_rot13_run(void * argument)
+{
+	hq9x_rot13_task_t * task = argument;
+	hq9x_rot13_block(task->from, task->to, task->size);
+	return NULL;
+}
+
+/* large inputs are split into one slice for each thread */
+static void hq9x_rot13_text(const char * from, char * to, size_t size)
+{
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = processors < 1 ? 1 : processors < HQ9X_ROT13_THREADS ? processors : HQ9X_ROT13_THREADS, i;
+	hq9x_rot13_task_t tasks[HQ9X_ROT13_THREADS];
+	pthread_t workers[HQ9X_ROT13_THREADS];
+	int started[HQ9X_ROT13_THREADS] = { 0 };
+	size_t slice;
+
+	if(size < HQ9X_ROT13_PARALLEL || threads == 1)
+	{
+		hq9x_rot13_block(from, to, size);
+		return;
+	}
+	slice = (size / threads + 63) & ~(size_t)63;
+	for(i = 0; i < threads; i++)
+	{
+		size_t start = i * slice < size ? i * slice : size;
+		tasks[i].from = from + start;
+		tasks[i].to = to + start;
+		tasks[i].size = (size - start < slice ? size - start : slice);
+		if(i > 0)
+			started[i] = pthread_create(&workers[i], NULL, hq9x_rot13_run, &tasks[i]) == 0;
+	}
+	hq9x_rot13_run(&tasks[0]);
+	for(i = 1; i < threads; i++)
+	{
+		if(started[i])
+			pthread_join(workers[i], NULL);
+		else
+			hq9x_rot13_run(&tasks[i]);
+	}
+}
+
+void hq9x_rot13(hq9x_state_t * state)
+{
+	source_t * input = &state->input;
+	const char * text;
+	size_t size;
+
+	if(!hq9x_input_ready(state))
+		return;
+	text = source_get_text(input);
+	size = strlen(text);
+
+	/* the text of the input does not change once read, its transformed copy is kept for the next R */
+	if(!input->rot13)
+	{
+		if(state->options.max_memory)
+		{
+			size_t used = hq9x_heap_size(state);
+			if(used > state->options.max_memory || size > state->options.max_memory - used)
+			{
+				char block[HQ9X_ROT13_BLOCK];
+				size_t offset, count;
+				for(offset = 0; offset < size; offset += count)
+				{
+					count = size - offset < sizeof block ? size - offset : sizeof block;
+					hq9x_rot13_block(text + offset, block, count);
+					hq9x_write(state, block, count);
+				}
+				return;
+			}
+		}
+		input->rot13 = hq9x_malloc(HQ9X_MEMORY_INPUT, size + 1);
+		hq9x_rot13_text(text, input->rot13, size);
+	}
+	hq9x_write(state, input->rot13, size);
+}
+
+/* CHIKRSX9+ command S */
+
+#define HQ9X_SORT_PARALLEL 65536 /* lines below which a sort stays on one thread */
+#define HQ9X_SORT_THREADS 8
+#define HQ9X_SORT_RUN 4096 /* fewest lines of a run sorted in memory when spilling */
+
+/* a line by its offset in the text, with its first bytes in front to compare most lines without the text */
+typedef struct hq9x_line_key
+{
+	uint64_t prefix; /* big endian, padded with zeros after the end of the line */
+	size_t offset;
+} hq9x_line_key_t;
+
+static hq9x_line_key_t hq9x_line_key(const char * text, size_t offset)
+{
+	hq9x_line_key_t key = { 0, offset };
+	unsigned char c = 1;
+	int i;
+	for(i = 0; i < 8; i++)
+	{
+		if(c && ((c = text[offset + i]) == '\n'))
+			c = 0;
+		key.prefix = key.prefix << 8 | c;
+	}
+	return key;
+}
+
+/* compares as strcmp would compare the lines cut out of the text */
+static int hq9x_line_compare(const char * text, size_t first, size_t second)
+{
+	const unsigned char * a = (const unsigned char *)text + first, * b = (const unsigned char *)text + second;
+	while(*a == *b && *a != '\n' && *a)
+		a++, b++;
+	return (*a == '\n' ? 0 : *a) - (*b == '\n' ? 0 : *b);
+}
+
+static int hq9x_key_compare(const char * text, const hq9x_line_key_t * first, const hq9x_line_key_t * second)
+{
+	if(first->prefix != second->prefix)
+		return first->prefix < second->prefix ? -1 : 1;
+	if((first->prefix & 0xFF) == 0)
+		return 0; /* both lines end within the prefix */
+	return hq9x_line_compare(text, first->offset + 8, second->offset + 8);
+}
+
+static void hq9x_key_merge(const char * text, hq9x_line_key_t * keys, size_t middle, size_t count, hq9x_line_key_t * temp)
+{
+	size_t i = 0, j = middle, k = 0;
+	while(i < middle && j < count)
+		temp[k++] = hq9x_key_compare(text, &keys[j], &keys[i]) < 0 ? keys[j++] : keys[i++];
+	while(i < middle)
+		temp[k++] = keys[i++];
+	while(j < count)
+		temp[k++] = keys[j++];
+	memcpy(keys, temp, count * sizeof(hq9x_line_key_t));
+}
+
+typedef struct hq9x_sort_task
+{
+	const char * text;
+	hq9x_line_key_t * keys, * temp;
+	size_t count;
+	int threads;
+} hq9x_sort_task_t;
+
+static void * hq9x_sort_run(void * argument);
+
+/* a merge sort, the halves sorted on threads of their own while there are threads left */
+static void hq9x_sort_keys(const char * text, hq9x_line_key_t * keys, hq9x_line_key_t * temp, size_t count, int threads)
+{
+	size_t middle = count / 2, i, j;
+
+	if(count <= 16)
+	{
+		for(i = 1; i < count; i++)
+		{
+			hq9x_line_key_t key = keys[i];
+			for(j = i; j > 0 && hq9x_key_compare(text, &key, &keys[j - 1]) < 0; j--)
+				keys[j] = keys[j - 1];
+			keys[j] = key;
+		}
+		return;
+	}
+
+	if(threads > 1 && count >= HQ9X_SORT_PARALLEL)
+	{
+		hq9x_sort_task_t task = { text, keys, temp, middle, threads / 2 };
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, hq9x_sort_run, &task) == 0)
+		{
+			hq9x_sort_keys(text, keys + middle, temp + middle, count - middle, threads - threads / 2);
+			pthread_join(thread, NULL);
+		}
+		else
+		{
+			hq9x_sort_keys(text, keys, temp, middle, 1);
+			hq9x_sort_keys(text, keys + middle, temp + middle, count - middle, 1);
+		}
+	}
+	else
+	{
+		hq9x_sort_keys(text, keys, temp, middle, 1);
+		hq9x_sort_keys(text, keys + middle, temp + middle, count - middle, 1);
+	}
+	if(hq9x_key_compare(text, &keys[middle], &keys[middle - 1]) < 0)
+		hq9x_key_merge(text, keys, middle, count, temp);
+}
+
+static void * hq9x_sort_run(void * argument)
+{
+	hq9x_sort_task_t * task = argument;
+	hq9x_sort_keys(task->text, task->keys, task->temp, task->count, task->threads);
+	return NULL;
+}
+
+/* sorts the lines starting at the given offsets, in place */
+static void hq9x_sort_offsets(const char * text, size_t * offsets, size_t count)
+{
+	hq9x_line_key_t * keys = malloc(count * sizeof(hq9x_line_key_t));
+	hq9x_line_key_t * temp = malloc(count * sizeof(hq9x_line_key_t));
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t i;
+
+	for(i = 0; i < count; i++)
+		keys[i] = hq9x_line_key(text, offsets[i]);
+	hq9x_sort_keys(text, keys, temp, count, processors < 1 ? 1 : processors < HQ9X_SORT_THREADS ? processors : HQ9X_SORT_THREADS);
+	for(i = 0; i < count; i++)
+		offsets[i] = keys[i].offset;
+	free(temp);
+	free(keys);
+}
+
+static void hq9x_write_line(hq9x_state_t * state, const char * text, size_t size, size_t offset)
+{
+	const char * end = memchr(text + offset, '\n', size - offset);
+	if(end)
+		hq9x_write(state, text + offset, end - text - offset + 1);
+	else
+	{
+		hq9x_write(state, text + offset, size - offset);
+		hq9x_putchar(state, '\n');
+	}
+}
+
+/* bytes hq9x_write_line writes for the line at offset */
+static size_t hq9x_line_size(const char * text, size_t size, size_t offset)
+{
+	const char * end = memchr(text + offset, '\n', size - offset);
+	return (end ? (size_t)(end - text) : size) - offset + 1;
+}
+
+/* above the memory limit the offsets are sorted in runs that fit, spilled to temporary files, then merged */
+/* the files are closed before anything can halt the run, if they cannot be used the run stops as over the limit */
+static void hq9x_sort_external(hq9x_state_t * state, const char * text, size_t size, size_t count, size_t run)
+{
+	size_t * offsets = malloc(run * sizeof(size_t));
+	size_t runs = (count + run - 1) / run, line = 0, offset = 0, i;
+	FILE ** files = calloc(runs, sizeof(FILE *));
+	size_t * heads = malloc(runs * sizeof(size_t)), * heap = malloc(runs * sizeof(size_t)), length = 0;
+	size_t max_output = state->options.max_output, last = 0;
+	int failed = 0, limited = 0;
+
+	if(!offsets || !files || !heads || !heap)
+	{
+		failed = 1;
+		goto out;
+	}
+	for(i = 0; i < runs; i++)
+	{
+		size_t n = 0;
+		for(; n < run && line < count; n++, line++)
+		{
+			offsets[n] = offset;
+			offset += strcspn(text + offset, "\n") + 1;
+		}
+		hq9x_sort_offsets(text, offsets, n);
+		if(!(files[i] = tmpfile()) || fwrite(offsets, sizeof(size_t), n, files[i]) != n || fseek(files[i], 0, SEEK_SET) != 0)
+		{
+			failed = 1;
+			goto out;
+		}
+	}
+
+	/* a binary heap of the runs, by the line each is at */
+	for(i = 0; i < runs; i++)
+	{
+		size_t j = length++;
+		if(fread(&heads[i], sizeof(size_t), 1, files[i]) != 1)
+		{
+			failed = 1;
+			goto out;
+		}
+		while(j > 0 && hq9x_line_compare(text, heads[i], heads[heap[(j - 1) / 2]]) < 0)
+		{
+			heap[j] = heap[(j - 1) / 2];
+			j = (j - 1) / 2;
+		}
+		heap[j] = i;
+	}
+	while(length > 0)
+	{
+		size_t top = heap[0], j = 0;
+		/* the line that passes the output limit is written once the files are closed */
+		if(max_output && hq9x_line_size(text, size, heads[top]) > max_output - state->output_size)
+		{
+			last = heads[top];
+			limited = 1;
+			goto out;
+		}
+		hq9x_write_line(state, text, size, heads[top]);
+		if(fread(&heads[top], sizeof(size_t), 1, files[top]) != 1)
+		{
+			if(ferror(files[top]))
+			{
+				failed = 1;
+				goto out;
+			}
+			top = heap[--length];
+		}
+		while(2 * j + 1 < length)
+		{
+			size_t child = 2 * j + 1;
+			if(child + 1 < length && hq9x_line_compare(text, heads[heap[child + 1]], heads[heap[child]]) < 0)
+				child++;
+			if(hq9x_line_compare(text, heads[heap[child]], heads[top]) >= 0)
+				break;
+			heap[j] = heap[child];
+			j = child;
+		}
+		if(length > 0)
+			heap[j] = top;
+	}
+
+out:
+	if(files)
+	{
+		for(i = 0; i < runs; i++)
+			if(files[i])
+				fclose(files[i]);
+	}
+	free(files);
+	free(heap);
+	free(heads);
+	free(offsets);
+	if(failed)
+		hq9x_exceeded(state, HQ9X_EXIT_MEMORY, "Unable to spill the sort to a temporary file");
+	if(limited)
+		hq9x_write_line(state, text, size, last);
+}
+
+void hq9x_sort(hq9x_state_t * state)
+{
+	source_t * input = &state->input;
+	const char * text;
+	size_t size, count = 1, i, offset;
+
+	if(!hq9x_input_ready(state))
+		return;
+	text = source_get_text(input);
+	size = strlen(text);
+
+	/* the text of the input does not change once read, the order of its lines is kept for the next S */
+	if(!input->sorted)
+	{
+		size_t needed;
+		for(i = 0; i < size; i++)
+			if(text[i] == '\n')
+				count++;
+		needed = count * (2 * sizeof(hq9x_line_key_t) + sizeof(size_t));
+		if(state->options.max_memory)
+		{
+			size_t used = hq9x_heap_size(state);
+			size_t left = used < state->options.max_memory ? state->options.max_memory - used : 0;
+			if(needed > left)
+			{
+				size_t run = left / (2 * sizeof(hq9x_line_key_t) + sizeof(size_t));
+				hq9x_sort_external(state, text, size, count, run < HQ9X_SORT_RUN ? HQ9X_SORT_RUN : run);
+				return;
+			}
+		}
+		input->sorted = hq9x_malloc(HQ9X_MEMORY_LINES, count * sizeof(size_t));
+		for(i = 0, offset = 0; i < count; i++)
+		{
+			input->sorted[i] = offset;
+			offset += strcspn(text + offset, "\n") + 1;
+		}
+		hq9x_sort_offsets(text, input->sorted, count);
+		input->sorted_count = count;
+	}
+	for(i = 0; i < input->sorted_count; i++)
+		hq9x_write_line(state, text, size, input->sorted[i]);
+}
+
+/* CHIKRSX9+ command X - implemented differently from reference implementation, parsing BF commands until next X */
+
+void hq9x_turing(hq9x_state_t * state)
+{
+	state->bf->enabled = !state->bf->enabled;
+}
+
+/* CHIKRSX9+ command X subcommands */
+
+static void hq9x_pre_alter_bf(hq9x_state_t * state)
+{
+	if(state->bf && state->bf->enabled)
+	{
+		switch(state->opchar)
+		{
+		case '<':
+			state->op = bf_left;
+		break;
+		case '>':
+			state->op = bf_right;
+		break;
+		case '+':
+			state->op = bf_inc;
+		break;
+		case '-':
+			state->op = bf_dec;
+		break;
+		case '[':
+			state->op = bf_do;
+		break;
+		case ']':
+			state->op = state->loops ? bf_loop_watched : bf_loop;
+		break;
+		case ',':
+			state->op = bf_read;
+		break;
+		case '.':
+			state->op = bf_write;
+		break;
+		}
+	}
+}
+
+/* Object orientation */
+
+static void hq9x_destroy_object(hq9x_object_t * object, hq9x_state_t * state)
+{
+	if(object != (hq9x_object_t *)&state->oo->meta_class && object != (hq9x_object_t *)&state->oo->generic_class)
+		hq9x_free(HQ9X_MEMORY_OBJECTS, object);
+}
+
+static void hq9x_raise_exception(hq9x_object_t * object, hq9x_state_t * state)
+{
+	fprintf(stderr, "Unhandled virtual exception\n");
+	hq9x_halt(state, 1);
+}
+
+static void hq9x_oo_init(hq9x_state_t * state)
+{
+	if(!state->oo)
+	{
+		state->oo = hq9x_clear_alloc(HQ9X_MEMORY_OBJECTS, sizeof(hq9x_oo_state_t));
+		state->oo->meta_class.isa = &state->oo->meta_class;
+		state->oo->meta_class.superclass = &state->oo->generic_class;
+		state->oo->meta_class.destroy = hq9x_destroy_object;
+		state->oo->meta_class.exception = hq9x_raise_exception;
+		state->oo->generic_class.isa = &state->oo->meta_class;
+		state->oo->generic_class.superclass = &state->oo->generic_class;
+		state->oo->generic_class.destroy = hq9x_destroy_object;
+		state->oo->generic_class.exception = hq9x_raise_exception;
+	}
+	if(state->oo->current_object)
+	{
+		state->oo->current_object->isa->destroy(state->oo->current_object, state);
+		state->oo->current_object = NULL;
+	}
+	if(state->oo->current_class)
+	{
+		state->oo->current_class->isa->destroy((hq9x_object_t *)state->oo->current_class, state);
+		state->oo->current_class = NULL;
+	}
+}
+
+static void hq9x_oo_clear(hq9x_state_t * state)
+{
+	if(state->oo)
+	{
+		hq9x_oo_init(state);
+		hq9x_free(HQ9X_MEMORY_OBJECTS, state->oo);
+		state->oo = NULL;
+	}
+}
+
+static hq9x_class_t * hq9x_new_class(hq9x_state_t * state)
+{
+	hq9x_class_t * new_class = hq9x_clear_alloc(HQ9X_MEMORY_OBJECTS, sizeof(hq9x_class_t));
+	new_class->isa = &state->oo->meta_class;
+	new_class->superclass = &state->oo->generic_class;
+	new_class->destroy = hq9x_destroy_object;
+	new_class->exception = hq9x_raise_exception;
+	return new_class;
+}
+
+static hq9x_object_t * hq9x_new_object(hq9x_object_t * class_object, hq9x_state_t * state)
+{
+	hq9x_object_t * new_object = hq9x_clear_alloc(HQ9X_MEMORY_OBJECTS, sizeof(hq9x_object_t));
+	new_object->isa = (hq9x_class_t *)class_object;
+	return new_object;
+}
+
+static void hq9x_new(hq9x_state_t * state)
+{
+	hq9x_oo_init(state);
+	state->oo->current_class = hq9x_new_class(state);
+	state->oo->current_object = hq9x_new_object((hq9x_object_t *)state->oo->current_class, state);
+}
+
+/* HQ9++ command + and ++ */
+
+void hq9x_inc_or_alloc(hq9x_state_t * state)
+{
+	if(state->last_op != hq9x_inc)
+		state->op = hq9x_inc, hq9x_inc(state);
+	else
+		state->op = hq9x_new, hq9x_new(state);
+}
+
+static void hq9x_io_error(hq9x_state_t * state)
+{
+	/* TODO */
+}
+
+static void hq9x_divide_by_zero(hq9x_state_t * state)
+{
+	state->accumulator -= state->accumulator;
+	state->accumulator = 1 / state->accumulator;
+}
+
+#define HQ9X_STACK_DEPTH 10000
+#define HQ9X_STACK_FRAME 128 /* about what each level takes, counted against the memory limit */
+
+static void hq9x_recurse(int depth, int limit)
+{
+	volatile char frame[64];
+	frame[0] = depth;
+	if(depth < limit)
+		hq9x_recurse(depth + 1, limit);
+	frame[1] = frame[0]; /* to assure no optimization is done */
+}
+
+/* recurses as deep as it may, rather than until the real stack overflows */
+static void hq9x_out_of_stack(hq9x_state_t * state)
+{
+	int limit = HQ9X_STACK_DEPTH;
+	if(state->options.max_memory)
+	{
+		size_t used = hq9x_heap_size(state);
+		size_t left = used < state->options.max_memory ? state->options.max_memory - used : 0;
+		if(left / HQ9X_STACK_FRAME < limit)
+		{
+			hq9x_recurse(0, left / HQ9X_STACK_FRAME);
+			hq9x_exceeded(state, HQ9X_EXIT_MEMORY, "Memory limit exceeded");
+		}
+	}
+	hq9x_recurse(0, limit);
+}
+
+/* repeats the current command forever, one step at a time so that hq9x_step can still yield */
+static void hq9x_infinite_loop(hq9x_state_t * state)
+{
+	state->op = hq9x_bottles;
+	state->hold = HOLD_AGAIN;
+}
+
+/* HQ9+- command - */
+
+void hq9x_quality_control(hq9x_state_t * state)
+{
+	if(state->bf && state->bf->enabled)
+	{
+		/* if BF commands are switched on, override "quality control" */
+		state->last_op = bf_dec;
+		bf_dec(state);
+		return;
+	}
+
+	if(state->last_op == NULL)
+	{
+		unsigned char next = *state->source.pointer;
+		if(state->ops[next] == hq9x_quality_control)
+		{
+			/* This is probably not how the author intended it, but this makes the most "sense" */
+			state->source.pointer ++;
+			state->op = hq9x_dec;
+			hq9x_dec(state);
+		}
+		else
+		{
+			if(state->on_error != ERROR_QUIET)
+			{
+				fprintf(stderr, "Syntax error\n");
+				hq9x_error_halt(state);
+			}
+			hq9x_halt(state, 1);
+		}
+	}
+	else if(state->last_op == hq9x_hello)
+	{
+		hq9x_io_error(state);
+		/* TODO */
+		fprintf(stderr, "I/O error\n");
+		hq9x_halt(state, 1);
+	}
+	else if(state->last_op == hq9x_quine)
+	{
+		hq9x_out_of_stack(state);
+		fprintf(stderr, "Out of stack\n");
+		hq9x_halt(state, 1);
+	}
+	else if(state->last_op == hq9x_bottles)
+	{
+		hq9x_infinite_loop(state);
+	}
+	else if(state->last_op == hq9x_inc)
+	{
+		hq9x_divide_by_zero(state);
+		/* unreachable */
+		fprintf(stderr, "Division by zero\n");
+		hq9x_halt(state, 1);
+	}
+	else if(state->last_op == hq9x_new)
+	{
+		state->oo->current_object->isa->exception(state->oo->current_object, state);
+		/* unreachable */
+		fprintf(stderr, "Unhandled virtual exception\n");
+		hq9x_halt(state, 1);
+	}
+	else
+	{
+		fprintf(stderr, "Unknown error, please contact the author of the software\n");
+		hq9x_halt(state, 1);
+	}
+}
+
+/* Deep Though API */
+
+static void * dt_init(void)
+{
+	return malloc(sizeof(long));
+}
+
+static void dt_process(void * state)
+{
+	*(long *)state = 42;
+}
+
+static void dt_log(void * state, hq9x_state_t * output)
+{
+	hq9x_printf(output, "%ld\n", *(long *)state);
+}
+
+static void dt_free(void * state)
+{
+	free(state);
+}
+
+/* H9F DT operator */
+
+/* TODO: the interpreter should probably consider two-character operators, as this cannot be combined with any other preprocessed dialect */
+
+static void hq9x_dt_d(hq9x_state_t * state)
+{
+}
+
+void hq9x_dt_invoke(hq9x_state_t * state)
+{
+	void * dt_state = dt_init();
+	dt_process(dt_state);
+	dt_log(dt_state, state);
+	dt_free(dt_state);
+}
+
+/* H9F preprocessor operator */
+
+static void hq9x_check_dt(hq9x_state_t * state)
+{
+	if(state->last_op == hq9x_dt_d)
+	{
+		if(state->opchar == 't')
+		{
+			state->op = hq9x_dt_invoke;
+		}
+		else
+		{
+			int tmp = state->opchar;
+			state->opchar = 'd';
+			hq9x_unknown(state);
+			state->opchar = tmp;
+		}
+	}
+}
+
+/* initialization */
+
+static void hq9x_initialize_bf(hq9x_state_t * state)
+{
+	state->ops['<'] = bf_left;
+	state->ops['>'] = bf_right;
+	state->ops['+'] = bf_inc;
+	state->ops['-'] = bf_dec;
+	state->ops['['] = bf_do;
+	state->ops[']'] = bf_loop;
+	state->ops['.'] = bf_write;
+	state->ops[','] = bf_read;
+	bf_init(state);
+	state->bf->enabled = 1;
+}
+
+void hq9x_initialize(hq9x_state_t * state, int version)
+{
+	state->dialect = version;
+	state->ops['\0'] = hq9x_nop; /* end of file */
+	switch(version)
+	{
+	case HQ9X_DEFAULT:
+		state->ops['k'] = hq9x_kill;
+	case HQ9X_CHIQRSX9X:
+		state->ops['c'] = hq9x_copy;
+		state->ops['i'] = hq9x_interpret;
+		state->ops['r'] = hq9x_rot13;
+		state->ops['s'] = hq9x_sort;
+		state->ops['x'] = hq9x_turing;
+
+	/* Turing-completeness is enabled through BF-parsing */
+		bf_init(state);
+		state->bf->enabled = 0;
+	/* fallthru; */
+	case HQ9X_ORIGINAL:
+	case HQ9X_OO:
+	case HQ9X_HQ9XBF:
+	case HQ9X_H9F:
+	default:
+		state->ops['q'] = hq9x_quine;
+	case HQ9X_H9X:
+		state->ops['h'] = hq9x_hello;
+		state->ops['9'] = hq9x_bottles;
+	case HQ9X_PLUS:
+		state->ops['+'] = hq9x_inc;
+	case HQ9X_NIL:
+	break;
+
+	case HQ9X_FISHQ9X:
+		state->ops['h'] = hq9x_hello;
+		state->ops['q'] = hq9x_quine;
+		state->ops['9'] = hq9x_bottles;
+		state->ops['+'] = hq9x_inc;
+	case HQ9X_DEADFISH:
+		state->ops['i'] = hq9x_inc;
+		state->ops['d'] = hq9x_dec;
+		state->ops['s'] = hq9x_square;
+		state->ops['o'] = hq9x_output;
+	break;
+
+	case HQ9X_BRAINF:
+		hq9x_initialize_bf(state);
+	break;
+
+	case HQ9X_BEFUNGE93:
+		state->ops['+'] = bef_add;
+		state->ops['-'] = bef_sub;
+		state->ops['*'] = bef_mul;
+		state->ops['/'] = bef_div;
+		state->ops['%'] = bef_mod;
+		state->ops['!'] = bef_not;
+		state->ops['`'] = bef_greater;
+		state->ops['>'] = bef_right;
+		state->ops['<'] = bef_left;
+		state->ops['^'] = bef_up;
+		state->ops['v'] = bef_down;
+		state->ops['?'] = bef_random;
+		state->ops['_'] = bef_h_if;
+		state->ops['|'] = bef_v_if;
+		state->ops['"'] = bef_string;
+		state->ops[':'] = bef_dup;
+		state->ops['\\'] = bef_swap;
+		state->ops['$'] = bef_drop;
+		state->ops['.'] = bef_print_int;
+		state->ops[','] = bef_print_char;
+		state->ops['#'] = bef_bridge;
+		state->ops['g'] = bef_get;
+		state->ops['p'] = bef_put;
+		state->ops['&'] = bef_scan_int;
+		state->ops['~'] = bef_scan_char;
+		state->ops['@'] = hq9x_kill;
+		state->ops['0'] = bef_push_digit;
+		state->ops['1'] = bef_push_digit;
+		state->ops['2'] = bef_push_digit;
+		state->ops['3'] = bef_push_digit;
+		state->ops['4'] = bef_push_digit;
+		state->ops['5'] = bef_push_digit;
+		state->ops['6'] = bef_push_digit;
+		state->ops['7'] = bef_push_digit;
+		state->ops['8'] = bef_push_digit;
+		state->ops['9'] = bef_push_digit;
+		state->ops[' '] = hq9x_nop;
+		bef_init(state);
+		state->bef->enabled = 1;
+	break;
+	}
+
+	if(version == HQ9X_H9F)
+	{
+		hq9x_initialize_bf(state);
+		state->ops['d'] = hq9x_dt_d;
+	}
+	if(version == HQ9X_DEFAULT || version == HQ9X_OO || version == HQ9X_OO_QC)
+		state->ops['+'] = hq9x_inc_or_alloc;
+	if(version == HQ9X_DEFAULT || version == HQ9X_OO_QC)
+		state->ops['-'] = hq9x_quality_control;
+	if(version == HQ9X_DEFAULT || version == HQ9X_HQ9XBF)
+		state->ops['b'] = hq9x_interpret_bf;
+	if(version == HQ9X_DEFAULT || version == HQ9X_2D)
+	{
+		state->ops['<'] = bef_left;
+		state->ops['>'] = bef_right;
+		state->ops['v'] = bef_down;
+		state->ops['^'] = bef_up;
+	}
+
+	if(version == HQ9X_DEADFISH || version == HQ9X_FISHQ9X)
+		state->pre_op = hq9x_force_bound;
+	else if(version == HQ9X_DEFAULT || version == HQ9X_CHIQRSX9X)
+		state->pre_op = hq9x_pre_alter_bf;
+	else if(version == HQ9X_BEFUNGE93)
+		state->pre_op = bef_preprocess;
+	else if(version == HQ9X_H9F)
+		state->pre_op = hq9x_check_dt;
+	else
+		state->pre_op = hq9x_nop;
+
+	switch(version)
+	{
+	case HQ9X_ORIGINAL:
+	case HQ9X_CHIQRSX9X:
+	case HQ9X_OO:
+	case HQ9X_HQ9XBF:
+	case HQ9X_H9F:
+	case HQ9X_BEFUNGE93: /* it is treated so in the reference implementation */
+		state->default_op = hq9x_unknown;
+		state->on_error = ERROR_HALT;
+	break;
+
+	case HQ9X_DEFAULT:
+	case HQ9X_BRAINF:
+	case HQ9X_OO_QC:
+	case HQ9X_FISHQ9X:
+	case HQ9X_H9X:
+	case HQ9X_PLUS:
+	case HQ9X_NIL:
+	default:
+		//state->default_op = hq9x_nop;
+		state->default_op = hq9x_unknown;
+		state->on_error = ERROR_QUIET;
+	break;
+
+	case HQ9X_DEADFISH:
+		state->default_op = hq9x_newline;
+	break;
+	}
+
+	switch(version)
+	{
+	case HQ9X_ORIGINAL:
+	//case HQ9X_OO:
+	case HQ9X_DEADFISH:
+	case HQ9X_BEFUNGE93: /* it is treated so in the reference implementation */
+		state->charcase = 'a';
+	break;
+
+	case HQ9X_OO_QC:
+	case HQ9X_CHIQRSX9X:
+	case HQ9X_DEFAULT:
+	case HQ9X_FISHQ9X:
+	//case HQ9X_BRAINF:
+	//case HQ9X_HQ9:
+	//case HQ9X_HQ9XBF:
+	//case HQ9X_PLUS:
+	//case HQ9X_NIL:
+	default:
+		state->charcase = 0;
+	break;
+
+	case HQ9X_H9F: /* this is what the default implementation does */
+		state->charcase = 'A';
+	break;
+	}
+}
+
+/* Compiled program cache */
+
+#define HQ9X_CACHE_MAGIC "EHQIPRG"
+#define HQ9X_CACHE_VERSION 2 /* bumped with every change to the entry layout or to what programs output */
+#define HQ9X_CACHE_SUFFIX ".ehqic"
+#define HQ9X_RESULT_MAGIC "EHQIRES"
+#define HQ9X_RESULT_SUFFIX ".ehqir"
+#define HQ9X_CACHE_LIMIT ((size_t)64 << 20)
+#define HQ9X_CACHE_USAGE ".usage" /* running total of the entry sizes, shared by every run using the directory */
+
+typedef struct hq9x_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t dialect;
+	uint64_t key;
+	uint64_t file_size;
+	uint64_t text_offset, text_size;
+	uint64_t ops_offset;
+	uint64_t jumps_offset;
+	uint64_t rows_offset, row_count; /* row offsets of the grid, if the program is laid out as one */
+} hq9x_cache_header_t;
+
+static uint64_t hq9x_hash(uint64_t hash, const void * data, size_t size)
+{
+	const unsigned char * bytes = data;
+	while(size-- > 0)
+	{
+		hash ^= *bytes++;
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+/* the key covers everything that influences the preprocessed form */
+static uint64_t hq9x_cache_key(source_t * source, int dialect, const char * settings)
+{
+	uint32_t version = HQ9X_CACHE_VERSION, dialect32 = dialect;
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	hash = hq9x_hash(hash, &version, sizeof version);
+	hash = hq9x_hash(hash, &dialect32, sizeof dialect32);
+	hash = hq9x_hash(hash, settings, strlen(settings) + 1);
+	return hq9x_hash(hash, source->text, source->size);
+}
+
+static void hq9x_cache_path(hq9x_cache_t * cache, uint64_t key, const char * suffix, char * path, size_t size)
+{
+	snprintf(path, size, "%s/%016llx%s", cache->directory, (unsigned long long)key, suffix);
+}
+
+static size_t hq9x_cache_align(size_t offset)
+{
+	return (offset + 7) & ~(size_t)7;
+}
+
+/* true if count items of unit bytes at offset lie inside a file of size bytes, without overflowing */
+static int hq9x_cache_fits(uint64_t offset, uint64_t count, uint64_t unit, uint64_t size)
+{
+	return offset <= size && count <= (size - offset) / unit;
+}
+
+/* everything an entry points to is checked before it is used, a damaged entry is treated as stale */
+static int hq9x_cache_load(hq9x_cache_t * cache, source_t * source, uint64_t key, int dialect)
+{
+	char path[4096];
+	struct stat st;
+	hq9x_cache_header_t * header;
+	const int32_t * jumps;
+	const uint64_t * rows;
+	char * base;
+	int fd, damaged = 0;
+	uint64_t i;
+
+	hq9x_cache_path(cache, key, HQ9X_CACHE_SUFFIX, path, sizeof path);
+	if((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+	if(fstat(fd, &st) == -1 || st.st_size < sizeof(hq9x_cache_header_t))
+	{
+		close(fd);
+		unlink(path);
+		return 0;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if(base == MAP_FAILED)
+	{
+		close(fd);
+		return 0;
+	}
+	header = (hq9x_cache_header_t *)base;
+	if(memcmp(header->magic, HQ9X_CACHE_MAGIC, sizeof header->magic) != 0
+	|| header->version != HQ9X_CACHE_VERSION
+	|| header->file_size != st.st_size
+	|| header->text_size >= st.st_size
+	|| !hq9x_cache_fits(header->text_offset, header->text_size + 1, 1, st.st_size)
+	|| !hq9x_cache_fits(header->ops_offset, header->text_size + 1, 1, st.st_size)
+	|| !hq9x_cache_fits(header->jumps_offset, header->text_size + 1, sizeof(int32_t), st.st_size)
+	|| !hq9x_cache_fits(header->rows_offset, header->row_count, sizeof(uint64_t), st.st_size)
+	|| header->jumps_offset % sizeof(int32_t) != 0 || header->rows_offset % sizeof(uint64_t) != 0)
+	{
+		/* stale format or truncated file */
+		munmap(base, st.st_size);
+		close(fd);
+		unlink(path);
+		return 0;
+	}
+	if(header->key != key || header->dialect != dialect || header->text_size != source->size
+	|| memcmp(base + header->text_offset, source->text, source->size + 1) != 0)
+	{
+		/* a hash collision, leave the entry to its own program */
+		munmap(base, st.st_size);
+		close(fd);
+		return 0;
+	}
+
+	/* a bracket jumps within the text, any other command has no jump, and each row is a string inside the file */
+	jumps = (const int32_t *)(base + header->jumps_offset);
+	rows = (const uint64_t *)(base + header->rows_offset);
+	for(i = 0; i <= header->text_size && !damaged; i++)
+	{
+		int bracket = source->text[i] == '[' || source->text[i] == ']';
+		damaged = jumps[i] < (bracket ? 0 : -1) || jumps[i] > (int64_t)header->text_size;
+	}
+	for(i = 0; i < header->row_count && !damaged; i++)
+		damaged = rows[i] >= st.st_size || !memchr(base + rows[i], '\0', st.st_size - rows[i]);
+	if(damaged)
+	{
+		munmap(base, st.st_size);
+		close(fd);
+		unlink(path);
+		return 0;
+	}
+
+	/* mark the entry as recently used, for eviction */
+	futimens(fd, NULL);
+	close(fd);
+
+	hq9x_free(source->memory, source->text);
+	source->map = base;
+	source->map_size = st.st_size;
+	source->text = base + header->text_offset;
+	source->ops = (unsigned char *)base + header->ops_offset;
+	source->jumps = (int32_t *)(base + header->jumps_offset);
+	if(header->row_count)
+	{
+		source->lines = hq9x_malloc(HQ9X_MEMORY_LINES, (header->row_count + 1) * sizeof(char *));
+		source->widths = hq9x_malloc(HQ9X_MEMORY_LINES, (header->row_count + 1) * sizeof(size_t));
+		for(i = 0; i < header->row_count; i++)
+		{
+			source->lines[i] = base + rows[i];
+			source->widths[i] = strlen(source->lines[i]);
+		}
+		source->lines[header->row_count] = NULL;
+		source->count = header->row_count;
+		source->line = &source->lines[0];
+	}
+	return 1;
+}
+
+typedef struct hq9x_cache_entry
+{
+	char * path;
+	size_t size;
+	struct timespec used;
+} hq9x_cache_entry_t;
+
+static int hq9x_cache_entry_compare(const void * first, const void * second)
+{
+	const struct timespec * a = &((const hq9x_cache_entry_t *)first)->used;
+	const struct timespec * b = &((const hq9x_cache_entry_t *)second)->used;
+	if(a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	return a->tv_nsec < b->tv_nsec ? -1 : a->tv_nsec > b->tv_nsec ? 1 : 0;
+}
+
+/* adds change to the running total of the entries, or sets it to change, and returns it */
+/* -1 if it is not known, because the directory was never scanned or the file cannot be used */
+static long long hq9x_cache_usage(hq9x_cache_t * cache, long long change, int set)
+{
+	char path[4096];
+	long long total = -1;
+	int fd;
+
+	snprintf(path, sizeof path, "%s/%s", cache->directory, HQ9X_CACHE_USAGE);
+	if((fd = open(path, O_RDWR | O_CREAT, 0666)) == -1)
+		return -1;
+	/* the lock goes with the descriptor, it keeps concurrent runs from losing each other's changes */
+	flock(fd, LOCK_EX);
+	if(set)
+		total = change;
+	else if(pread(fd, &total, sizeof total, 0) == sizeof total && total >= 0)
+		total += change;
+	else
+		total = -1;
+	if(total >= 0 && pwrite(fd, &total, sizeof total, 0) != sizeof total)
+		total = -1;
+	close(fd);
+	return total;
+}
+
+/* removes the least recently used entries until the cache fits into its limit */
+static void hq9x_cache_evict(hq9x_cache_t * cache)
+{
+	DIR * dir;
+	struct dirent * dirent;
+	struct stat st;
+	hq9x_cache_entry_t * entries = NULL;
+	size_t count = 0, capacity = 0, total = 0, i;
+	char path[4096];
+
+	if(!(dir = opendir(cache->directory)))
+		return;
+	while((dirent = readdir(dir)))
+	{
+		size_t length = strlen(dirent->d_name);
+		if(length < sizeof HQ9X_CACHE_SUFFIX
+		|| (strcmp(dirent->d_name + length - (sizeof HQ9X_CACHE_SUFFIX - 1), HQ9X_CACHE_SUFFIX) != 0
+		&& strcmp(dirent->d_name + length - (sizeof HQ9X_RESULT_SUFFIX - 1), HQ9X_RESULT_SUFFIX) != 0))
+			continue;
+		snprintf(path, sizeof path, "%s/%s", cache->directory, dirent->d_name);
+		if(stat(path, &st) == -1)
+			continue;
+		if(count == capacity)
+			entries = realloc(entries, (capacity += 16) * sizeof(hq9x_cache_entry_t));
+		entries[count].path = strdup(path);
+		entries[count].size = st.st_size;
+		entries[count].used = st.st_mtim;
+		total += st.st_size;
+		count++;
+	}
+	closedir(dir);
+
+	if(total > cache->limit)
+	{
+		qsort(entries, count, sizeof(hq9x_cache_entry_t), hq9x_cache_entry_compare);
+		for(i = 0; i < count && total > cache->limit; i++)
+		{
+			unlink(entries[i].path);
+			total -= entries[i].size;
+		}
+	}
+
+	hq9x_cache_usage(cache, total, 1);
+
+	for(i = 0; i < count; i++)
+		free(entries[i].path);
+	free(entries);
+}
+
+/* written under a temporary name so that concurrent runs never see a partial entry */
+/* the directory is only scanned once the running total goes over the limit */
+static void hq9x_cache_write(hq9x_cache_t * cache, const char * path, const void * image, size_t size)
+{
+	char temp[4096];
+	long long total;
+	int fd, written;
+
+	snprintf(temp, sizeof temp, "%s/.tmp.XXXXXX", cache->directory);
+	if((fd = mkstemp(temp)) == -1)
+		return;
+	written = write(fd, image, size) == size;
+	if(close(fd) != 0 || !written || rename(temp, path) != 0)
+	{
+		unlink(temp);
+		return;
+	}
+
+	total = hq9x_cache_usage(cache, size, 0);
+	if(total < 0 || (size_t)total > cache->limit)
+		hq9x_cache_evict(cache);
+}
+
+static void hq9x_cache_store(hq9x_cache_t * cache, source_t * source, uint64_t key, int dialect)
+{
+	char path[4096];
+	hq9x_cache_header_t header;
+	uint64_t * rows = NULL;
+	char * image;
+	size_t offset, i;
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, HQ9X_CACHE_MAGIC, sizeof header.magic);
+	header.version = HQ9X_CACHE_VERSION;
+	header.dialect = dialect;
+	header.key = key;
+	header.text_offset = offset = sizeof header;
+	header.text_size = source->size;
+	header.ops_offset = offset = hq9x_cache_align(offset + source->size + 1);
+	header.jumps_offset = offset = hq9x_cache_align(offset + source->size + 1);
+	header.rows_offset = offset = hq9x_cache_align(offset + (source->size + 1) * sizeof(int32_t));
+	if(source->lines)
+	{
+		header.row_count = source->count;
+		rows = malloc(source->count * sizeof(uint64_t));
+		offset += source->count * sizeof(uint64_t);
+		for(i = 0; i < source->count; i++)
+		{
+			rows[i] = offset;
+			offset += strlen(source->lines[i]) + 1;
+		}
+	}
+	header.file_size = offset;
+
+	image = clear_alloc(offset);
+	memcpy(image, &header, sizeof header);
+	memcpy(image + header.text_offset, source->text, source->size + 1);
+	memcpy(image + header.ops_offset, source->ops, source->size + 1);
+	memcpy(image + header.jumps_offset, source->jumps, (source->size + 1) * sizeof(int32_t));
+	if(rows)
+	{
+		memcpy(image + header.rows_offset, rows, source->count * sizeof(uint64_t));
+		for(i = 0; i < source->count; i++)
+			strcpy(image + rows[i], source->lines[i]);
+		free(rows);
+	}
+
+	hq9x_cache_path(cache, key, HQ9X_CACHE_SUFFIX, path, sizeof path);
+	hq9x_cache_write(cache, path, image, offset);
+	free(image);
+}
+
+static void hq9x_settings(hq9x_state_t * state, char * settings, size_t size)
+{
+	snprintf(settings, size, "c%d u%d w%c n%c", state->options.charcase, state->options.on_unknown, state->options.on_whitespace, state->options.on_newline);
+}
+
+/* preprocesses the program, the input source at this point */
+static void hq9x_prepare(hq9x_state_t * state)
+{
+	source_t * program = &state->input;
+	hq9x_cache_t * cache = &state->cache;
+	char settings[64];
+	uint64_t key = 0;
+
+	program->size = strlen(program->text);
+	if(cache->directory)
+	{
+		hq9x_settings(state, settings, sizeof settings);
+		key = hq9x_cache_key(program, state->dialect, settings);
+		if(hq9x_cache_load(cache, program, key, state->dialect))
+			return;
+	}
+
+	/* a naive run decodes each command as it gets to it and scans for the matching brackets */
+	if(!state->options.naive)
+		source_compile(program, state->charcase);
+	if(state->dialect == HQ9X_BEFUNGE93)
+		source_ensure_grid(program, 25, 80);
+
+	if(cache->directory)
+		hq9x_cache_store(cache, program, key, state->dialect);
+}
+
+/* Result cache for deterministic programs */
+
+typedef struct hq9x_result_header
+{
+	char magic[8];
+	uint32_t version;
+	int32_t status;
+	int32_t accumulator;
+	uint32_t reserved;
+	uint64_t key;
+	uint64_t text_size; /* the source follows the header, to rule out collisions */
+	uint64_t output_size; /* the output follows the source */
+} hq9x_result_header_t;
+
+static int hq9x_op_reads_input(function_ptr_t op)
+{
+	return op == bf_read || op == bef_scan_int || op == bef_scan_char || op == bef_random
+		|| op == hq9x_copy || op == hq9x_rot13 || op == hq9x_sort
+		|| op == hq9x_interpret || op == hq9x_interpret_bf;
+}
+
+/* static pass over the prepared program, true if neither input nor randomness can be reached */
+/* Befunge programs may still put such commands into the grid, those are caught when executed */
+static int hq9x_is_deterministic(hq9x_state_t * state)
+{
+	source_t * program = &state->input;
+	size_t i;
+
+	if(program->lines)
+	{
+		char ** line;
+		for(line = program->lines; *line; line++)
+			for(i = 0; (*line)[i]; i++)
+				if(hq9x_op_reads_input(state->ops[source_fold(state->charcase, (*line)[i])]))
+					return 0;
+		return 1;
+	}
+
+	for(i = 0; i < program->size; i++)
+	{
+		if(hq9x_op_reads_input(state->ops[program->ops[i]]))
+			return 0;
+		if(state->pre_op == hq9x_pre_alter_bf && program->ops[i] == ',')
+			return 0; /* may become a BF read after X */
+	}
+	return 1;
+}
+
+/* writes out the stored output, returns 0 if there is no result for the key */
+static int hq9x_result_replay(hq9x_state_t * state, source_t * source, uint64_t key, int * status)
+{
+	hq9x_cache_t * cache = &state->cache;
+	char path[4096];
+	hq9x_result_header_t header;
+	struct stat st;
+	char * buffer;
+	FILE * file;
+	int found = 0;
+
+	hq9x_cache_path(cache, key, HQ9X_RESULT_SUFFIX, path, sizeof path);
+	if(!(file = fopen(path, "rb")))
+		return 0;
+	/* the sizes come from the file, a damaged one is a miss */
+	if(fread(&header, sizeof header, 1, file) == 1
+	&& memcmp(header.magic, HQ9X_RESULT_MAGIC, sizeof header.magic) == 0
+	&& header.version == HQ9X_CACHE_VERSION
+	&& header.key == key && header.text_size == source->size
+	&& fstat(fileno(file), &st) == 0
+	&& hq9x_cache_fits(sizeof header + header.text_size, header.output_size, 1, st.st_size)
+	&& (buffer = malloc(header.text_size + header.output_size + 1)))
+	{
+		if(fread(buffer, 1, header.text_size + header.output_size, file) == header.text_size + header.output_size
+		&& memcmp(buffer, source->text, source->size) == 0)
+		{
+			state->write(state->user, buffer + header.text_size, header.output_size);
+			*status = header.status;
+			state->accumulator = header.accumulator;
+			found = 1;
+			futimens(fileno(file), NULL);
+		}
+		free(buffer);
+	}
+	fclose(file);
+	return found;
+}
+
+/* called on every exit path of a run that might be cached */
+static void hq9x_result_store(hq9x_state_t * state, int status)
+{
+	hq9x_result_t * result = state->result;
+	hq9x_result_header_t header;
+	char path[4096];
+	char * image;
+
+	if(!result || result->overflow || state->nondeterministic)
+		return;
+	state->result = NULL;
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, HQ9X_RESULT_MAGIC, sizeof header.magic);
+	header.version = HQ9X_CACHE_VERSION;
+	header.status = status;
+	header.accumulator = state->accumulator;
+	header.key = result->key;
+	header.text_size = result->text_size;
+	header.output_size = result->size;
+
+	image = malloc(sizeof header + result->text_size + result->size);
+	memcpy(image, &header, sizeof header);
+	memcpy(image + sizeof header, result->text, result->text_size);
+	memcpy(image + sizeof header + result->text_size, result->data, result->size);
+	hq9x_cache_path(result->cache, result->key, HQ9X_RESULT_SUFFIX, path, sizeof path);
+	hq9x_cache_write(result->cache, path, image, sizeof header + result->text_size + result->size);
+	free(image);
+	free(result->data);
+	result->data = NULL;
+}
+
+/* Library interface */
+
+int hq9x_dialect_by_name(const char * name)
+{
+	if(strcasecmp(name, "HQ9+") == 0 || strcasecmp(name, "HQ9X") == 0 || strcmp(name, "b") == 0)
+		return HQ9X_ORIGINAL;
+	else if(strcasecmp(name, "CHIQRSX9+") == 0 || strcasecmp(name, "CHIQRSX9X") == 0 || strcmp(name, "o") == 0)
+		return HQ9X_CHIQRSX9X;
+	else if(strcasecmp(name, "ALL") == 0)
+		return HQ9X_DEFAULT;
+	else if(strcasecmp(name, "BF") == 0)
+		return HQ9X_BRAINF;
+	else if(strcasecmp(name, "HQ9++") == 0 || strcasecmp(name, "HQ9XX") == 0 || strcmp(name, "m") == 0)
+		return HQ9X_OO;
+	else if(strcasecmp(name, "HQ9+-") == 0 || strcmp(name, "z") == 0)
+		return HQ9X_OO_QC;
+	else if(strcasecmp(name, "DF") == 0 || strcasecmp(name, "DEADFISH") == 0 || strcasecmp(name, "DEADFUSH") == 0)
+		return HQ9X_DEADFISH;
+	else if(strcasecmp(name, "FISHQ9+") == 0 || strcasecmp(name, "FISHQ9X") == 0)
+		return HQ9X_FISHQ9X;
+	else if(strcasecmp(name, "H9+") == 0 || strcasecmp(name, "H9X") == 0)
+		return HQ9X_H9X;
+	else if(strcasecmp(name, "HQ9+B") == 0 || strcasecmp(name, "HQ9XB") == 0)
+		return HQ9X_HQ9XBF;
+	else if(strcasecmp(name, "2D") == 0 || strcasecmp(name, "HQ9+2D") == 0 || strcasecmp(name, "HQ9X2D") == 0)
+		return HQ9X_2D;
+	else if(strcasecmp(name, "BF93") == 0)
+		return HQ9X_BEFUNGE93;
+	else if(strcasecmp(name, "H9F") == 0)
+		return HQ9X_H9F;
+	else if(strcasecmp(name, "NIL") == 0)
+		return HQ9X_NIL;
+	else if(strcmp(name, "+") == 0)
+		return HQ9X_PLUS;
+	else
+		return -1;
+}
+
+void hq9x_default_options(hq9x_options_t * options)
+{
+	memset(options, 0, sizeof(hq9x_options_t));
+	options->charcase = -1;
+	options->on_whitespace = 'i';
+	options->on_newline = 'w';
+	options->hello_message = "Hello, world!";
+	options->cache_limit = HQ9X_CACHE_LIMIT;
+	options->cache_results = 1;
+}
+
+hq9x_state_t * hq9x_create(int dialect, const hq9x_options_t * options)
+{
+	hq9x_state_t * state = clear_alloc(sizeof(hq9x_state_t));
+
+	if(options)
+		state->options = *options;
+	else
+		hq9x_default_options(&state->options);
+	state->exit_with_accumulator = state->options.exit_with_accumulator;
+	state->cache.directory = state->options.naive ? NULL : state->options.cache_directory;
+	state->cache.limit = state->options.cache_limit;
+	state->random = 1;
+
+	hq9x_initialize(state, dialect);
+	state->dispatch = state->ops;
+	if(state->options.charcase != -1)
+		state->charcase = state->options.charcase;
+	switch(state->options.on_unknown)
+	{
+	case 'n':
+		state->default_op = hq9x_newline;
+	break;
+	case 'q':
+		state->default_op = hq9x_unknown;
+		state->on_error = ERROR_QUIET;
+	break;
+	case 's':
+		state->default_op = hq9x_unknown;
+		state->on_error = ERROR_SIGNAL;
+	break;
+	case 'h':
+		state->default_op = hq9x_unknown;
+		state->on_error = ERROR_HALT;
+	break;
+	}
+	switch(state->options.on_whitespace)
+	{
+	case 'i':
+		state->ops[' '] = state->ops['\t'] = hq9x_nop;
+	break;
+	case 'u':
+		state->ops[' '] = state->ops['\t'] = hq9x_unknown;
+	break;
+	}
+	switch(state->options.on_newline)
+	{
+	case 'w':
+		state->ops['\n'] = state->ops[' '];
+	break;
+	case 'i':
+		state->ops['\n'] = hq9x_nop;
+	break;
+	case 'u':
+		state->ops['\n'] = hq9x_unknown;
+	break;
+	}
+	if(state->options.detect_loops)
+		hq9x_watch_loops(state);
+	if(state->options.profile || state->options.sample_rate > 0)
+		state->profile = hq9x_profile_create(state->options.profile > 1, state->options.sample_rate);
+	return state;
+}
+
+static void hq9x_reset(hq9x_state_t * state, hq9x_read_t input, hq9x_write_t output, void * user)
+{
+	state->bf_enabled = state->bf ? state->bf->enabled : 0;
+	state->read = input;
+	state->write = output;
+	state->user = user;
+	state->accumulator = 0;
+	state->random = 1; /* each run of a program goes the same ways at ? */
+	state->dispatch = state->ops;
+	state->last_op = NULL;
+	state->nondeterministic = 0;
+	state->status = 0;
+	state->hold = HOLD_NONE;
+	state->steps = 0;
+	state->output_size = 0;
+	state->deadline = state->options.max_seconds > 0 ? hq9x_now() + state->options.max_seconds : 0;
+	hq9x_schedule_check(state);
+	if(state->loops)
+		hq9x_loops_reset(state->loops);
+	if(state->bf)
+		bf_init(state);
+	if(state->bef)
+		bef_init(state);
+
+	source_init(&state->source, input, user);
+	state->source.text = "";
+}
+
+static uint64_t hq9x_result_key(hq9x_state_t * state)
+{
+	char settings[64];
+	uint64_t key;
+	hq9x_settings(state, settings, sizeof settings);
+	key = hq9x_cache_key(&state->input, state->dialect, settings);
+	key = hq9x_hash(key, "result", sizeof "result");
+	key = hq9x_hash(key, HQ9X_VERSION, strlen(HQ9X_VERSION));
+	key = hq9x_hash(key, &state->exit_with_accumulator, sizeof state->exit_with_accumulator);
+	key = hq9x_hash(key, state->options.hello_message, strlen(state->options.hello_message));
+	/* a run stopped by a limit is not stored, but one that was not stopped may have needed more */
+	key = hq9x_hash(key, &state->options.max_steps, sizeof state->options.max_steps);
+	key = hq9x_hash(key, &state->options.max_output, sizeof state->options.max_output);
+	key = hq9x_hash(key, &state->options.max_memory, sizeof state->options.max_memory);
+	return key;
+}
+
+/* replays the result if it is cached, otherwise enters the prepared program in the input */
+static int hq9x_launch(hq9x_state_t * state, int deterministic, uint64_t key)
+{
+	if(deterministic)
+	{
+		hq9x_result_t * result = &state->capture;
+		memset(result, 0, sizeof *result);
+		result->key = key;
+		if(hq9x_result_replay(state, &state->input, result->key, &state->status))
+			return HQ9X_FINISHED;
+		result->cache = &state->cache;
+		result->text = state->input.text;
+		result->text_size = state->input.size;
+		result->limit = state->options.result_limit;
+		state->result = result;
+	}
+
+	if(state->profile)
+		hq9x_profile_program(state->profile, state->input.text);
+	hq9x_enter(state);
+	return HQ9X_RUNNING;
+}
+
+int hq9x_start(hq9x_state_t * state, const char * program, size_t size, hq9x_read_t input, hq9x_write_t output, void * user)
+{
+	int deterministic;
+
+	hq9x_reset(state, input, output, user);
+	source_init(&state->input, input, user);
+	state->input.text = hq9x_strdupto(HQ9X_MEMORY_INPUT, program, size);
+	hq9x_prepare(state);
+
+	deterministic = state->cache.directory && state->options.cache_results && !state->profile && hq9x_is_deterministic(state);
+	return hq9x_launch(state, deterministic, deterministic ? hq9x_result_key(state) : 0);
+}
+
+/* puts the lines changed by the last run back, instead of preparing the program again */
+static void hq9x_snapshot_restore(hq9x_snapshot_t * snapshot)
+{
+	source_t * source = &snapshot->source;
+	size_t i;
+
+	if(source->lines && !snapshot->lines)
+	{
+		/* cut into lines while running, the text itself is unchanged */
+		for(i = 0; i < source->count; i++)
+			hq9x_free(HQ9X_MEMORY_LINES, source->lines[i]);
+		hq9x_free(HQ9X_MEMORY_LINES, source->lines);
+		hq9x_free(HQ9X_MEMORY_LINES, source->widths);
+		source->lines = NULL;
+		source->widths = NULL;
+		source->count = 0;
+	}
+	else if(source->lines)
+	{
+		for(i = snapshot->count; i < source->count; i++)
+			hq9x_free(HQ9X_MEMORY_LINES, source->lines[i]);
+		source->lines[snapshot->count] = NULL;
+		source->count = snapshot->count;
+		for(i = 0; i < snapshot->count; i++)
+		{
+			size_t size;
+			if(!source->dirty[i])
+				continue;
+			source->dirty[i] = 0;
+			size = strlen(snapshot->lines[i]);
+			if(strlen(source->lines[i]) != size)
+			{
+				if(source_is_mapped(source, source->lines[i]))
+					source->lines[i] = hq9x_malloc(HQ9X_MEMORY_LINES, size + 1);
+				else
+					source->lines[i] = hq9x_realloc(HQ9X_MEMORY_LINES, source->lines[i], size + 1);
+			}
+			memcpy(source->lines[i], snapshot->lines[i], size + 1);
+			source->widths[i] = size;
+		}
+	}
+
+	source->pointer = NULL;
+	source->line = source->lines ? &source->lines[0] : NULL;
+	source->dir = '>';
+	source->out_of_bound = 0;
+}
+
+static void hq9x_snapshot_free(hq9x_snapshot_t * snapshot)
+{
+	size_t i;
+	source_free(&snapshot->source);
+	for(i = 0; i < snapshot->count; i++)
+		hq9x_free(HQ9X_MEMORY_LINES, snapshot->lines[i]);
+	hq9x_free(HQ9X_MEMORY_LINES, snapshot->lines);
+	free(snapshot);
+}
+
+int hq9x_load(hq9x_state_t * state, const char * program, size_t size)
+{
+	hq9x_snapshot_t * snapshot;
+	size_t i;
+
+	if(state->snapshot)
+		hq9x_snapshot_free(state->snapshot);
+	state->snapshot = snapshot = clear_alloc(sizeof(hq9x_snapshot_t));
+
+	source_init(&state->input, NULL, NULL);
+	state->input.text = hq9x_strdupto(HQ9X_MEMORY_INPUT, program, size);
+	hq9x_prepare(state);
+	snapshot->deterministic = state->cache.directory && state->options.cache_results && !state->profile && hq9x_is_deterministic(state);
+	if(snapshot->deterministic)
+		snapshot->key = hq9x_result_key(state);
+	snapshot->source = state->input;
+	memset(&state->input, 0, sizeof(source_t));
+
+	if(snapshot->source.lines)
+	{
+		snapshot->count = snapshot->source.count;
+		snapshot->lines = hq9x_malloc(HQ9X_MEMORY_LINES, snapshot->count * sizeof(char *));
+		for(i = 0; i < snapshot->count; i++)
+			snapshot->lines[i] = hq9x_strdup(HQ9X_MEMORY_LINES, snapshot->source.lines[i]);
+		snapshot->source.dirty = clear_alloc(snapshot->count);
+		snapshot->source.dirty_size = snapshot->count;
+	}
+	hq9x_snapshot_restore(snapshot);
+	return 0;
+}
+
+int hq9x_start_loaded(hq9x_state_t * state, hq9x_read_t input, hq9x_write_t output, void * user)
+{
+	hq9x_snapshot_t * snapshot = state->snapshot;
+
+	hq9x_reset(state, input, output, user);
+	state->input = snapshot->source;
+	state->input.read = input;
+	state->input.user = user;
+	snapshot->running = 1;
+	return hq9x_launch(state, snapshot->deterministic, snapshot->key);
+}
+
+int hq9x_finish(hq9x_state_t * state)
+{
+	if(state->frame)
+	{
+		/* stopped before the end, there is nothing to cache */
+		state->nondeterministic = 1;
+		while(state->frame)
+			hq9x_leave(state);
+	}
+
+	hq9x_result_store(state, state->status);
+	if(state->result)
+	{
+		free(state->result->data);
+		state->result = NULL;
+	}
+	if(state->snapshot && state->snapshot->running)
+	{
+		/* the program is back in the input once all frames are left */
+		state->snapshot->source = state->input;
+		state->snapshot->running = 0;
+		hq9x_snapshot_restore(state->snapshot);
+		memset(&state->input, 0, sizeof(source_t));
+	}
+	else
+		source_free(&state->input);
+
+	if(state->bf)
+		state->bf->enabled = state->bf_enabled;
+	hq9x_oo_clear(state);
+	return state->status;
+}
+
+int hq9x_run(hq9x_state_t * state, const char * program, size_t size, hq9x_read_t input, hq9x_write_t output, void * user)
+{
+	if(hq9x_start(state, program, size, input, output, user) != HQ9X_FINISHED)
+	{
+		while(hq9x_step(state, ULONG_MAX) != HQ9X_FINISHED)
+			;
+	}
+	return hq9x_finish(state);
+}
+
+int hq9x_rerun(hq9x_state_t * state, hq9x_read_t input, hq9x_write_t output, void * user)
+{
+	if(hq9x_start_loaded(state, input, output, user) != HQ9X_FINISHED)
+	{
+		while(hq9x_step(state, ULONG_MAX) != HQ9X_FINISHED)
+			;
+	}
+	return hq9x_finish(state);
+}
+
+/* Lockstep BF */
+
+/* an input held in memory, and where the output of its run goes */
+typedef struct hq9x_record
+{
+	const char * data;
+	size_t pos, size;
+	hq9x_write_t write;
+	void * user;
+} hq9x_record_t;
+
+static size_t hq9x_read_record(void * user, char * buffer, size_t size)
+{
+	hq9x_record_t * record = user;
+	if(size > record->size - record->pos)
+		size = record->size - record->pos;
+	memcpy(buffer, record->data + record->pos, size);
+	record->pos += size;
+	return size;
+}
+
+static void hq9x_write_record(void * user, const char * data, size_t size)
+{
+	hq9x_record_t * record = user;
+	record->write(record->user, data, size);
+}
+
+/* true if the loaded program only uses the BF commands, everything else being a comment */
+static int bf_lockstep_possible(hq9x_state_t * state)
+{
+	source_t * program = &state->snapshot->source;
+	size_t i;
+
+	if(!state->bf || !state->bf->enabled || program->lines || !program->ops || state->pre_op != hq9x_nop || state->profile || state->loops)
+		return 0;
+	for(i = 0; i < program->size; i++)
+	{
+		function_ptr_t op = state->ops[program->ops[i]];
+		if(!op)
+			op = state->default_op;
+		if(op == bf_left || op == bf_right || op == bf_inc || op == bf_dec
+		|| op == bf_do || op == bf_loop || op == bf_write || op == bf_read || op == hq9x_nop)
+			continue;
+		if(op == hq9x_unknown && state->on_error == ERROR_QUIET)
+			continue;
+		return 0;
+	}
+	return 1;
+}
+
+/* the lanes in lockstep share the step count and the time limit, a lane on its own keeps them */
+typedef struct bf_lockstep
+{
+	unsigned long long steps;
+	unsigned long long check_at;
+	double deadline;
+	size_t * written; /* output of each lane so far */
+} bf_lockstep_t;
+
+/* the next step at which the limits are checked, as hq9x_schedule_check */
+static void bf_lockstep_schedule(hq9x_state_t * state, bf_lockstep_t * lockstep)
+{
+	hq9x_options_t * options = &state->options;
+	lockstep->check_at = ULLONG_MAX;
+	if(lockstep->deadline || options->max_memory)
+		lockstep->check_at = lockstep->steps + HQ9X_BUDGET_INTERVAL;
+	if(options->max_steps && options->max_steps < lockstep->check_at)
+		lockstep->check_at = options->max_steps;
+}
+
+/* the limits of hq9x_check_budget, stopping every lane still in lockstep if one is exceeded */
+static size_t bf_lockstep_budget(hq9x_state_t * state, bf_lockstep_t * lockstep, size_t cells, const size_t * active, size_t remaining, int * statuses)
+{
+	hq9x_options_t * options = &state->options;
+	const char * message;
+	int status;
+	size_t i;
+
+	if(options->max_steps && lockstep->steps >= options->max_steps)
+		status = HQ9X_EXIT_STEPS, message = "Step limit exceeded";
+	else if(lockstep->deadline && hq9x_now() >= lockstep->deadline)
+		status = HQ9X_EXIT_TIME, message = "Time limit exceeded";
+	else if(options->max_memory && cells * sizeof(bf_cell_t) > options->max_memory)
+		status = HQ9X_EXIT_MEMORY, message = "Memory limit exceeded";
+	else
+	{
+		bf_lockstep_schedule(state, lockstep);
+		return remaining;
+	}
+	for(i = 0; i < remaining; i++)
+	{
+		fprintf(stderr, "%s\n", message);
+		statuses[active[i]] = status;
+	}
+	return 0;
+}
+
+/* continues a lane on its own, from the branch at pc it disagreed on */
+static int bf_lockstep_peel(hq9x_state_t * state, size_t pc, const bf_cell_t * tape, size_t lanes, size_t lane, size_t used, size_t pointer,
+	const bf_lockstep_t * lockstep, hq9x_record_t * record)
+{
+	size_t i;
+
+	if(hq9x_start_loaded(state, hq9x_read_record, hq9x_write_record, record) == HQ9X_FINISHED)
+		return hq9x_finish(state);
+	state->source.pointer = state->source.text + pc;
+	state->steps = lockstep->steps;
+	state->output_size = lockstep->written[lane];
+	state->deadline = lockstep->deadline;
+	hq9x_schedule_check(state);
+	if(state->bf->count < used)
+	{
+		state->bf->cells = hq9x_realloc(HQ9X_MEMORY_TAPE, state->bf->cells, sizeof(bf_cell_t) * used);
+		state->bf->count = used;
+	}
+	for(i = 0; i < used; i++)
+		state->bf->cells[i] = tape[i * lanes + lane];
+	state->bf->pointer = pointer;
+	state->bf->used = used;
+	while(hq9x_step(state, ULONG_MAX) != HQ9X_FINISHED)
+		;
+	return hq9x_finish(state);
+}
+
+size_t hq9x_rerun_lockstep(hq9x_state_t * state, size_t count, const char * const * inputs, const size_t * sizes,
+	hq9x_write_t output, void * const * users, int * statuses)
+{
+	source_t * program = &state->snapshot->source;
+	hq9x_record_t * records;
+	bf_lockstep_t lockstep;
+	bf_cell_t * tape;
+	size_t * active;
+	size_t max_output = state->options.max_output;
+	size_t lanes = count, remaining = count, peeled = 0;
+	size_t cells = 100, used = 1, pointer = 0, pc, i, l;
+
+	if(!bf_lockstep_possible(state))
+	{
+		for(l = 0; l < count; l++)
+		{
+			hq9x_record_t record = { inputs[l], 0, sizes[l], output, users[l] };
+			statuses[l] = hq9x_rerun(state, hq9x_read_record, hq9x_write_record, &record);
+		}
+		return count;
+	}
+
+	/* cell i of lane l is at i * lanes + l, so that every command is a loop over one vector */
+	tape = hq9x_clear_alloc(HQ9X_MEMORY_TAPE, sizeof(bf_cell_t) * cells * lanes);
+	records = malloc(sizeof(hq9x_record_t) * lanes);
+	active = malloc(sizeof(size_t) * lanes);
+	lockstep.written = clear_alloc(sizeof(size_t) * lanes);
+	lockstep.steps = 0;
+	lockstep.deadline = state->options.max_seconds > 0 ? hq9x_now() + state->options.max_seconds : 0;
+	bf_lockstep_schedule(state, &lockstep);
+	for(l = 0; l < lanes; l++)
+	{
+		records[l].data = inputs[l];
+		records[l].pos = 0;
+		records[l].size = strnlen(inputs[l], sizes[l]);
+		records[l].write = output;
+		records[l].user = users[l];
+		active[l] = l;
+		statuses[l] = 0; /* BF leaves the accumulator alone */
+	}
+
+	for(pc = 0; pc < program->size && remaining > 0; pc++)
+	{
+		function_ptr_t op = state->ops[program->ops[pc]];
+		bf_cell_t * vector = tape + pointer * lanes;
+
+		if(op == bf_inc)
+		{
+			for(l = 0; l < lanes; l++)
+				vector[l]++;
+		}
+		else if(op == bf_dec)
+		{
+			for(l = 0; l < lanes; l++)
+				vector[l]--;
+		}
+		else if(op == bf_left)
+		{
+			if(pointer > 0)
+				pointer--;
+		}
+		else if(op == bf_right)
+		{
+			if(pointer < 30000)
+				pointer++;
+			if(pointer >= used)
+				used = pointer + 1;
+			if(pointer >= cells)
+			{
+				bf_cell_t * grown = hq9x_realloc(HQ9X_MEMORY_TAPE, tape, sizeof(bf_cell_t) * (cells + 100) * lanes);
+				if(!grown)
+				{
+					/* the lanes still in lockstep cannot go on */
+					for(i = 0; i < remaining; i++)
+						statuses[active[i]] = HQ9X_EXIT_MEMORY;
+					remaining = 0;
+					break;
+				}
+				tape = grown;
+				memset(tape + cells * lanes, 0, sizeof(bf_cell_t) * 100 * lanes);
+				cells += 100;
+			}
+		}
+		else if(op == bf_write)
+		{
+			size_t kept = 0;
+			for(i = 0; i < remaining; i++)
+			{
+				l = active[i];
+				if(max_output && lockstep.written[l] + 1 > max_output)
+				{
+					/* as hq9x_write, only this lane stops */
+					fprintf(stderr, "Output limit exceeded\n");
+					statuses[l] = HQ9X_EXIT_OUTPUT;
+					continue;
+				}
+				lockstep.written[l]++;
+				output(users[l], (const char *)&vector[l], 1);
+				active[kept++] = l;
+			}
+			remaining = kept;
+		}
+		else if(op == bf_read)
+		{
+			for(i = 0; i < remaining; i++)
+			{
+				hq9x_record_t * record = &records[active[i]];
+				l = active[i];
+				if((vector[l] = record->pos < record->size ? record->data[record->pos] : 0))
+					record->pos++;
+			}
+		}
+		else if(op == bf_do || op == bf_loop)
+		{
+			size_t nonzero = 0, kept = 0;
+			int taken;
+			for(i = 0; i < remaining; i++)
+				if(vector[active[i]])
+					nonzero++;
+			/* the majority stays in lockstep, the others carry on one by one */
+			taken = 2 * nonzero >= remaining;
+			if(nonzero != 0 && nonzero != remaining)
+			{
+				for(i = 0; i < remaining; i++)
+				{
+					l = active[i];
+					if((vector[l] != 0) == taken)
+						active[kept++] = l;
+					else
+					{
+						statuses[l] = bf_lockstep_peel(state, pc, tape, lanes, l, used, pointer, &lockstep, &records[l]);
+						peeled++;
+					}
+				}
+				remaining = kept;
+			}
+			if(taken == (op == bf_loop))
+				pc = program->jumps[pc];
+		}
+
+		/* a program that is just about to end is let to */
+		if(++lockstep.steps >= lockstep.check_at && pc + 1 < program->size)
+			remaining = bf_lockstep_budget(state, &lockstep, cells, active, remaining, statuses);
+	}
+
+	hq9x_free(HQ9X_MEMORY_TAPE, tape);
+	free(lockstep.written);
+	free(records);
+	free(active);
+	return peeled;
+}
+
+
+unsigned long long hq9x_steps(const hq9x_state_t * state)
+{
+	return state->steps;
+}
+
+/* Live statistics */
+
+/* no stdio here, this is called from signal handlers */
+static size_t hq9x_stats_append(char * buffer, size_t at, size_t size, const char * text)
+{
+	while(*text && at + 1 < size)
+		buffer[at++] = *text++;
+	return at;
+}
+
+static size_t hq9x_stats_number(char * buffer, size_t at, size_t size, unsigned long long value)
+{
+	char digits[24];
+	int count = 0;
+	do
+	{
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while(value);
+	while(count > 0 && at + 1 < size)
+		buffer[at++] = digits[--count];
+	return at;
+}
+
+/* only reads counters the run keeps anyway, the position as of the last command */
+size_t hq9x_stats(const hq9x_state_t * state, char * buffer, size_t size)
+{
+	const source_t * source = &state->source;
+	const source_t * input = &state->input;
+	const char * pointer = source->pointer;
+	char * const * line = source->line;
+	size_t at = 0;
+
+	if(size == 0)
+		return 0;
+	at = hq9x_stats_append(buffer, at, size, "steps ");
+	at = hq9x_stats_number(buffer, at, size, state->steps);
+	at = hq9x_stats_append(buffer, at, size, ", output ");
+	at = hq9x_stats_number(buffer, at, size, state->output_size);
+	at = hq9x_stats_append(buffer, at, size, ", input ");
+	at = hq9x_stats_number(buffer, at, size, input->text && input->pointer >= input->text ? input->pointer - input->text : 0);
+	if(state->bf)
+	{
+		at = hq9x_stats_append(buffer, at, size, ", tape ");
+		at = hq9x_stats_number(buffer, at, size, state->bf->used);
+	}
+	if(state->bef)
+	{
+		at = hq9x_stats_append(buffer, at, size, ", stack ");
+		at = hq9x_stats_number(buffer, at, size, state->bef->pointer);
+	}
+	if(state->frame && pointer && source->lines && line && line >= source->lines && line < source->lines + source->count)
+	{
+		at = hq9x_stats_append(buffer, at, size, ", at ");
+		at = hq9x_stats_number(buffer, at, size, pointer - *line);
+		at = hq9x_stats_append(buffer, at, size, ",");
+		at = hq9x_stats_number(buffer, at, size, line - source->lines);
+	}
+	else if(state->frame && pointer && !source->lines && source->text)
+	{
+		at = hq9x_stats_append(buffer, at, size, ", at ");
+		at = hq9x_stats_number(buffer, at, size, pointer - source->text);
+	}
+	if(state->frame && state->frame->parent)
+		at = hq9x_stats_append(buffer, at, size, " in a nested program");
+	at = hq9x_stats_append(buffer, at, size, "\n");
+	buffer[at] = '\0';
+	return at;
+}
+
+/* Memory report */
+
+void hq9x_memory_report(hq9x_write_t output, void * user, int json)
+{
+	int i;
+	if(json)
+	{
+		hq9x_report(output, user, "{");
+		for(i = 0; i <= HQ9X_MEMORY_KINDS; i++)
+			hq9x_report(output, user, "%s\"%s\": {\"current\": %lld, \"peak\": %lld}", i ? ", " : "",
+				hq9x_memory_names[i], hq9x_memory[i].current, hq9x_memory[i].peak);
+		hq9x_report(output, user, "}");
+		return;
+	}
+	hq9x_report(output, user, "Memory:%15s %14s\n", "current", "peak");
+	for(i = 0; i <= HQ9X_MEMORY_KINDS; i++)
+		hq9x_report(output, user, "%8s %14lld %14lld\n", hq9x_memory_names[i], hq9x_memory[i].current, hq9x_memory[i].peak);
+}
+
+/* Checkpoints */
+
+#define HQ9X_CHECKPOINT_MAGIC "EHQICKP"
+#define HQ9X_CHECKPOINT_VERSION 4
+
+typedef struct hq9x_checkpoint_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t dialect;
+	uint32_t bf_cell_size, bef_cell_size; /* the tape and the stack are stored as they are in memory */
+	uint64_t frame_count;
+} hq9x_checkpoint_header_t;
+
+/* every command a dispatch table can hold, stored as its index in a byte, so only append to it */
+static const function_ptr_t hq9x_functions[] =
+{
+	NULL,
+	hq9x_nop, hq9x_unknown, hq9x_newline, hq9x_hello, hq9x_quine, hq9x_bottles,
+	hq9x_inc, hq9x_dec, hq9x_square, hq9x_output, hq9x_kill, hq9x_force_bound,
+	hq9x_interpret, hq9x_interpret_bf, hq9x_copy, hq9x_rot13, hq9x_sort, hq9x_turing, hq9x_pre_alter_bf,
+	hq9x_new, hq9x_inc_or_alloc, hq9x_quality_control, hq9x_dt_d, hq9x_dt_invoke, hq9x_check_dt,
+	bf_left, bf_right, bf_inc, bf_dec, bf_do, bf_loop, bf_write, bf_read,
+	bef_up, bef_down, bef_left, bef_right, bef_add, bef_sub, bef_mul, bef_div, bef_mod,
+	bef_not, bef_greater, bef_random, bef_h_if, bef_v_if, bef_string, bef_dup, bef_swap, bef_drop,
+	bef_print_int, bef_print_char, bef_scan_int, bef_scan_char, bef_bridge, bef_get, bef_put,
+	bef_push_digit, bef_preprocess,
+	bf_loop_watched, bef_turn_watched,
+};
+
+#define HQ9X_FUNCTION_COUNT (sizeof hq9x_functions / sizeof hq9x_functions[0])
+
+typedef struct hq9x_stream
+{
+	FILE * file;
+	int failed;
+	int watched; /* a loop detector was on when the checkpoint was written */
+} hq9x_stream_t;
+
+static void hq9x_put_bytes(hq9x_stream_t * stream, const void * data, size_t size)
+{
+	if(size && fwrite(data, 1, size, stream->file) != size)
+		stream->failed = 1;
+}
+
+static void hq9x_put(hq9x_stream_t * stream, uint64_t value)
+{
+	hq9x_put_bytes(stream, &value, sizeof value);
+}
+
+static void hq9x_get_bytes(hq9x_stream_t * stream, void * data, size_t size)
+{
+	if(stream->failed || (size && fread(data, 1, size, stream->file) != size))
+	{
+		stream->failed = 1;
+		memset(data, 0, size);
+	}
+}
+
+static uint64_t hq9x_get(hq9x_stream_t * stream)
+{
+	uint64_t value;
+	hq9x_get_bytes(stream, &value, sizeof value);
+	return value;
+}
+
+/* a count or size about to be allocated, a corrupt file is not trusted with more than it holds */
+static size_t hq9x_get_size(hq9x_stream_t * stream, size_t unit)
+{
+	uint64_t value = hq9x_get(stream);
+	struct stat st;
+	if(!stream->failed && fstat(fileno(stream->file), &st) == 0 && value > (uint64_t)st.st_size / unit)
+		stream->failed = 1;
+	return stream->failed ? 0 : value;
+}
+
+static void hq9x_put_function(hq9x_stream_t * stream, function_ptr_t function)
+{
+	size_t i;
+	for(i = 0; i < HQ9X_FUNCTION_COUNT; i++)
+	{
+		if(hq9x_functions[i] == function)
+		{
+			unsigned char index = i;
+			hq9x_put_bytes(stream, &index, 1);
+			return;
+		}
+	}
+	stream->failed = 1;
+}
+
+static function_ptr_t hq9x_get_function(hq9x_stream_t * stream)
+{
+	unsigned char i;
+	hq9x_get_bytes(stream, &i, 1);
+	if(i >= HQ9X_FUNCTION_COUNT)
+	{
+		stream->failed = 1;
+		return NULL;
+	}
+	if(hq9x_functions[i] == bf_loop_watched || hq9x_functions[i] == bef_turn_watched)
+		stream->watched = 1;
+	return hq9x_functions[i];
+}
+
+static void hq9x_put_table(hq9x_stream_t * stream, function_ptr_t * ops, function_ptr_t pre_op, function_ptr_t default_op)
+{
+	int i;
+	for(i = 0; i < 256; i++)
+		hq9x_put_function(stream, ops[i]);
+	hq9x_put_function(stream, pre_op);
+	hq9x_put_function(stream, default_op);
+}
+
+static void hq9x_get_table(hq9x_stream_t * stream, function_ptr_t * ops, function_ptr_t * pre_op, function_ptr_t * default_op)
+{
+	int i;
+	for(i = 0; i < 256; i++)
+		ops[i] = hq9x_get_function(stream);
+	*pre_op = hq9x_get_function(stream);
+	*default_op = hq9x_get_function(stream);
+}
+
+/* a pointer into the text or one of the lines of a source, as a line number (0 for the text) and an offset */
+static void hq9x_put_pointer(hq9x_stream_t * stream, source_t * source, const char * pointer)
+{
+	size_t i;
+	if(!pointer)
+	{
+		hq9x_put(stream, (uint64_t)-1);
+		return;
+	}
+	if(source->text && source->text <= pointer && pointer <= source->text + strlen(source->text))
+	{
+		hq9x_put(stream, 0);
+		hq9x_put(stream, pointer - source->text);
+		return;
+	}
+	for(i = 0; source->lines && i < source->count; i++)
+	{
+		if(source->lines[i] <= pointer && pointer <= source->lines[i] + source->widths[i])
+		{
+			hq9x_put(stream, i + 1);
+			hq9x_put(stream, pointer - source->lines[i]);
+			return;
+		}
+	}
+	stream->failed = 1;
+}
+
+static char * hq9x_get_pointer(hq9x_stream_t * stream, source_t * source)
+{
+	uint64_t line = hq9x_get(stream), offset;
+	size_t width;
+	char * base;
+	if(line == (uint64_t)-1 || stream->failed)
+		return NULL;
+	offset = hq9x_get(stream);
+	if(line == 0)
+		base = source->text, width = base ? strlen(base) : 0;
+	else if(line <= source->count && source->lines)
+		base = source->lines[line - 1], width = source->widths[line - 1];
+	else
+		base = NULL, width = 0;
+	if(!base || offset > width)
+	{
+		stream->failed = 1;
+		return NULL;
+	}
+	return base + offset;
+}
+
+/* with an explicit size, a line of the grid may hold a 0 the program put there */
+static void hq9x_put_string(hq9x_stream_t * stream, const char * text, size_t size)
+{
+	hq9x_put(stream, size);
+	hq9x_put_bytes(stream, text, size);
+}
+
+static char * hq9x_get_string(hq9x_stream_t * stream, int memory, size_t * sizep)
+{
+	size_t size = hq9x_get_size(stream, 1);
+	char * text = hq9x_malloc(memory, size + 1);
+	hq9x_get_bytes(stream, text, size);
+	text[size] = '\0';
+	if(sizep)
+		*sizep = size;
+	return text;
+}
+
+static void hq9x_put_source(hq9x_stream_t * stream, source_t * source)
+{
+	size_t i;
+	hq9x_put(stream, source->text != NULL);
+	if(source->text)
+		hq9x_put_string(stream, source->text, strlen(source->text));
+	hq9x_put(stream, source->partial);
+	hq9x_put(stream, source->lines ? source->count : 0);
+	for(i = 0; source->lines && i < source->count; i++)
+		hq9x_put_string(stream, source->lines[i], source->widths[i]);
+	hq9x_put(stream, source->line ? source->line - source->lines : (uint64_t)-1);
+	hq9x_put_pointer(stream, source, source->pointer);
+	hq9x_put(stream, source->dir);
+	hq9x_put(stream, source->out_of_bound);
+	hq9x_put(stream, source->ops != NULL);
+	hq9x_put(stream, source->grown);
+}
+
+/* the source is rebuilt in memory of its own, even if it was loaded from the cache */
+static void hq9x_get_source(hq9x_stream_t * stream, hq9x_state_t * state, source_t * source)
+{
+	size_t i;
+	uint64_t line;
+
+	source_init(source, state->read, state->user);
+	if(hq9x_get(stream))
+	{
+		source->text = hq9x_get_string(stream, source->memory, NULL);
+		source->size = strlen(source->text);
+		source->capacity = source->size + 1;
+	}
+	source->partial = hq9x_get(stream) && source->text && source->read;
+	if((source->count = hq9x_get_size(stream, sizeof(uint64_t))))
+	{
+		source->lines = hq9x_malloc(HQ9X_MEMORY_LINES, (source->count + 1) * sizeof(char *));
+		source->widths = hq9x_malloc(HQ9X_MEMORY_LINES, (source->count + 1) * sizeof(size_t));
+		for(i = 0; i < source->count; i++)
+			source->lines[i] = hq9x_get_string(stream, HQ9X_MEMORY_LINES, &source->widths[i]);
+		source->lines[source->count] = NULL;
+	}
+	line = hq9x_get(stream);
+	if(line != (uint64_t)-1)
+	{
+		if(line < source->count)
+			source->line = &source->lines[line];
+		else
+			stream->failed = 1;
+	}
+	source->pointer = hq9x_get_pointer(stream, source);
+	source->dir = hq9x_get(stream);
+	source->out_of_bound = hq9x_get(stream);
+	if(hq9x_get(stream) && !source->lines && source->text && !stream->failed)
+		source_compile(source, state->charcase);
+	source->grown = hq9x_get(stream);
+}
+
+/* writes a run stopped between two calls of hq9x_step, replacing the file only once it is complete */
+int hq9x_checkpoint(hq9x_state_t * state, const char * path)
+{
+	hq9x_checkpoint_header_t header;
+	hq9x_stream_t stream = { NULL, 0, 0 };
+	hq9x_frame_t ** frames;
+	hq9x_frame_t * frame;
+	char temp[4096];
+	size_t count = 0, i;
+
+	if(!state->frame)
+		return -1;
+	snprintf(temp, sizeof temp, "%s.tmp", path);
+	if(!(stream.file = fopen(temp, "wb")))
+		return -1;
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, HQ9X_CHECKPOINT_MAGIC, sizeof header.magic);
+	header.version = HQ9X_CHECKPOINT_VERSION;
+	header.dialect = state->dialect;
+	header.bf_cell_size = sizeof(bf_cell_t);
+	header.bef_cell_size = sizeof(bef_cell_t);
+	for(frame = state->frame; frame; frame = frame->parent)
+		count++;
+	header.frame_count = count;
+	hq9x_put_bytes(&stream, &header, sizeof header);
+
+	/* the case folding comes first, the sources are compiled with it when read back */
+	hq9x_put(&stream, (unsigned char)state->charcase);
+	hq9x_put(&stream, state->on_error);
+	hq9x_put(&stream, state->exit_with_accumulator);
+	hq9x_put(&stream, state->accumulator);
+	hq9x_put(&stream, state->random);
+	hq9x_put(&stream, state->steps);
+	hq9x_put(&stream, state->output_size);
+	hq9x_put(&stream, state->bf_enabled);
+	hq9x_put(&stream, (unsigned char)state->opchar);
+	hq9x_put_table(&stream, state->ops, state->pre_op, state->default_op);
+	/* the shared BF table of B is not written, only whether it is in use */
+	hq9x_put(&stream, state->dispatch == hq9x_bf_ops_watched ? 2 : state->dispatch != state->ops);
+	hq9x_put_function(&stream, state->op);
+	hq9x_put_function(&stream, state->last_op);
+
+	/* from the outermost program in, each one followed by where its input was in the next one */
+	frames = malloc(count * sizeof(hq9x_frame_t *));
+	for(frame = state->frame, i = count; frame; frame = frame->parent)
+		frames[--i] = frame;
+	for(i = 0; i < count; i++)
+	{
+		if(i > 0)
+		{
+			/* the outermost one is only a placeholder */
+			hq9x_put_source(&stream, &frames[i]->source);
+			hq9x_put_pointer(&stream, &frames[i]->source, frames[i - 1]->input_pointer);
+		}
+		hq9x_put_function(&stream, frames[i]->op);
+		hq9x_put_function(&stream, frames[i]->last_op);
+		hq9x_put(&stream, frames[i]->dispatch != NULL);
+		if(frames[i]->dispatch)
+		{
+			hq9x_put_function(&stream, frames[i]->pre_op);
+			hq9x_put_function(&stream, frames[i]->default_op);
+		}
+	}
+	free(frames);
+	hq9x_put_source(&stream, &state->source);
+	hq9x_put_pointer(&stream, &state->source, state->frame->input_pointer);
+	hq9x_put_source(&stream, &state->input);
+
+	hq9x_put(&stream, state->bf != NULL);
+	if(state->bf)
+	{
+		hq9x_put(&stream, state->bf->enabled);
+		hq9x_put(&stream, state->bf->count);
+		hq9x_put(&stream, state->bf->used);
+		hq9x_put(&stream, state->bf->pointer);
+		hq9x_put_bytes(&stream, state->bf->cells, state->bf->used * sizeof(bf_cell_t));
+	}
+	hq9x_put(&stream, state->bef != NULL);
+	if(state->bef)
+	{
+		hq9x_put(&stream, state->bef->enabled);
+		hq9x_put(&stream, state->bef->stringmode);
+		hq9x_put(&stream, state->bef->version);
+		hq9x_put(&stream, state->bef->pointer);
+		hq9x_put_bytes(&stream, state->bef->stack, state->bef->pointer * sizeof(bef_cell_t));
+	}
+	hq9x_put(&stream, state->oo && state->oo->current_object);
+
+	if(fflush(stream.file) != 0 || fsync(fileno(stream.file)) != 0)
+		stream.failed = 1;
+	if(fclose(stream.file) != 0)
+		stream.failed = 1;
+	if(stream.failed || rename(temp, path) != 0)
+	{
+		unlink(temp);
+		return -1;
+	}
+	return 0;
+}
+
+int hq9x_resume(hq9x_state_t * state, const char * path, hq9x_read_t input, hq9x_write_t output, void * user)
+{
+	hq9x_checkpoint_header_t header;
+	hq9x_stream_t stream = { NULL, 0, 0 };
+	function_ptr_t ops[256], pre_op = state->pre_op, default_op = state->default_op;
+	int dialect = state->dialect, charcase = state->charcase, on_error = state->on_error;
+	int sources = 0; /* whether the source and the input are read yet */
+	int has_bf, has_bef, bf_dispatch = 0;
+	size_t i;
+
+	if(!(stream.file = fopen(path, "rb")))
+		return -1;
+	hq9x_get_bytes(&stream, &header, sizeof header);
+	if(stream.failed
+	|| memcmp(header.magic, HQ9X_CHECKPOINT_MAGIC, sizeof header.magic) != 0
+	|| header.version != HQ9X_CHECKPOINT_VERSION
+	|| header.bf_cell_size != sizeof(bf_cell_t) || header.bef_cell_size != sizeof(bef_cell_t)
+	|| header.frame_count == 0)
+	{
+		fclose(stream.file);
+		return -1;
+	}
+
+	hq9x_reset(state, input, output, user);
+	memcpy(ops, state->ops, sizeof ops);
+	state->dialect = header.dialect;
+	state->charcase = hq9x_get(&stream);
+	state->on_error = hq9x_get(&stream);
+	state->exit_with_accumulator = hq9x_get(&stream);
+	state->accumulator = hq9x_get(&stream);
+	state->random = hq9x_get(&stream);
+	state->steps = hq9x_get(&stream);
+	state->output_size = hq9x_get(&stream);
+	state->bf_enabled = hq9x_get(&stream);
+	state->opchar = hq9x_get(&stream);
+	hq9x_get_table(&stream, state->ops, &state->pre_op, &state->default_op);
+	if((bf_dispatch = hq9x_get(&stream)) == 2)
+		stream.watched = 1;
+	state->op = hq9x_get_function(&stream);
+	state->last_op = hq9x_get_function(&stream);
+
+	for(i = 0; i < header.frame_count && !stream.failed; i++)
+	{
+		hq9x_frame_t * frame = hq9x_clear_alloc(HQ9X_MEMORY_FRAMES, sizeof(hq9x_frame_t));
+		if(i == 0)
+			frame->source = state->source; /* the placeholder hq9x_reset made */
+		else
+		{
+			hq9x_get_source(&stream, state, &frame->source);
+			source_retag(&frame->source, HQ9X_MEMORY_TEXT);
+			state->frame->input_pointer = hq9x_get_pointer(&stream, &frame->source);
+		}
+		frame->parent = state->frame;
+		state->frame = frame;
+		frame->op = hq9x_get_function(&stream);
+		frame->last_op = hq9x_get_function(&stream);
+		if(hq9x_get(&stream))
+		{
+			/* only B has a table of its own, and B is not among the BF commands */
+			frame->dispatch = state->ops;
+			frame->pre_op = hq9x_get_function(&stream);
+			frame->default_op = hq9x_get_function(&stream);
+		}
+	}
+	if(!stream.failed)
+	{
+		hq9x_get_source(&stream, state, &state->source);
+		source_retag(&state->source, HQ9X_MEMORY_TEXT);
+		state->frame->input_pointer = hq9x_get_pointer(&stream, &state->source);
+		hq9x_get_source(&stream, state, &state->input);
+		sources = 1;
+	}
+
+	if((has_bf = hq9x_get(&stream)))
+	{
+		size_t count, used, pointer;
+		if(!state->bf)
+			state->bf = clear_alloc(sizeof(bf_state_t));
+		state->bf->enabled = hq9x_get(&stream);
+		count = hq9x_get(&stream);
+		used = hq9x_get_size(&stream, sizeof(bf_cell_t));
+		pointer = hq9x_get(&stream);
+		if(used > count || pointer >= count || count > ((size_t)1 << 30))
+			stream.failed = 1;
+		if(!stream.failed)
+		{
+			hq9x_free(HQ9X_MEMORY_TAPE, state->bf->cells);
+			state->bf->cells = hq9x_clear_alloc(HQ9X_MEMORY_TAPE, (state->bf->count = count) * sizeof(bf_cell_t));
+			state->bf->used = used;
+			state->bf->pointer = pointer;
+			hq9x_get_bytes(&stream, state->bf->cells, used * sizeof(bf_cell_t));
+		}
+	}
+	if((has_bef = hq9x_get(&stream)))
+	{
+		size_t pointer;
+		if(!state->bef)
+			state->bef = clear_alloc(sizeof(bef_state_t));
+		state->bef->enabled = hq9x_get(&stream);
+		state->bef->stringmode = hq9x_get(&stream);
+		state->bef->version = hq9x_get(&stream);
+		pointer = hq9x_get_size(&stream, sizeof(bef_cell_t));
+		if(!stream.failed)
+		{
+			hq9x_free(HQ9X_MEMORY_STACK, state->bef->stack);
+			state->bef->stack = hq9x_clear_alloc(HQ9X_MEMORY_STACK, (state->bef->capacity = pointer + 16) * sizeof(bef_cell_t));
+			state->bef->pointer = pointer;
+			hq9x_get_bytes(&stream, state->bef->stack, pointer * sizeof(bef_cell_t));
+		}
+	}
+	if(hq9x_get(&stream) && !stream.failed)
+		hq9x_new(state);
+	fclose(stream.file);
+
+	if(stream.failed)
+	{
+		while(state->frame)
+		{
+			hq9x_frame_t * frame = state->frame;
+			if(frame->parent)
+				source_free(&frame->source);
+			state->frame = frame->parent;
+			hq9x_free(HQ9X_MEMORY_FRAMES, frame);
+		}
+		if(sources)
+		{
+			source_free(&state->source);
+			source_free(&state->input);
+		}
+		memset(&state->input, 0, sizeof(source_t));
+		memcpy(state->ops, ops, sizeof ops);
+		state->pre_op = pre_op;
+		state->default_op = default_op;
+		state->dialect = dialect;
+		state->charcase = charcase;
+		state->on_error = on_error;
+		hq9x_reset(state, input, output, user);
+		return -1;
+	}
+
+	if(!has_bf)
+		bf_clear(state);
+	if(!has_bef)
+		bef_clear(state);
+
+	/* what the run wrote before is not there to be cached */
+	state->nondeterministic = 1;
+	state->result = NULL;
+	hq9x_schedule_check(state);
+	state->dispatch = bf_dispatch ? hq9x_bf_ops : state->ops;
+	if(stream.watched || state->options.detect_loops)
+		hq9x_watch_loops(state);
+	return HQ9X_RUNNING;
+}
+
+hq9x_state_t * hq9x_clone(const hq9x_state_t * prototype)
+{
+	hq9x_state_t * state = malloc(sizeof(hq9x_state_t));
+
+	memcpy(state, prototype, sizeof(hq9x_state_t));
+	state->dispatch = state->ops;
+	state->bf = NULL;
+	state->bef = NULL;
+	state->oo = NULL;
+	state->result = NULL;
+	state->snapshot = NULL;
+	state->frame = NULL;
+	state->loops = NULL;
+	if(prototype->loops)
+		hq9x_watch_loops(state);
+	if(prototype->profile)
+		state->profile = hq9x_profile_create(prototype->profile->cycles, prototype->profile->rate);
+	if(prototype->bf)
+	{
+		bf_init(state);
+		state->bf->enabled = prototype->bf->enabled;
+	}
+	if(prototype->bef)
+	{
+		bef_init(state);
+		state->bef->enabled = prototype->bef->enabled;
+	}
+	return state;
+}
+
+void hq9x_destroy(hq9x_state_t * state)
+{
+	if(state->snapshot)
+		hq9x_snapshot_free(state->snapshot);
+	bf_clear(state);
+	bef_clear(state);
+	hq9x_oo_clear(state);
+	hq9x_loops_free(state->loops);
+	hq9x_profile_free(state->profile);
+	free(state);
+}
+
+/* Static analysis */
+
+static void hq9x_analyze_discard(void * user, const char * data, size_t size)
+{
+}
+
+/* measured with the command itself, so that the two cannot drift apart */
+static size_t hq9x_bottles_size(hq9x_state_t * state)
+{
+	hq9x_write_t write = state->write;
+	void * user = state->user;
+	hq9x_result_t * result = state->result;
+	size_t max_output = state->options.max_output, output_size = state->output_size, size;
+
+	state->write = hq9x_analyze_discard;
+	state->result = NULL;
+	state->options.max_output = 0;
+	state->output_size = 0;
+	hq9x_bottles(state);
+	size = state->output_size;
+	state->write = write;
+	state->user = user;
+	state->result = result;
+	state->options.max_output = max_output;
+	state->output_size = output_size;
+	return size;
+}
+
+static function_ptr_t hq9x_analyze_op(hq9x_state_t * state, char c)
+{
+	function_ptr_t op = state->ops[source_fold(state->charcase, c)];
+	return op ? op : state->default_op;
+}
+
+static const char * hq9x_analyze_flag(int flag)
+{
+	return flag ? "true" : "false";
+}
+
+/* HQ9+ and the dialects without jumps run each command once, in order, */
+/* so the output size and the accumulator follow from the text up to the first command that depends on more */
+static void hq9x_analyze_linear(hq9x_state_t * state, const char * text, hq9x_write_t output, void * user)
+{
+	size_t length = strlen(text), i, size = 0, bottles = 0;
+	unsigned long long steps = 0;
+	int accumulator = 0, status = -1, error = 0;
+	function_ptr_t last_op = NULL;
+	const char * suggestion = "interpreter";
+
+	/* an empty program still runs its terminating null */
+	for(i = 0; i < (length ? length : 1); i++)
+	{
+		function_ptr_t op = hq9x_analyze_op(state, text[i]);
+
+		if(state->pre_op == hq9x_force_bound && (accumulator == -1 || accumulator == 256))
+			accumulator = 0;
+		steps++;
+		if(op == hq9x_inc_or_alloc)
+		{
+			if(last_op == hq9x_inc)
+				break; /* allocates an object */
+			op = hq9x_inc;
+		}
+
+		if(op == hq9x_nop)
+			;
+		else if(op == hq9x_hello)
+			size += strlen(state->options.hello_message) + 1;
+		else if(op == hq9x_quine)
+			size += length;
+		else if(op == hq9x_bottles)
+			size += bottles ? bottles : (bottles = hq9x_bottles_size(state));
+		else if(op == hq9x_inc)
+			accumulator++;
+		else if(op == hq9x_dec)
+			accumulator--;
+		else if(op == hq9x_square)
+			accumulator = (int)((unsigned)accumulator * (unsigned)accumulator);
+		else if(op == hq9x_output)
+			size += snprintf(NULL, 0, "%d\n", accumulator);
+		else if(op == hq9x_newline)
+			size++;
+		else if(op == hq9x_unknown)
+		{
+			if(state->on_error == ERROR_HALT)
+			{
+				status = 1;
+				error = 1;
+				break;
+			}
+		}
+		else if(op == hq9x_kill)
+		{
+			status = state->exit_with_accumulator ? accumulator : 0;
+			break;
+		}
+		else
+			break; /* input, jumps, BF, objects or the grid */
+		last_op = op;
+	}
+
+	hq9x_report(output, user, "{\"kind\": \"linear\"");
+	if(i < (length ? length : 1) && status == -1)
+	{
+		/* what ran before it is still a lower bound */
+		hq9x_report(output, user, ", \"exact\": false, \"stops_at\": %zu, \"output_bytes_at_least\": %zu", i, size);
+	}
+	else
+	{
+		if(status == -1)
+			status = state->exit_with_accumulator ? accumulator : 0;
+		hq9x_report(output, user, ", \"exact\": true, \"output_bytes\": %zu, \"accumulator\": %d, \"status\": %d, \"steps\": %llu, \"error\": %s",
+			size, accumulator, status, steps, hq9x_analyze_flag(error));
+		if(error || (state->options.max_output && size > state->options.max_output) || (state->options.max_steps && steps > state->options.max_steps))
+			suggestion = "reject";
+	}
+
+	for(i = 0; i < length; i++)
+		if(hq9x_op_reads_input(hq9x_analyze_op(state, text[i])) || (state->pre_op == hq9x_pre_alter_bf && text[i] == ','))
+			break;
+	hq9x_report(output, user, ", \"reads_input\": %s, \"suggestion\": \"%s\"}", hq9x_analyze_flag(i < length), suggestion);
+}
+
+/* the pointer is where it was at the start of each loop as long as every loop moves it back there, */
+/* the cells used then follow from a single pass over the text */
+static void hq9x_analyze_bf(hq9x_state_t * state, const char * text, hq9x_write_t output, void * user)
+{
+	size_t length = strlen(text), i, depth = 0, max_depth = 0, loops = 0, reads = 0, writes = 0, unmatched = 0;
+	size_t * entries = malloc((length + 1) * sizeof(size_t));
+	size_t offset = 0, highest = 0;
+	int bounded = 1;
+
+	for(i = 0; i < length; i++)
+	{
+		function_ptr_t op = hq9x_analyze_op(state, text[i]);
+
+		if(op == bf_right)
+		{
+			if(offset < 30000 && ++offset > highest)
+				highest = offset;
+		}
+		else if(op == bf_left)
+		{
+			if(offset > 0)
+				offset--;
+			else if(depth > 0)
+				bounded = 0; /* stopped at the left end, the loop does not move it back */
+		}
+		else if(op == bf_do)
+		{
+			entries[depth++] = offset;
+			loops++;
+			if(depth > max_depth)
+				max_depth = depth;
+		}
+		else if(op == bf_loop || op == bf_loop_watched)
+		{
+			if(depth == 0)
+			{
+				unmatched++;
+				bounded = 0; /* jumps back to the start */
+			}
+			else if(entries[--depth] != offset)
+				bounded = 0;
+		}
+		else if(op == bf_read)
+			reads++;
+		else if(op == bf_write || op == hq9x_hello || op == hq9x_quine || op == hq9x_bottles)
+			writes++;
+	}
+	unmatched += depth;
+	free(entries);
+
+	hq9x_report(output, user, "{\"kind\": \"bf\", \"loops\": %zu, \"max_depth\": %zu, \"reads\": %zu, \"writes\": %zu, \"balanced\": %s, \"tape_bounded\": %s",
+		loops, max_depth, reads, writes, hq9x_analyze_flag(unmatched == 0), hq9x_analyze_flag(bounded));
+	if(bounded)
+		hq9x_report(output, user, ", \"tape_cells\": %zu", highest + 1);
+	else
+		hq9x_report(output, user, ", \"tape_cells\": null");
+	/* straight code runs once, loops are what compiling pays off for */
+	hq9x_report(output, user, ", \"reads_input\": %s, \"suggestion\": \"%s\"}", hq9x_analyze_flag(reads > 0),
+		unmatched == 0 && loops > 0 ? "jit" : "interpreter");
+}
+
+/* follows every direction the instruction pointer may take over the grid as it is at the start, */
+/* a grid changed by p may lead elsewhere, so the results only hold for programs without a reachable p */
+static void hq9x_analyze_befunge(hq9x_state_t * state, const char * text, hq9x_write_t output, void * user)
+{
+	static const int dx[4] = { 1, 0, -1, 0 }, dy[4] = { 0, 1, 0, -1 };
+	size_t width = 80, height = 25, row = 0, column = 0, reachable = 0, top = 0, cells, i;
+	unsigned char * seen; /* one bit for each direction, in and out of string mode */
+	char * grid;
+	size_t * stack;
+	int put = 0, get = 0, reads = 0, writes = 0, random = 0, halts = 0, errors = 0;
+	const char * suggestion;
+
+	/* the grid is at least 80 by 25, lines longer than that are taken as if all were as long */
+	for(i = 0; text[i]; i++)
+	{
+		if(text[i] == '\n')
+		{
+			row++;
+			column = 0;
+			continue;
+		}
+		if(++column > width)
+			width = column;
+	}
+	if(row + 1 > height)
+		height = row + 1;
+	cells = width * height;
+	grid = malloc(cells);
+	memset(grid, ' ', cells);
+	for(i = 0, row = 0, column = 0; text[i]; i++)
+	{
+		if(text[i] == '\n')
+		{
+			row++;
+			column = 0;
+		}
+		else
+			grid[row * width + column++] = text[i];
+	}
+	seen = calloc(cells, 1);
+	stack = malloc(cells * 8 * sizeof(size_t));
+
+	/* a state is the cell, the direction and the string mode */
+	stack[top++] = 0;
+	seen[0] = 1;
+	while(top > 0)
+	{
+		size_t entry = stack[--top], cell = entry >> 3;
+		int dir = entry & 3, string = (entry >> 2) & 1, next[4], count = 0, skip = 0, j;
+		char c = grid[cell];
+
+		if(string)
+		{
+			if(c == '"')
+				string = 0;
+			next[count++] = dir;
+		}
+		else
+		{
+			function_ptr_t op = hq9x_analyze_op(state, c);
+			if(op == bef_right)
+				next[count++] = 0;
+			else if(op == bef_down)
+				next[count++] = 1;
+			else if(op == bef_left)
+				next[count++] = 2;
+			else if(op == bef_up)
+				next[count++] = 3;
+			else if(op == bef_random)
+			{
+				random = 1;
+				for(j = 0; j < 4; j++)
+					next[count++] = j;
+			}
+			else if(op == bef_h_if)
+				next[count++] = 0, next[count++] = 2;
+			else if(op == bef_v_if)
+				next[count++] = 1, next[count++] = 3;
+			else if(op == hq9x_kill)
+				halts = 1;
+			else if(op == hq9x_unknown && state->on_error == ERROR_HALT)
+				errors = 1;
+			else
+			{
+				if(op == bef_string)
+					string = 1;
+				else if(op == bef_bridge)
+					skip = 1;
+				else if(op == bef_put)
+					put = 1;
+				else if(op == bef_get)
+					get = 1;
+				else if(op == bef_scan_int || op == bef_scan_char)
+					reads = 1;
+				else if(op == bef_print_int || op == bef_print_char || op == hq9x_newline)
+					writes = 1;
+				next[count++] = dir;
+			}
+		}
+
+		for(j = 0; j < count; j++)
+		{
+			size_t x = cell % width, y = cell / width, target;
+			int steps = 1 + skip;
+			while(steps-- > 0)
+			{
+				x = (x + width + dx[next[j]]) % width;
+				y = (y + height + dy[next[j]]) % height;
+			}
+			target = y * width + x;
+			if(!(seen[target] & (1 << (next[j] + 4 * string))))
+			{
+				seen[target] |= 1 << (next[j] + 4 * string);
+				stack[top++] = target << 3 | string << 2 | next[j];
+			}
+		}
+	}
+
+	for(i = 0; i < cells; i++)
+		if(seen[i])
+			reachable++;
+	free(stack);
+	free(seen);
+	free(grid);
+
+	/* with no @ nor p in reach it can only be stopped by an unknown command or a limit */
+	if(!halts && !errors && !put)
+		suggestion = "reject";
+	else if(!put)
+		suggestion = "jit";
+	else
+		suggestion = "interpreter";
+	hq9x_report(output, user, "{\"kind\": \"befunge\", \"width\": %zu, \"height\": %zu, \"reachable_cells\": %zu, \"put_reachable\": %s, \"get_reachable\": %s",
+		width, height, reachable, hq9x_analyze_flag(put), hq9x_analyze_flag(get));
+	hq9x_report(output, user, ", \"reads_input\": %s, \"random\": %s, \"writes_output\": %s, \"halt_reachable\": %s, \"error_reachable\": %s, \"suggestion\": \"%s\"}",
+		hq9x_analyze_flag(reads), hq9x_analyze_flag(random), hq9x_analyze_flag(writes), hq9x_analyze_flag(halts), hq9x_analyze_flag(errors), suggestion);
+}
+
+void hq9x_analyze(hq9x_state_t * state, const char * program, size_t size, hq9x_write_t output, void * user)
+{
+	/* the text ends at the first null, as it does when run */
+	char * text = malloc(size + 1);
+	memcpy(text, program, size);
+	text[size] = '\0';
+
+	if(state->dialect == HQ9X_BEFUNGE93)
+		hq9x_analyze_befunge(state, text, output, user);
+	else if(state->ops['['] == bf_do)
+		hq9x_analyze_bf(state, text, output, user);
+	else
+		hq9x_analyze_linear(state, text, output, user);
+	free(text);
+}
+
+/* Performance cliffs */
+
+#if !defined(HQ9X_LIBRARY) || defined(HQ9X_FUZZER)
+
+#define HQ9X_CLIFF_SIZE 4096 /* bytes a text is repeated up to for the smaller of two runs */
+#define HQ9X_CLIFF_SCALE 8 /* how many times more it is repeated for the larger one */
+#define HQ9X_CLIFF_GROWTH 2.5 /* time growing this many times faster than the work is a cliff */
+#define HQ9X_CLIFF_STEPS 10000000 /* limits of the runs, unless others are given */
+#define HQ9X_CLIFF_OUTPUT 16777216
+#define HQ9X_CLIFF_SECONDS 0.005 /* quicker runs are too close to the noise to compare */
+
+/* the work of a run is its steps and every byte it handled, the time it takes should grow with it */
+typedef struct hq9x_cost
+{
+	double seconds;
+	double work;
+	int status;
+} hq9x_cost_t;
+
+static void hq9x_cost_write(void * user, const char * data, size_t size)
+{
+	*(size_t *)user += size;
+}
+
+/* the quickest of three runs */
+static void hq9x_cost_measure(int dialect, const hq9x_options_t * options, const char * program, size_t program_size,
+	const char * input, size_t input_size, hq9x_cost_t * cost)
+{
+	hq9x_options_t measure_options = *options;
+	hq9x_state_t * state;
+	hq9x_record_t record;
+	size_t output_size = 0;
+	int i;
+
+	measure_options.cache_directory = NULL;
+	measure_options.cache_results = 0;
+	if(!measure_options.max_steps)
+		measure_options.max_steps = HQ9X_CLIFF_STEPS;
+	if(!measure_options.max_output)
+		measure_options.max_output = HQ9X_CLIFF_OUTPUT;
+	state = hq9x_create(dialect, &measure_options);
+	for(i = 0; i < 3; i++)
+	{
+		double seconds = hq9x_now();
+		record.data = input;
+		record.pos = 0;
+		record.size = input_size;
+		record.write = hq9x_cost_write;
+		record.user = &output_size;
+		output_size = 0;
+		cost->status = hq9x_run(state, program, program_size, hq9x_read_record, hq9x_write_record, &record);
+		seconds = hq9x_now() - seconds;
+		if(i == 0 || seconds < cost->seconds)
+			cost->seconds = seconds;
+	}
+	cost->work = (double)hq9x_steps(state) + program_size + input_size + output_size;
+	hq9x_destroy(state);
+}
+
+static char * hq9x_repeat(const char * text, size_t size, size_t copies)
+{
+	char * repeated = malloc(size * copies + 1);
+	size_t i;
+	for(i = 0; i < copies; i++)
+		memcpy(repeated + i * size, text, size);
+	repeated[size * copies] = '\0';
+	return repeated;
+}
+
+/* how many times faster than the work the time grows when the program, or else the input, is repeated more */
+/* returns 0 if it cannot tell, the copies of the text for the larger run are stored in copies */
+static double hq9x_cliff(int dialect, const hq9x_options_t * options, const char * program, size_t program_size,
+	const char * input, size_t input_size, int scale_input, size_t * copies)
+{
+	hq9x_cost_t costs[2];
+	const char * text = scale_input ? input : program;
+	size_t size = scale_input ? input_size : program_size;
+	int i;
+
+	if(size == 0)
+		return 0;
+	*copies = (HQ9X_CLIFF_SIZE + size - 1) / size;
+	for(i = 0; i < 2; i++)
+	{
+		char * repeated = hq9x_repeat(text, size, *copies);
+		if(scale_input)
+			hq9x_cost_measure(dialect, options, program, program_size, repeated, size * *copies, &costs[i]);
+		else
+			hq9x_cost_measure(dialect, options, repeated, size * *copies, input, input_size, &costs[i]);
+		free(repeated);
+		if(i == 0)
+			*copies *= HQ9X_CLIFF_SCALE;
+	}
+
+	/* a run stopped by a limit did less work than the text asked for */
+	if(costs[0].status >= HQ9X_EXIT_STEPS || costs[1].status >= HQ9X_EXIT_STEPS
+	|| costs[1].seconds < HQ9X_CLIFF_SECONDS || costs[0].seconds <= 0 || costs[0].work <= 0)
+		return 0;
+	return (costs[1].seconds / costs[0].seconds) / (costs[1].work / costs[0].work);
+}
+
+#endif /* !HQ9X_LIBRARY || HQ9X_FUZZER */
+
+#ifdef HQ9X_FUZZER
+/* libFuzzer entry point, built with: clang -O1 -g -fsanitize=fuzzer -DHQ9X_LIBRARY -DHQ9X_FUZZER hq9x.c */
+/* the first byte picks the dialect, the program follows up to a 0 byte, and the input after it */
+/* a program or input hitting a cliff aborts, for the fuzzer to keep it */
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+	hq9x_options_t options;
+	const char * program;
+	const char * input = "";
+	const char * end;
+	size_t program_size, input_size = 0, copies;
+	int dialect, scale_input;
+
+	if(size < 2)
+		return 0;
+	dialect = data[0] % (HQ9X_H9F + 1);
+	program = (const char *)data + 1;
+	program_size = size - 1;
+	if((end = memchr(program, '\0', program_size)))
+	{
+		input = end + 1;
+		input_size = program_size - (input - program);
+		program_size = end - program;
+	}
+
+	hq9x_default_options(&options);
+	for(scale_input = 0; scale_input < 2; scale_input++)
+	{
+		double growth = hq9x_cliff(dialect, &options, program, program_size, input, input_size, scale_input, &copies);
+		if(growth > HQ9X_CLIFF_GROWTH)
+		{
+			fprintf(stderr, "The time grows %.1f times faster than the work with the size of the %s\n",
+				growth, scale_input ? "input" : "program");
+			abort();
+		}
+	}
+	return 0;
+}
+#endif /* HQ9X_FUZZER */
+
+#ifndef HQ9X_LIBRARY
+
+static char * readall(int kind, hq9x_read_t input, void * user)
+{
+	size_t size, count;
+	char * buff;
+	char * end;
+	end = buff = hq9x_malloc(kind, 1 + (size = 16));
+
+	while((count = input(user, end, 16)) == 16)
+	{
+		buff = hq9x_realloc(kind, buff, 1 + (size += 16));
+		end = buff + size - 16;
+	}
+
+	buff[size - 16 + count] = '\0';
+
+	return hq9x_realloc(kind, buff, 1 + size - 16 + count);
+}
+
+/* writes text as a quoted JSON string */
+static void print_json_string(FILE * file, const char * text)
+{
+	fputc('"', file);
+	for(; *text; text++)
+	{
+		unsigned char c = *text;
+		if(c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if(c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+void show_version(void)
+{
+	printf(HQ9X_VERSION);
+	exit(0);
+}
+
+void usage(char * argv0)
+{
+	printf("Usage: %s <options>? <inputfile>?\n\
+Valid options:\n\
+\t-a\tOn exit, give accumulator as result\n\
+\t-c<chr>\tCase sensitivity, values:\n\
+\t\t0 - insensitive ('X' and 'x' are the same)\n\
+\t\ta - lower case ('X' and 'x' are different)\n\
+\t\tA - upper case ('x' is invalid)\n\
+\t\td - default for dialect\n\
+\t-h\tThis help page\n\
+\t-n<chr>\tOperation on newline:\n\
+\t\ti - ignore\n\
+\t\tu - unknown (signal if enabled)\n\
+\t\tw - as whitespace (default)\n\
+\t-m\tMessage to write on command H\n\
+\t-p\tProfile the program, with a report on the standard error at the end\n\
+\t-pc\tThe same, also sampling the cycles each command takes\n\
+\t-u<chr>\tOperation on unknown command:\n\
+\t\th - signal error and halt\n\
+\t\tn - insert newline (Deadfish)\n\
+\t\tq - quiet (comment)\n\
+\t\ts - signal error\n\
+\t-v\tCurrent version\n\
+\t-x\tChange dialect, currently supported:\n\
+\t\tall\t\t\tThe default dialect, a combination of several extensions\n\
+\t\tb hq9+ hq9x\t\tOriginal HQ9+ by Cliff L. Biffle\n\
+\t\t\thttp://web.archive.org/web/20090602074545/http://www.cliff.biffle.org/esoterica/hq9plus.html\n\
+\t\to chiqrsx9+ chiqrsx9x\tCHIQRSX9+, A Turing-complete extension by Ørjen Johansen\n\
+\t\t\thttp://oerjan.nvg.org/esoteric/chiqrsx9+.pl\n\
+\t\tm hq9++ hq9xx\t\tObject-oriented extension by David Morgan-Mar\n\
+\t\t\thttp://www.dangermouse.net/esoteric/hq9plusplus.html\n\
+\t\tz hq9+-\t\t\tObject-oriented extension with quality control by melikamp\n\
+\t\t\thttp://melikamp.com/features/hq9pm.shtml\n\
+\t\th9+ h9x\t\t\tA restriction, presumably by User:Phantom Hoover\n\
+\t\t\thttp://esolangs.org/wiki/H9%%2B\n\
+\t\thq9+b hq9xb\t\tAn extension that is ℒ-complete, by User:Oleg\n\
+\t\t\thttp://esolangs.org/wiki/HQ9%%2BB\n\
+\t\t2d hq9+2d hq9x2d\tAn extension where the program counter moves in 4 directions, by Kenner Gordon\n\
+\t\t\thttp://esolangs.org/wiki/HQ9%%2B2D\n\
+\t\tbf\t\t\tThe BrainF language by Urban Müller\n\
+\t\tdf deadfish\t\tThe Deadfish language, a HQ9+ derivative by Jonathan Todd Skinner\n\
+\t\t\thttp://web.archive.org/web/20100425075447/http://www.jonathantoddskinner.com/projects/deadfish.html\n\
+\t\tfishq9+ fishq9x\t\tA combination of Deadfish and HQ9+ by User:Erinius\n\
+\t\t\thttp://esolangs.org/wiki/FISHQ9%%2B\n\
+\t\tbf93\t\t\tThe Befunge-93 language by Chris Pressey\n\
+\t\t\thttp://catseye.tc/node/Befunge-93.html\n\
+\t\th9f\t\t\tThe Hq9eF language by Egor Promyshlennikov (2016)\n\
+\t\t\thttp://esolangs.org/wiki/Special:Search/H9F\n\
+\t\t+\t\t\tThe + language, possibly by User:HolyCloudNinja\n\
+\t\t\thttp://esolangs.org/wiki/%%2B\n\
+\t\tnil\t\t\tThe Nil language by Sascha René Leib\n\
+\t\t\thttp://esolangs.org/wiki/%%2B\n\
+\t-w<chr>\tOperation on whitespace:\n\
+\t\ti - ignore (default)\n\
+\t\tu - unknown (signal if enabled)\n\
+\t--cache <dir>\tKeep prepared programs in <dir> (default: $EHQI_CACHE_DIR)\n\
+\t--cache-limit <bytes>\tEvict least recently used entries above this size (default: 64 MiB)\n\
+\t--no-cache\tDo not use the program cache\n\
+\t--no-result-cache\tAlways run deterministic programs instead of replaying their output\n\
+\t--result-limit <bytes>\tDo not cache results with more output than this\n\
+\t--max-steps <n>\tStop a program after <n> commands, with status 120\n\
+\t--max-time <seconds>\tStop a program after this much time, with status 121\n\
+\t--max-output <bytes>\tStop a program writing more than this, with status 122\n\
+\t--max-memory <bytes>\tStop a program allocating more than this, with status 123\n\
+\t--checkpoint <file>\tSave the running program to <file> on SIGUSR2\n\
+\t--checkpoint-every <n>\tAlso save it every <n> steps\n\
+\t--resume <file>\tContinue a saved program instead of starting one\n\
+\t--sample <file>\tSample where the program is on SIGPROF and write the stacks to <file>,\n\
+\t\tin the folded format of flame graph tools\n\
+\t--sample-rate <n>\tSamples per second of processor time for --sample (default: 997)\n\
+\t--perf-counters\tCount the cycles, instructions, branch and cache misses of the run, in total and per step\n\
+\t--perf-counters-json\tThe same, as one JSON object\n\
+\t--stats-fd <n>\tWhere to write a line of statistics of the run on SIGUSR1 (default: 2)\n\
+\t--mem-report\tShow the bytes allocated for each kind of data at the end and at their peak,\n\
+\t\tnot counting the job and thread tables of --batch, --serve and --bench, and the lines of --each-line\n\
+\t--mem-report-json\tThe same, as one JSON object\n\
+\t--detect-loops\tStop a program that is stuck in a loop without I/O, with status 124\n\
+\t--each-line\tPrepare the program once and run it for every line of the standard input\n\
+\t--lanes <n>\tRun <n> lines of --each-line at once, in lockstep while a BF program allows it,\n\
+\t\tand report the inputs per second\n\
+\t<file> -| <options>? <file>\tRun the programs as a pipeline in one process, options carry over\n\
+\t--stage-threads\tRun each stage of a pipeline on its own thread\n\
+\t--batch <manifest>\tRun the jobs listed in <manifest>, one per line:\n\
+\t\t<program> <dialect> [<input> [<output>]], with - for no input or the standard output\n\
+\t--slice <n>\tInterleave the --batch jobs of each thread, switching after <n> commands\n\
+\t\tor when a job waits for input, and report the steps and slices each job used\n\
+\t--serve <socket>\tServe requests on a local socket until interrupted:\n\
+\t\tRUN <dialect> <program size> <input size> [<flag>...], then the program and the input\n\
+\t\tSTATS, for the number of requests and latency percentiles\n\
+\t\tA request stops after 10 seconds, unless --max-steps or --max-time is given\n\
+\t--max-inflight <n>\tConnections --serve accepts at once, others are told to retry (default: 4 per thread)\n\
+\t--max-request <n>\tBytes of program and input a --serve request may send, larger ones are refused (default: 64 MiB)\n\
+\t--threads <n>\tNumber of worker threads for --batch and --serve (default: one per processor)\n\
+\t--differential\tRun the program over the standard input with the naive interpreter and each\n\
+\t\toptimized path, and report where their output, exit status or accumulator differ\n\
+\t--differential-random <n>\tThe same for <n> random programs and inputs of the dialect, 0 for no end\n\
+\t--cliffs <n>\tTry <n> random programs and inputs of the dialect, 0 for no end, repeating each to find\n\
+\t\twhere the time grows much faster than the work, and save those for --bench\n\
+\t--cliffs-dir <dir>\tWhere --cliffs saves them, with their lines in <dir>/manifest (default: bench/cliffs)\n\
+\t--seed <n>\tSeed of --differential-random and --cliffs (default: from the time)\n\
+\t--analyze\tReport what can be told about the program without running it, as JSON\n\
+\t--bench <manifest>\tTime the cases listed in <manifest> and report them as JSON, one per line:\n\
+\t\t<program> <dialect> [<input> [<max steps>]], with - for no input,\n\
+\t\tpaths relative to <manifest> and <file>*<n> for <n> copies of <file>\n\
+\t--bench-runs <n>\tTimed runs of each case (default: 10)\n\
+\t--bench-warmup <n>\tRuns of each case before timing it (default: 2)\n\
+",
+	argv0);
+	/* melikamp is referred to as Ivan Grigoryevich Zaigralin in the sources */
+	exit(0);
+}
+
+static size_t hq9x_read_file(void * user, char * buffer, size_t size)
+{
+	return fread(buffer, 1, size, (FILE *)user);
+}
+
+static size_t hq9x_read_stdin(void * user, char * buffer, size_t size)
+{
+	return fread(buffer, 1, size, stdin);
+}
+
+static void hq9x_write_stdout(void * user, const char * data, size_t size)
+{
+	fwrite(data, 1, size, stdout);
+}
+
+static void hq9x_write_stderr(void * user, const char * data, size_t size)
+{
+	fwrite(data, 1, size, stderr);
+}
+
+static void hq9x_write_file(void * user, const char * data, size_t size)
+{
+	fwrite(data, 1, size, (FILE *)user);
+}
+
+/* Hardware performance counters */
+
+enum
+{
+	HQ9X_CYCLES,
+	HQ9X_INSTRUCTIONS,
+	HQ9X_BRANCH_MISSES,
+	HQ9X_CACHE_MISSES,
+	HQ9X_COUNTERS
+};
+
+static const char * const hq9x_counter_names[HQ9X_COUNTERS] = { "cycles", "instructions", "branch_misses", "cache_misses" };
+
+typedef struct hq9x_counters
+{
+	int fds[HQ9X_COUNTERS]; /* -1 if the kernel would not open the counter */
+	double values[HQ9X_COUNTERS]; /* scaled up if the counter was multiplexed, -1 if not available */
+	int error; /* why the first counter that could not be opened was not */
+} hq9x_counters_t;
+
+/* counts this thread in user space only, which an unprivileged process is usually allowed */
+static void hq9x_counters_start(hq9x_counters_t * counters)
+{
+	int i;
+#ifdef __linux__
+	static const uint64_t configs[HQ9X_COUNTERS] =
+		{ PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES };
+	struct perf_event_attr attr;
+#endif
+
+	memset(counters, 0, sizeof *counters);
+	for(i = 0; i < HQ9X_COUNTERS; i++)
+	{
+		counters->values[i] = -1;
+#ifdef __linux__
+		memset(&attr, 0, sizeof attr);
+		attr.size = sizeof attr;
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = configs[i];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		counters->fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if(counters->fds[i] == -1 && !counters->error)
+			counters->error = errno;
+#else
+		counters->fds[i] = -1;
+		counters->error = ENOSYS;
+#endif
+	}
+#ifdef __linux__
+	for(i = 0; i < HQ9X_COUNTERS; i++)
+	{
+		if(counters->fds[i] == -1)
+			continue;
+		ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+static void hq9x_counters_stop(hq9x_counters_t * counters)
+{
+	int i;
+#ifdef __linux__
+	for(i = 0; i < HQ9X_COUNTERS; i++)
+		if(counters->fds[i] != -1)
+			ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif
+	for(i = 0; i < HQ9X_COUNTERS; i++)
+	{
+		uint64_t data[3]; /* value, time enabled, time running */
+		if(counters->fds[i] == -1)
+			continue;
+		if(read(counters->fds[i], data, sizeof data) == sizeof data && data[2])
+			counters->values[i] = data[0] * ((double)data[1] / data[2]);
+		close(counters->fds[i]);
+		counters->fds[i] = -1;
+	}
+}
+
+/* the totals, and per step of the guest program if the steps are known */
+static void hq9x_counters_report(hq9x_counters_t * counters, const char * dialect, unsigned long long steps, int json)
+{
+	double * values = counters->values;
+	double ipc = values[HQ9X_CYCLES] > 0 && values[HQ9X_INSTRUCTIONS] >= 0 ? values[HQ9X_INSTRUCTIONS] / values[HQ9X_CYCLES] : -1;
+	int available = 0, i;
+
+	for(i = 0; i < HQ9X_COUNTERS; i++)
+		if(values[i] >= 0)
+			available = 1;
+	if(json)
+	{
+		fprintf(stderr, "{\"dialect\": \"%s\", \"steps\": %llu, \"available\": %s", dialect, steps, available ? "true" : "false");
+		if(counters->error)
+			fprintf(stderr, ", \"error\": \"%s\"", strerror(counters->error));
+		for(i = 0; i < HQ9X_COUNTERS; i++)
+		{
+			if(values[i] < 0)
+				fprintf(stderr, ", \"%s\": null", hq9x_counter_names[i]);
+			else
+				fprintf(stderr, ", \"%s\": %.0f", hq9x_counter_names[i], values[i]);
+		}
+		if(ipc < 0)
+			fprintf(stderr, ", \"ipc\": null");
+		else
+			fprintf(stderr, ", \"ipc\": %.3f", ipc);
+		fprintf(stderr, ", \"per_step\": {");
+		for(i = 0; i < HQ9X_COUNTERS; i++)
+		{
+			if(values[i] < 0 || !steps)
+				fprintf(stderr, "%s\"%s\": null", i ? ", " : "", hq9x_counter_names[i]);
+			else
+				fprintf(stderr, "%s\"%s\": %.4f", i ? ", " : "", hq9x_counter_names[i], values[i] / steps);
+		}
+		fprintf(stderr, "}, \"memory\": ");
+		hq9x_memory_report(hq9x_write_stderr, NULL, 1);
+		fprintf(stderr, "}\n");
+		return;
+	}
+
+	if(!available)
+	{
+		int error = counters->error ? counters->error : ENOSYS;
+		fprintf(stderr, "Performance counters unavailable: %s%s\n", strerror(error),
+			error == EACCES || error == EPERM ? " (see /proc/sys/kernel/perf_event_paranoid)" : "");
+		return;
+	}
+	fprintf(stderr, "Counters: %s, %llu steps\n", dialect, steps);
+	for(i = 0; i < HQ9X_COUNTERS; i++)
+	{
+		fprintf(stderr, "%14s ", hq9x_counter_names[i]);
+		if(values[i] < 0)
+			fprintf(stderr, "%16s\n", "unavailable");
+		else if(steps)
+			fprintf(stderr, "%16.0f %12.4f per step\n", values[i], values[i] / steps);
+		else
+			fprintf(stderr, "%16.0f\n", values[i]);
+	}
+	if(ipc >= 0)
+		fprintf(stderr, "%14s %16.3f\n", "IPC", ipc);
+}
+
+/* Batch mode */
+
+typedef struct hq9x_job
+{
+	char * program_path;
+	char * input_path; /* NULL for no input */
+	char * output_path; /* NULL for the standard output */
+	char * program; /* shared between the jobs of the same program */
+	int dialect;
+	int status;
+	double seconds;
+	unsigned long long steps;
+	unsigned long slices, blocked; /* only counted when scheduled */
+} hq9x_job_t;
+
+/* jobs are popped from the tail by the owner and stolen from the head by the others */
+typedef struct hq9x_deque
+{
+	pthread_mutex_t lock;
+	size_t * jobs;
+	size_t head, tail;
+} hq9x_deque_t;
+
+typedef struct hq9x_batch
+{
+	hq9x_job_t * jobs;
+	size_t count;
+	hq9x_deque_t * deques;
+	int threads;
+	unsigned long slice; /* 0 to run each job to completion */
+	const hq9x_options_t * options;
+	pthread_mutex_t output_lock;
+} hq9x_batch_t;
+
+typedef struct hq9x_worker
+{
+	hq9x_batch_t * batch;
+	int index;
+	pthread_t thread;
+} hq9x_worker_t;
+
+typedef struct hq9x_job_io
+{
+	FILE * input;
+	int fd; /* the input of a scheduled job, read without blocking */
+	FILE * output;
+	char * buffer; /* output collected for the standard output */
+	size_t size, capacity;
+} hq9x_job_io_t;
+
+static size_t hq9x_job_read(void * user, char * buffer, size_t size)
+{
+	hq9x_job_io_t * io = user;
+	return io->input ? fread(buffer, 1, size, io->input) : 0;
+}
+
+static size_t hq9x_job_read_nonblocking(void * user, char * buffer, size_t size)
+{
+	hq9x_job_io_t * io = user;
+	ssize_t count;
+	if(io->fd == -1)
+		return 0;
+	while((count = read(io->fd, buffer, size)) == -1 && errno == EINTR)
+		;
+	if(count == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? HQ9X_WOULD_BLOCK : 0;
+	return count;
+}
+
+static void hq9x_job_write(void * user, const char * data, size_t size)
+{
+	hq9x_job_io_t * io = user;
+	if(io->output)
+	{
+		fwrite(data, 1, size, io->output);
+		return;
+	}
+	if(io->size + size > io->capacity)
+	{
+		while(io->size + size > io->capacity)
+			io->capacity = io->capacity ? 2 * io->capacity : 4096;
+		io->buffer = hq9x_realloc(HQ9X_MEMORY_HOST, io->buffer, io->capacity);
+	}
+	memcpy(io->buffer + io->size, data, size);
+	io->size += size;
+}
+
+static void hq9x_job_close(hq9x_batch_t * batch, hq9x_job_io_t * io)
+{
+	if(io->output)
+		fclose(io->output);
+	if(io->buffer)
+	{
+		pthread_mutex_lock(&batch->output_lock);
+		fwrite(io->buffer, 1, io->size, stdout);
+		fflush(stdout);
+		pthread_mutex_unlock(&batch->output_lock);
+		hq9x_free(HQ9X_MEMORY_HOST, io->buffer);
+	}
+}
+
+static int hq9x_job_take(hq9x_batch_t * batch, int index, size_t * job)
+{
+	int i;
+	hq9x_deque_t * deque = &batch->deques[index];
+
+	pthread_mutex_lock(&deque->lock);
+	if(deque->head < deque->tail)
+	{
+		*job = deque->jobs[--deque->tail];
+		pthread_mutex_unlock(&deque->lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	for(i = 1; i < batch->threads; i++)
+	{
+		deque = &batch->deques[(index + i) % batch->threads];
+		pthread_mutex_lock(&deque->lock);
+		if(deque->head < deque->tail)
+		{
+			*job = deque->jobs[deque->head++];
+			pthread_mutex_unlock(&deque->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&deque->lock);
+	}
+	return 0;
+}
+
+static void * hq9x_worker(void * argument)
+{
+	hq9x_worker_t * worker = argument;
+	hq9x_batch_t * batch = worker->batch;
+	hq9x_state_t * states[HQ9X_H9F + 1] = { NULL };
+	size_t index;
+	int i;
+
+	while(hq9x_job_take(batch, worker->index, &index))
+	{
+		hq9x_job_t * job = &batch->jobs[index];
+		hq9x_job_io_t io;
+		double start = hq9x_now();
+
+		memset(&io, 0, sizeof io);
+		if(job->input_path && !(io.input = fopen(job->input_path, "r")))
+			fprintf(stderr, "Unable to open %s for reading\n", job->input_path);
+		if(job->output_path && !(io.output = fopen(job->output_path, "w")))
+			fprintf(stderr, "Unable to open %s for writing\n", job->output_path);
+
+		/* one state per dialect and worker, reused across the jobs */
+		if(!states[job->dialect])
+			states[job->dialect] = hq9x_create(job->dialect, batch->options);
+		if(job->program && (!job->input_path || io.input) && (!job->output_path || io.output))
+			job->status = hq9x_run(states[job->dialect], job->program, strlen(job->program), hq9x_job_read, hq9x_job_write, &io);
+		else
+			job->status = 1;
+
+		if(io.input)
+			fclose(io.input);
+		hq9x_job_close(batch, &io);
+		job->seconds = hq9x_now() - start;
+	}
+
+	for(i = 0; i <= HQ9X_H9F; i++)
+		if(states[i])
+			hq9x_destroy(states[i]);
+	return NULL;
+}
+
+/* the jobs a scheduling worker interleaves at once, more are taken as these finish */
+#define HQ9X_SCHEDULE_WIDTH 256
+
+typedef struct hq9x_task
+{
+	hq9x_job_t * job;
+	hq9x_state_t * state;
+	hq9x_job_io_t io;
+	double start;
+	int blocked;
+} hq9x_task_t;
+
+static void hq9x_task_end(hq9x_batch_t * batch, hq9x_task_t * task)
+{
+	hq9x_job_t * job = task->job;
+
+	job->status = hq9x_finish(task->state);
+	job->steps = hq9x_steps(task->state);
+	hq9x_destroy(task->state);
+	if(task->io.fd != -1)
+		close(task->io.fd);
+	hq9x_job_close(batch, &task->io);
+	job->seconds = hq9x_now() - task->start;
+}
+
+/* runs many jobs on one thread, switching after each slice or when a job waits for its input */
+static void * hq9x_scheduler(void * argument)
+{
+	hq9x_worker_t * worker = argument;
+	hq9x_batch_t * batch = worker->batch;
+	hq9x_state_t * templates[HQ9X_H9F + 1] = { NULL };
+	hq9x_task_t ** tasks = malloc(HQ9X_SCHEDULE_WIDTH * sizeof(hq9x_task_t *)); /* the states refer to their tasks, which must not move */
+	struct pollfd * fds = malloc(HQ9X_SCHEDULE_WIDTH * sizeof(struct pollfd));
+	size_t active = 0, index;
+	int more = 1;
+	int i;
+
+	while(1)
+	{
+		size_t runnable = 0, waiting = 0, t;
+
+		while(more && active < HQ9X_SCHEDULE_WIDTH)
+		{
+			hq9x_task_t * task;
+			hq9x_job_t * job;
+
+			if(!(more = hq9x_job_take(batch, worker->index, &index)))
+				break;
+			task = malloc(sizeof(hq9x_task_t));
+			job = &batch->jobs[index];
+			memset(task, 0, sizeof *task);
+			task->job = job;
+			task->io.fd = -1;
+			task->start = hq9x_now();
+			if(job->input_path && (task->io.fd = open(job->input_path, O_RDONLY | O_NONBLOCK)) == -1)
+				fprintf(stderr, "Unable to open %s for reading\n", job->input_path);
+			if(job->output_path && !(task->io.output = fopen(job->output_path, "w")))
+				fprintf(stderr, "Unable to open %s for writing\n", job->output_path);
+			if(!job->program || (job->input_path && task->io.fd == -1) || (job->output_path && !task->io.output))
+			{
+				if(task->io.fd != -1)
+					close(task->io.fd);
+				hq9x_job_close(batch, &task->io);
+				job->status = 1;
+				free(task);
+				continue;
+			}
+
+			/* clones of a per worker template are cheap to set up for each job */
+			if(!templates[job->dialect])
+				templates[job->dialect] = hq9x_create(job->dialect, batch->options);
+			task->state = hq9x_clone(templates[job->dialect]);
+			if(hq9x_start(task->state, job->program, strlen(job->program), hq9x_job_read_nonblocking, hq9x_job_write, &task->io) == HQ9X_FINISHED)
+			{
+				hq9x_task_end(batch, task);
+				free(task);
+				continue;
+			}
+			tasks[active++] = task;
+		}
+		if(active == 0)
+			break;
+
+		for(t = 0; t < active; )
+		{
+			hq9x_task_t * task = tasks[t];
+			int result;
+
+			if(task->blocked)
+			{
+				t++;
+				continue;
+			}
+			result = hq9x_step(task->state, batch->slice);
+			task->job->slices++;
+			if(result == HQ9X_FINISHED)
+			{
+				hq9x_task_end(batch, task);
+				free(task);
+				tasks[t] = tasks[--active];
+				continue;
+			}
+			if(result == HQ9X_BLOCKED)
+			{
+				task->blocked = 1;
+				task->job->blocked++;
+			}
+			else
+				runnable++;
+			t++;
+		}
+
+		/* parked jobs are only resumed once their input has something to read */
+		for(t = 0; t < active; t++)
+		{
+			if(!tasks[t]->blocked)
+				continue;
+			fds[waiting].fd = tasks[t]->io.fd;
+			fds[waiting].events = POLLIN;
+			fds[waiting].revents = 0;
+			waiting++;
+		}
+		if(waiting == 0)
+			continue;
+		if(poll(fds, waiting, runnable ? 0 : -1) > 0)
+		{
+			size_t w = 0;
+			for(t = 0; t < active; t++)
+			{
+				if(!tasks[t]->blocked)
+					continue;
+				if(fds[w++].revents)
+					tasks[t]->blocked = 0;
+			}
+		}
+	}
+
+	for(i = 0; i <= HQ9X_H9F; i++)
+		if(templates[i])
+			hq9x_destroy(templates[i]);
+	free(tasks);
+	free(fds);
+	return NULL;
+}
+
+static int hq9x_job_compare(const void * first, const void * second)
+{
+	return strcmp((*(hq9x_job_t * const *)first)->program_path, (*(hq9x_job_t * const *)second)->program_path);
+}
+
+/* each line of the manifest is: program dialect [input [output]], with - for none */
+/* the paths of the jobs and the jobs themselves, the programs are shared between jobs and freed by the caller */
+static void hq9x_batch_free_jobs(hq9x_batch_t * batch)
+{
+	size_t i;
+	for(i = 0; i < batch->count; i++)
+	{
+		free(batch->jobs[i].program_path);
+		free(batch->jobs[i].input_path);
+		free(batch->jobs[i].output_path);
+	}
+	free(batch->jobs);
+	batch->jobs = NULL;
+	batch->count = 0;
+}
+
+static int hq9x_batch(const char * manifest, int threads, unsigned long slice, const hq9x_options_t * options)
+{
+	hq9x_batch_t batch;
+	hq9x_worker_t * workers;
+	hq9x_job_t ** sorted;
+	FILE * file;
+	char * text;
+	char * line;
+	char * next;
+	size_t capacity = 0, i, lineno = 0;
+	double start, seconds;
+	int failed = 0;
+
+	if(!(file = fopen(manifest, "r")))
+	{
+		fprintf(stderr, "Unable to open %s for reading\n", manifest);
+		return 1;
+	}
+	text = readall(HQ9X_MEMORY_HOST, hq9x_read_file, file);
+	fclose(file);
+
+	memset(&batch, 0, sizeof batch);
+	for(line = text; line; line = next)
+	{
+		char * fields[4] = { NULL };
+		char * save;
+		int count = 0, dialect;
+
+		if((next = strchr(line, '\n')))
+			*next++ = '\0';
+		lineno++;
+		if(*line == '#')
+			continue;
+		for(count = 0; count < 4; count++)
+			if(!(fields[count] = strtok_r(count ? NULL : line, " \t\r", &save)))
+				break;
+		if(count == 0)
+			continue;
+		if(count < 2)
+		{
+			fprintf(stderr, "%s:%lu: expected: program dialect [input [output]]\n", manifest, (unsigned long)lineno);
+			failed = 1;
+			break;
+		}
+		if((dialect = hq9x_dialect_by_name(fields[1])) == -1)
+		{
+			fprintf(stderr, "%s:%lu: unrecognized dialect: %s\n", manifest, (unsigned long)lineno, fields[1]);
+			failed = 1;
+			break;
+		}
+
+		if(batch.count == capacity)
+		{
+			hq9x_job_t * jobs = realloc(batch.jobs, (capacity ? 2 * capacity : 64) * sizeof(hq9x_job_t));
+			if(!jobs)
+			{
+				fprintf(stderr, "%s:%lu: unable to allocate the jobs\n", manifest, (unsigned long)lineno);
+				failed = 1;
+				break;
+			}
+			batch.jobs = jobs;
+			capacity = capacity ? 2 * capacity : 64;
+		}
+		memset(&batch.jobs[batch.count], 0, sizeof(hq9x_job_t));
+		batch.jobs[batch.count].dialect = dialect;
+		batch.jobs[batch.count].program_path = strdup(fields[0]);
+		if(fields[2] && strcmp(fields[2], "-") != 0)
+			batch.jobs[batch.count].input_path = strdup(fields[2]);
+		if(fields[3] && strcmp(fields[3], "-") != 0)
+			batch.jobs[batch.count].output_path = strdup(fields[3]);
+		batch.count++;
+	}
+	hq9x_free(HQ9X_MEMORY_HOST, text);
+	if(failed)
+	{
+		hq9x_batch_free_jobs(&batch);
+		return 1;
+	}
+
+	/* every program is read only once, however many jobs run it */
+	sorted = malloc(batch.count * sizeof(hq9x_job_t *));
+	for(i = 0; i < batch.count; i++)
+		sorted[i] = &batch.jobs[i];
+	qsort(sorted, batch.count, sizeof(hq9x_job_t *), hq9x_job_compare);
+	for(i = 0; i < batch.count; i++)
+	{
+		if(i > 0 && strcmp(sorted[i]->program_path, sorted[i - 1]->program_path) == 0)
+		{
+			sorted[i]->program = sorted[i - 1]->program;
+			continue;
+		}
+		if((file = fopen(sorted[i]->program_path, "r")))
+		{
+			sorted[i]->program = readall(HQ9X_MEMORY_TEXT, hq9x_read_file, file);
+			fclose(file);
+		}
+		else
+			fprintf(stderr, "Unable to open %s for reading\n", sorted[i]->program_path);
+	}
+
+	if(threads < 1)
+		threads = 1;
+	batch.threads = threads;
+	batch.slice = slice;
+	batch.options = options;
+	batch.deques = clear_alloc(threads * sizeof(hq9x_deque_t));
+	pthread_mutex_init(&batch.output_lock, NULL);
+	for(i = 0; i < threads; i++)
+	{
+		pthread_mutex_init(&batch.deques[i].lock, NULL);
+		batch.deques[i].jobs = malloc((batch.count / threads + 1) * sizeof(size_t));
+	}
+	for(i = 0; i < batch.count; i++)
+	{
+		hq9x_deque_t * deque = &batch.deques[i % threads];
+		deque->jobs[deque->tail++] = i;
+	}
+
+	start = hq9x_now();
+	workers = malloc(threads * sizeof(hq9x_worker_t));
+	for(i = 0; i < threads; i++)
+	{
+		workers[i].batch = &batch;
+		workers[i].index = i;
+		pthread_create(&workers[i].thread, NULL, slice ? hq9x_scheduler : hq9x_worker, &workers[i]);
+	}
+	for(i = 0; i < threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	seconds = hq9x_now() - start;
+
+	for(i = 0; i < batch.count; i++)
+	{
+		hq9x_job_t * job = &batch.jobs[i];
+		if(slice)
+			fprintf(stderr, "job %lu\t%s\tstatus %d\t%llu steps\t%lu slices\t%lu blocked\t%.3f ms\n", (unsigned long)i + 1, job->program_path,
+				job->status, job->steps, job->slices, job->blocked, job->seconds * 1e3);
+		else
+			fprintf(stderr, "job %lu\t%s\tstatus %d\t%.3f ms\n", (unsigned long)i + 1, job->program_path, job->status, job->seconds * 1e3);
+		if(job->status != 0)
+			failed++;
+	}
+	fprintf(stderr, "%lu jobs (%d failed) on %d threads in %.3f s, %.1f jobs/s\n",
+		(unsigned long)batch.count, failed, threads, seconds, seconds > 0 ? batch.count / seconds : 0.0);
+
+	for(i = 0; i < batch.count; i++)
+	{
+		if(i + 1 == batch.count || sorted[i]->program != sorted[i + 1]->program)
+			hq9x_free(HQ9X_MEMORY_TEXT, sorted[i]->program);
+	}
+	for(i = 0; i < threads; i++)
+	{
+		pthread_mutex_destroy(&batch.deques[i].lock);
+		free(batch.deques[i].jobs);
+	}
+	pthread_mutex_destroy(&batch.output_lock);
+	free(batch.deques);
+	free(workers);
+	free(sorted);
+	hq9x_batch_free_jobs(&batch);
+	return failed ? 1 : 0;
+}
+
+/* Record mode */
+
+/* runs the loaded program once for each line of the standard input, which is the input of that run */
+/* with lanes, that many lines are run at once in lockstep, and the throughput is reported to compare with a single lane */
+static int hq9x_each_line(hq9x_state_t * state, int lanes)
+{
+	char ** lines = NULL;
+	size_t * sizes = NULL, * capacities = NULL;
+	hq9x_job_io_t * outputs = NULL;
+	void ** users = NULL;
+	int * statuses = NULL;
+	unsigned long inputs = 0, peeled = 0;
+	double start = hq9x_now(), seconds;
+	ssize_t length;
+	int failed = 0;
+	int report = lanes > 0;
+	int l, count;
+
+	if(lanes < 1)
+		lanes = 1;
+	lines = clear_alloc(lanes * sizeof(char *));
+	sizes = malloc(lanes * sizeof(size_t));
+	capacities = clear_alloc(lanes * sizeof(size_t));
+	outputs = clear_alloc(lanes * sizeof(hq9x_job_io_t));
+	users = malloc(lanes * sizeof(void *));
+	statuses = malloc(lanes * sizeof(int));
+	for(l = 0; l < lanes; l++)
+		users[l] = &outputs[l];
+
+	do
+	{
+		for(count = 0; count < lanes; count++)
+		{
+			if((length = getline(&lines[count], &capacities[count], stdin)) == -1)
+				break;
+			sizes[count] = length;
+		}
+		if(count == 0)
+			break;
+
+		if(lanes == 1)
+		{
+			hq9x_record_t record = { lines[0], 0, sizes[0], hq9x_write_stdout, NULL };
+			statuses[0] = hq9x_rerun(state, hq9x_read_record, hq9x_write_record, &record);
+		}
+		else
+		{
+			/* collected so that the outputs keep the order of the lines */
+			peeled += hq9x_rerun_lockstep(state, count, (const char * const *)lines, sizes, hq9x_job_write, users, statuses);
+			for(l = 0; l < count; l++)
+			{
+				if(outputs[l].size)
+					fwrite(outputs[l].buffer, 1, outputs[l].size, stdout);
+				outputs[l].size = 0;
+			}
+		}
+		for(l = 0; l < count; l++)
+			if(statuses[l] != 0)
+				failed = 1;
+		inputs += count;
+	} while(count == lanes);
+	seconds = hq9x_now() - start;
+
+	if(report)
+		fprintf(stderr, "%lu inputs in %.3f s, %.1f inputs/s, %d lanes, %lu left lockstep\n",
+			inputs, seconds, seconds > 0 ? inputs / seconds : 0.0, lanes, peeled);
+	for(l = 0; l < lanes; l++)
+	{
+		free(lines[l]);
+		hq9x_free(HQ9X_MEMORY_HOST, outputs[l].buffer);
+	}
+	free(lines);
+	free(sizes);
+	free(capacities);
+	free(outputs);
+	free(users);
+	free(statuses);
+	return failed;
+}
+
+/* Pipeline mode */
+
+#define HQ9X_PIPE_SIZE 65536
+#define HQ9X_PIPELINE_SLICE 4096
+
+/* the output of one stage that is the input of the next */
+typedef struct hq9x_pipe
+{
+	char * data;
+	size_t head, size, capacity;
+	int closed; /* the writing stage has finished */
+	int abandoned; /* the reading stage has finished, further output is dropped */
+	int threaded; /* bounded and blocking, otherwise it grows and the reader is told to wait */
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} hq9x_pipe_t;
+
+typedef struct hq9x_stage
+{
+	int dialect;
+	hq9x_options_t options;
+	const char * path;
+	char * program;
+	hq9x_state_t * state;
+	hq9x_pipe_t * in; /* NULL for the standard input */
+	hq9x_pipe_t * out; /* NULL for the standard output */
+	int status;
+	int finished;
+	int broken; /* wrote to a stage that had finished, the run is stopped once the write returns */
+	pthread_t thread;
+} hq9x_stage_t;
+
+static size_t hq9x_pipe_read(hq9x_pipe_t * pipe, char * buffer, size_t size)
+{
+	size_t count;
+
+	if(pipe->threaded)
+	{
+		pthread_mutex_lock(&pipe->lock);
+		while(pipe->head == pipe->size && !pipe->closed)
+			pthread_cond_wait(&pipe->changed, &pipe->lock);
+	}
+	else if(pipe->head == pipe->size && !pipe->closed)
+		return HQ9X_WOULD_BLOCK;
+
+	count = pipe->size - pipe->head;
+	if(count > size)
+		count = size;
+	memcpy(buffer, pipe->data + pipe->head, count);
+	pipe->head += count;
+	if(pipe->head == pipe->size)
+		pipe->head = pipe->size = 0;
+
+	if(pipe->threaded)
+	{
+		pthread_cond_broadcast(&pipe->changed);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+	return count;
+}
+
+/* returns 0 if the reading stage has finished */
+static int hq9x_pipe_write(hq9x_pipe_t * pipe, const char * data, size_t size)
+{
+	int open;
+
+	if(!pipe->threaded)
+	{
+		if(pipe->abandoned)
+			return 0;
+		if(pipe->size + size > pipe->capacity)
+		{
+			while(pipe->size + size > pipe->capacity)
+				pipe->capacity *= 2;
+			pipe->data = hq9x_realloc(HQ9X_MEMORY_HOST, pipe->data, pipe->capacity);
+		}
+		memcpy(pipe->data + pipe->size, data, size);
+		pipe->size += size;
+		return 1;
+	}
+
+	pthread_mutex_lock(&pipe->lock);
+	while(size > 0 && !pipe->abandoned)
+	{
+		size_t count;
+		while(pipe->size == pipe->capacity && !pipe->abandoned)
+			pthread_cond_wait(&pipe->changed, &pipe->lock);
+		if(pipe->abandoned)
+			break;
+		if(pipe->head > 0)
+		{
+			/* move the unread part to the front, instead of wrapping around */
+			memmove(pipe->data, pipe->data + pipe->head, pipe->size - pipe->head);
+			pipe->size -= pipe->head;
+			pipe->head = 0;
+		}
+		count = pipe->capacity - pipe->size;
+		if(count > size)
+			count = size;
+		memcpy(pipe->data + pipe->size, data, count);
+		pipe->size += count;
+		data += count;
+		size -= count;
+		pthread_cond_broadcast(&pipe->changed);
+	}
+	open = !pipe->abandoned;
+	pthread_mutex_unlock(&pipe->lock);
+	return open;
+}
+
+static void hq9x_pipe_close(hq9x_pipe_t * pipe, int abandon)
+{
+	if(pipe->threaded)
+		pthread_mutex_lock(&pipe->lock);
+	if(abandon)
+		pipe->abandoned = 1;
+	else
+		pipe->closed = 1;
+	if(pipe->threaded)
+	{
+		pthread_cond_broadcast(&pipe->changed);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+}
+
+static size_t hq9x_stage_read(void * user, char * buffer, size_t size)
+{
+	hq9x_stage_t * stage = user;
+	return stage->in ? hq9x_pipe_read(stage->in, buffer, size) : fread(buffer, 1, size, stdin);
+}
+
+static void hq9x_stage_write(void * user, const char * data, size_t size)
+{
+	hq9x_stage_t * stage = user;
+	if(!stage->out)
+		fwrite(data, 1, size, stdout);
+	else if(!hq9x_pipe_write(stage->out, data, size))
+		stage->broken = 1; /* the result of a cached run is replayed before the run can be halted */
+}
+
+static void hq9x_stage_end(hq9x_stage_t * stage)
+{
+	stage->status = hq9x_finish(stage->state);
+	if(stage->broken)
+		stage->status = 1; /* as a closed pipe would */
+	stage->finished = 1;
+	if(stage->out)
+		hq9x_pipe_close(stage->out, 0);
+	if(stage->in)
+		hq9x_pipe_close(stage->in, 1);
+}
+
+static void * hq9x_stage_thread(void * argument)
+{
+	hq9x_stage_t * stage = argument;
+	if(hq9x_start(stage->state, stage->program, strlen(stage->program), hq9x_stage_read, hq9x_stage_write, stage) != HQ9X_FINISHED)
+	{
+		while(!stage->broken && hq9x_step(stage->state, HQ9X_PIPELINE_SLICE) != HQ9X_FINISHED)
+			;
+	}
+	hq9x_stage_end(stage);
+	return NULL;
+}
+
+/* runs all stages on the calling thread */
+static void hq9x_pipeline_step(hq9x_stage_t * stages, int count)
+{
+	int i;
+
+	for(i = 0; i < count; i++)
+	{
+		if(hq9x_start(stages[i].state, stages[i].program, strlen(stages[i].program), hq9x_stage_read, hq9x_stage_write, &stages[i]) == HQ9X_FINISHED)
+			hq9x_stage_end(&stages[i]);
+	}
+
+	/* driven by the last stage: a stage waiting for input hands over to the one before it, fresh output to the one after it */
+	i = count - 1;
+	while(!stages[count - 1].finished)
+	{
+		hq9x_stage_t * stage = &stages[i];
+		size_t before = stage->out ? stage->out->size : 0;
+		int result;
+
+		if(stage->finished)
+		{
+			i++;
+			continue;
+		}
+		result = hq9x_step(stage->state, HQ9X_PIPELINE_SLICE);
+		if(result == HQ9X_FINISHED || stage->broken)
+		{
+			hq9x_stage_end(stage);
+			i++;
+		}
+		else if(result == HQ9X_BLOCKED)
+			i--;
+		else if(stage->out && stage->out->size > before)
+			i++;
+	}
+
+	/* the stages before it still run to their end, or until they write to the finished one */
+	for(i = 0; i < count - 1; i++)
+	{
+		if(stages[i].finished)
+			continue;
+		while(!stages[i].broken && hq9x_step(stages[i].state, HQ9X_PIPELINE_SLICE) != HQ9X_FINISHED)
+			;
+		hq9x_stage_end(&stages[i]);
+	}
+}
+
+/* runs the stages in one process, each feeding its output to the next one */
+/* returns the status of the last stage, as a shell would */
+static int hq9x_pipeline(hq9x_stage_t * stages, int count, int threaded)
+{
+	hq9x_pipe_t * pipes = clear_alloc(count * sizeof(hq9x_pipe_t));
+	int i, status;
+
+	for(i = 0; i < count; i++)
+	{
+		FILE * file = fopen(stages[i].path, "r");
+		if(!file)
+		{
+			fprintf(stderr, "Unable to open %s for reading\n", stages[i].path);
+			while(i-- > 0)
+				hq9x_free(HQ9X_MEMORY_TEXT, stages[i].program);
+			free(pipes);
+			return 1;
+		}
+		stages[i].program = readall(HQ9X_MEMORY_TEXT, hq9x_read_file, file);
+		fclose(file);
+	}
+	for(i = 0; i < count; i++)
+	{
+		if(i + 1 < count)
+		{
+			pipes[i].threaded = threaded;
+			pipes[i].data = hq9x_malloc(HQ9X_MEMORY_HOST, pipes[i].capacity = HQ9X_PIPE_SIZE);
+			pthread_mutex_init(&pipes[i].lock, NULL);
+			pthread_cond_init(&pipes[i].changed, NULL);
+			stages[i].out = &pipes[i];
+		}
+		stages[i].in = i > 0 ? &pipes[i - 1] : NULL;
+		stages[i].state = hq9x_create(stages[i].dialect, &stages[i].options);
+	}
+
+	if(threaded)
+	{
+		for(i = 0; i < count; i++)
+			pthread_create(&stages[i].thread, NULL, hq9x_stage_thread, &stages[i]);
+		for(i = 0; i < count; i++)
+			pthread_join(stages[i].thread, NULL);
+	}
+	else
+		hq9x_pipeline_step(stages, count);
+	status = stages[count - 1].status;
+
+	for(i = 0; i < count; i++)
+	{
+		hq9x_destroy(stages[i].state);
+		hq9x_free(HQ9X_MEMORY_TEXT, stages[i].program);
+		if(i + 1 < count)
+		{
+			pthread_mutex_destroy(&pipes[i].lock);
+			pthread_cond_destroy(&pipes[i].changed);
+			hq9x_free(HQ9X_MEMORY_HOST, pipes[i].data);
+		}
+	}
+	free(pipes);
+	return status;
+}
+
+/* Server mode */
+
+/*
+ * A connection carries any number of requests, one after the other:
+ *   RUN <dialect> <program size> <input size> [<flag>...]\n<program><input>
+ *   STATS\n
+ * The output of a run is streamed back as O <size>\n<data> chunks, followed by S <status>\n.
+ * STATS is answered by a single line, errors by E <message>\n.
+ * A request larger than --max-request is answered by E request too large\n, and the connection closed.
+ */
+
+#define HQ9X_LATENCIES 65536
+#define HQ9X_MAX_REQUEST ((size_t)64 << 20) /* bytes of program and input a request may send, by default */
+#define HQ9X_SERVE_SECONDS 10.0 /* time a request may run for, unless a step or time limit is given */
+
+typedef struct hq9x_server
+{
+	int listener;
+	int threads, max_inflight;
+	size_t max_request; /* program and input bytes, larger requests are refused before they are read */
+	hq9x_options_t options; /* with the default time limit, so that no request keeps its worker for good */
+	hq9x_state_t * templates[HQ9X_H9F + 1]; /* prepared once, cloned by the workers */
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	int * queue; /* accepted connections waiting for a worker */
+	size_t head, queued;
+	int inflight; /* connections queued or being served */
+	int stopping;
+
+	double latencies[HQ9X_LATENCIES]; /* the most recent ones */
+	unsigned long requests;
+} hq9x_server_t;
+
+typedef struct hq9x_connection
+{
+	int fd;
+	char in[4096];
+	size_t in_pos, in_size;
+	char out[4096];
+	size_t out_size;
+	const char * input;
+	size_t input_pos, input_size;
+} hq9x_connection_t;
+
+static volatile sig_atomic_t hq9x_server_stop = 0;
+
+static void hq9x_server_signal(int signum)
+{
+	hq9x_server_stop = 1;
+}
+
+static int hq9x_connection_send(hq9x_connection_t * connection, const char * data, size_t size)
+{
+	while(size > 0)
+	{
+		ssize_t count = write(connection->fd, data, size);
+		if(count <= 0)
+		{
+			if(count == -1 && errno == EINTR)
+				continue;
+			return 0;
+		}
+		data += count;
+		size -= count;
+	}
+	return 1;
+}
+
+static void hq9x_connection_flush(hq9x_connection_t * connection)
+{
+	char header[32];
+	if(connection->out_size > 0)
+	{
+		snprintf(header, sizeof header, "O %lu\n", (unsigned long)connection->out_size);
+		hq9x_connection_send(connection, header, strlen(header));
+		hq9x_connection_send(connection, connection->out, connection->out_size);
+		connection->out_size = 0;
+	}
+}
+
+/* reads exactly size bytes, returns 0 if the connection is closed first */
+static int hq9x_connection_read(hq9x_connection_t * connection, char * buffer, size_t size)
+{
+	while(size > 0)
+	{
+		size_t count;
+		if(connection->in_pos == connection->in_size)
+		{
+			ssize_t received = read(connection->fd, connection->in, sizeof connection->in);
+			if(received <= 0)
+			{
+				if(received == -1 && errno == EINTR)
+					continue;
+				return 0;
+			}
+			connection->in_pos = 0;
+			connection->in_size = received;
+		}
+		count = connection->in_size - connection->in_pos;
+		if(count > size)
+			count = size;
+		memcpy(buffer, connection->in + connection->in_pos, count);
+		connection->in_pos += count;
+		buffer += count;
+		size -= count;
+	}
+	return 1;
+}
+
+static int hq9x_connection_getline(hq9x_connection_t * connection, char * line, size_t size)
+{
+	size_t length = 0;
+	while(hq9x_connection_read(connection, &line[length], 1))
+	{
+		if(line[length] == '\n')
+		{
+			line[length] = '\0';
+			return 1;
+		}
+		if(++length == size)
+			return 0;
+	}
+	return 0;
+}
+
+static size_t hq9x_connection_input(void * user, char * buffer, size_t size)
+{
+	hq9x_connection_t * connection = user;
+	if(size > connection->input_size - connection->input_pos)
+		size = connection->input_size - connection->input_pos;
+	memcpy(buffer, connection->input + connection->input_pos, size);
+	connection->input_pos += size;
+	return size;
+}
+
+static void hq9x_connection_output(void * user, const char * data, size_t size)
+{
+	hq9x_connection_t * connection = user;
+	while(size > 0)
+	{
+		size_t count = sizeof connection->out - connection->out_size;
+		if(count > size)
+			count = size;
+		memcpy(connection->out + connection->out_size, data, count);
+		connection->out_size += count;
+		data += count;
+		size -= count;
+		if(connection->out_size == sizeof connection->out)
+			hq9x_connection_flush(connection);
+	}
+}
+
+static int hq9x_latency_compare(const void * first, const void * second)
+{
+	double a = *(const double *)first, b = *(const double *)second;
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static void hq9x_server_stats(hq9x_server_t * server, char * line, size_t size)
+{
+	double * sorted;
+	size_t count;
+	unsigned long requests;
+
+	pthread_mutex_lock(&server->lock);
+	requests = server->requests;
+	count = requests < HQ9X_LATENCIES ? requests : HQ9X_LATENCIES;
+	sorted = malloc((count + 1) * sizeof(double));
+	memcpy(sorted, server->latencies, count * sizeof(double));
+	pthread_mutex_unlock(&server->lock);
+
+	if(count == 0)
+	{
+		snprintf(line, size, "requests 0\n");
+		free(sorted);
+		return;
+	}
+	qsort(sorted, count, sizeof(double), hq9x_latency_compare);
+	snprintf(line, size, "requests %lu p50 %.3f ms p90 %.3f ms p99 %.3f ms max %.3f ms\n", requests,
+		sorted[count * 50 / 100] * 1e3, sorted[count * 90 / 100] * 1e3, sorted[count * 99 / 100] * 1e3, sorted[count - 1] * 1e3);
+	free(sorted);
+}
+
+/* applies a command line flag to the options, returns 0 if it is not one that can be set per request */
+static int hq9x_request_flag(hq9x_options_t * options, const char * flag)
+{
+	if(flag[0] != '-')
+		return 0;
+	switch(flag[1])
+	{
+	case 'a':
+		options->exit_with_accumulator = 1;
+		return 1;
+	case 'c':
+		if(flag[2] == '0' || flag[2] == 'a' || flag[2] == 'A')
+			options->charcase = flag[2] == '0' ? 0 : flag[2];
+		else if(flag[2] == 'd')
+			options->charcase = -1;
+		else
+			return 0;
+		return 1;
+	case 'u':
+		if(!flag[2] || !strchr("nqsh", flag[2]))
+			return 0;
+		options->on_unknown = flag[2];
+		return 1;
+	case 'w':
+		if(!flag[2] || !strchr("ui", flag[2]))
+			return 0;
+		options->on_whitespace = flag[2];
+		return 1;
+	case 'n':
+		if(!flag[2] || !strchr("wui", flag[2]))
+			return 0;
+		options->on_newline = flag[2];
+		return 1;
+	}
+	return 0;
+}
+
+static void hq9x_serve_connection(hq9x_server_t * server, int fd, hq9x_state_t ** states)
+{
+	hq9x_connection_t connection;
+	char line[1024];
+
+	memset(&connection, 0, sizeof connection);
+	connection.fd = fd;
+	while(hq9x_connection_getline(&connection, line, sizeof line))
+	{
+		char * fields[3];
+		char * flag;
+		char * save;
+		char * data;
+		hq9x_options_t options = server->options;
+		hq9x_state_t * state;
+		int dialect, custom = 0, i, status;
+		unsigned long program_size, input_size;
+		double start = hq9x_now();
+
+		if(strcmp(line, "STATS") == 0)
+		{
+			hq9x_server_stats(server, line, sizeof line);
+			hq9x_connection_send(&connection, line, strlen(line));
+			continue;
+		}
+		if(strncmp(line, "RUN ", 4) != 0)
+		{
+			hq9x_connection_send(&connection, "E unknown request\n", 18);
+			break;
+		}
+		for(i = 0; i < 3; i++)
+			if(!(fields[i] = strtok_r(i ? NULL : line + 4, " ", &save)))
+				break;
+		if(i < 3)
+		{
+			hq9x_connection_send(&connection, "E expected: RUN <dialect> <program size> <input size>\n", 54);
+			break;
+		}
+		program_size = strtoul(fields[1], NULL, 10);
+		input_size = strtoul(fields[2], NULL, 10);
+		while((flag = strtok_r(NULL, " ", &save)))
+		{
+			if(!hq9x_request_flag(&options, flag))
+				break;
+			custom = 1;
+		}
+
+		/* refused without reading them, the connection cannot be kept in step after that */
+		if(program_size > server->max_request || input_size > server->max_request - program_size
+		|| !(data = hq9x_malloc(HQ9X_MEMORY_HOST, program_size + input_size + 1)))
+		{
+			hq9x_connection_send(&connection, "E request too large\n", 20);
+			break;
+		}
+		if(!hq9x_connection_read(&connection, data, program_size + input_size))
+		{
+			hq9x_free(HQ9X_MEMORY_HOST, data);
+			break;
+		}
+		if(flag)
+		{
+			hq9x_free(HQ9X_MEMORY_HOST, data);
+			snprintf(line, sizeof line, "E invalid flag: %s\n", flag);
+			hq9x_connection_send(&connection, line, strlen(line));
+			continue;
+		}
+		if((dialect = hq9x_dialect_by_name(fields[0])) == -1)
+		{
+			hq9x_free(HQ9X_MEMORY_HOST, data);
+			hq9x_connection_send(&connection, "E unrecognized dialect\n", 23);
+			continue;
+		}
+
+		/* requests with their own flags cannot share the prepared states */
+		if(custom)
+			state = hq9x_create(dialect, &options);
+		else
+		{
+			if(!states[dialect])
+				states[dialect] = hq9x_clone(server->templates[dialect]);
+			state = states[dialect];
+		}
+		connection.input = data + program_size;
+		connection.input_pos = 0;
+		connection.input_size = input_size;
+		status = hq9x_run(state, data, program_size, hq9x_connection_input, hq9x_connection_output, &connection);
+		if(custom)
+			hq9x_destroy(state);
+		hq9x_free(HQ9X_MEMORY_HOST, data);
+
+		hq9x_connection_flush(&connection);
+		snprintf(line, sizeof line, "S %d\n", status);
+		hq9x_connection_send(&connection, line, strlen(line));
+
+		pthread_mutex_lock(&server->lock);
+		server->latencies[server->requests++ % HQ9X_LATENCIES] = hq9x_now() - start;
+		pthread_mutex_unlock(&server->lock);
+	}
+}
+
+static void * hq9x_server_worker(void * argument)
+{
+	hq9x_server_t * server = argument;
+	hq9x_state_t * states[HQ9X_H9F + 1] = { NULL };
+	int fd, i;
+
+	while(1)
+	{
+		pthread_mutex_lock(&server->lock);
+		while(server->queued == 0 && !server->stopping)
+			pthread_cond_wait(&server->ready, &server->lock);
+		if(server->queued == 0)
+		{
+			pthread_mutex_unlock(&server->lock);
+			break;
+		}
+		fd = server->queue[server->head];
+		server->head = (server->head + 1) % server->max_inflight;
+		server->queued--;
+		pthread_mutex_unlock(&server->lock);
+
+		hq9x_serve_connection(server, fd, states);
+		close(fd);
+
+		pthread_mutex_lock(&server->lock);
+		server->inflight--;
+		pthread_mutex_unlock(&server->lock);
+	}
+
+	for(i = 0; i <= HQ9X_H9F; i++)
+		if(states[i])
+			hq9x_destroy(states[i]);
+	return NULL;
+}
+
+static int hq9x_serve(const char * path, int threads, int max_inflight, size_t max_request, const hq9x_options_t * options)
+{
+	hq9x_server_t * server;
+	pthread_t * workers;
+	struct sockaddr_un address;
+	struct sigaction action;
+	struct stat st;
+	sigset_t signals, old_signals;
+	char line[256];
+	int i;
+
+	if(strlen(path) >= sizeof address.sun_path)
+	{
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return 1;
+	}
+	if(threads < 1)
+		threads = 1;
+	if(max_inflight < threads)
+		max_inflight = threads;
+
+	server = clear_alloc(sizeof(hq9x_server_t));
+	server->threads = threads;
+	server->max_inflight = max_inflight;
+	server->max_request = max_request;
+	server->options = *options;
+	if(!options->max_steps && options->max_seconds <= 0)
+		server->options.max_seconds = HQ9X_SERVE_SECONDS;
+	server->queue = malloc(max_inflight * sizeof(int));
+	for(i = 0; i <= HQ9X_H9F; i++)
+		server->templates[i] = hq9x_create(i, &server->options);
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_cond_init(&server->ready, NULL);
+
+	memset(&address, 0, sizeof address);
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path); /* left over from an earlier server */
+	if((server->listener = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+	|| bind(server->listener, (struct sockaddr *)&address, sizeof address) == -1
+	|| listen(server->listener, max_inflight) == -1)
+	{
+		fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	/* only the accepting thread handles the signals */
+	memset(&action, 0, sizeof action);
+	action.sa_handler = hq9x_server_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+	workers = malloc(threads * sizeof(pthread_t));
+	for(i = 0; i < threads; i++)
+		pthread_create(&workers[i], NULL, hq9x_server_worker, server);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+	while(!hq9x_server_stop)
+	{
+		int fd = accept(server->listener, NULL, NULL);
+		if(fd == -1)
+			continue;
+		pthread_mutex_lock(&server->lock);
+		if(server->inflight >= server->max_inflight)
+		{
+			pthread_mutex_unlock(&server->lock);
+			send(fd, "E busy\n", 7, MSG_NOSIGNAL);
+			close(fd);
+			continue;
+		}
+		server->queue[(server->head + server->queued) % server->max_inflight] = fd;
+		server->queued++;
+		server->inflight++;
+		pthread_cond_signal(&server->ready);
+		pthread_mutex_unlock(&server->lock);
+	}
+
+	close(server->listener);
+	unlink(path);
+	pthread_mutex_lock(&server->lock);
+	server->stopping = 1;
+	pthread_cond_broadcast(&server->ready);
+	pthread_mutex_unlock(&server->lock);
+	for(i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+
+	hq9x_server_stats(server, line, sizeof line);
+	fprintf(stderr, "%s", line);
+
+	for(i = 0; i <= HQ9X_H9F; i++)
+		hq9x_destroy(server->templates[i]);
+	pthread_cond_destroy(&server->ready);
+	pthread_mutex_destroy(&server->lock);
+	free(server->queue);
+	free(server);
+	free(workers);
+	return 0;
+}
+
+/* Live statistics on SIGUSR1 */
+
+static hq9x_state_t * volatile hq9x_stats_state = NULL;
+static int hq9x_stats_fd = 2;
+
+static void hq9x_stats_signal(int signum)
+{
+	char line[256];
+	hq9x_state_t * state = hq9x_stats_state;
+	int saved = errno;
+	if(state)
+	{
+		size_t size = hq9x_stats(state, line, sizeof line);
+		ssize_t written = write(hq9x_stats_fd, line, size);
+		(void)written; /* a failure has nowhere to be reported */
+	}
+	errno = saved;
+}
+
+static void hq9x_stats_watch(hq9x_state_t * state)
+{
+	struct sigaction action;
+	hq9x_stats_state = state;
+	memset(&action, 0, sizeof action);
+	action.sa_handler = state ? hq9x_stats_signal : SIG_DFL;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, NULL);
+}
+
+/* Checkpointed runs */
+
+#define HQ9X_CHECKPOINT_SLICE 1048576 /* steps between looking for a checkpoint request */
+
+static volatile sig_atomic_t hq9x_checkpoint_requested = 0;
+
+static void hq9x_checkpoint_signal(int signum)
+{
+	hq9x_checkpoint_requested = 1;
+}
+
+/* runs or resumes a program, saving it to path on SIGUSR2 and every so many steps */
+static int hq9x_run_checkpointed(hq9x_state_t * state, const char * program, const char * resume, const char * path, unsigned long long every)
+{
+	unsigned long long next = every ? every : ULLONG_MAX;
+	int result;
+
+	if(path)
+	{
+		struct sigaction action;
+		memset(&action, 0, sizeof action);
+		action.sa_handler = hq9x_checkpoint_signal;
+		action.sa_flags = SA_RESTART;
+		sigaction(SIGUSR2, &action, NULL);
+	}
+
+	if(resume)
+	{
+		if((result = hq9x_resume(state, resume, hq9x_read_stdin, hq9x_write_stdout, NULL)) < 0)
+		{
+			fprintf(stderr, "Unable to resume from %s\n", resume);
+			return 1;
+		}
+		if(every)
+			next = hq9x_steps(state) + every;
+	}
+	else
+		result = hq9x_start(state, program, strlen(program), hq9x_read_stdin, hq9x_write_stdout, NULL);
+
+	while(result != HQ9X_FINISHED)
+	{
+		unsigned long long steps = hq9x_steps(state);
+		result = hq9x_step(state, next - steps < HQ9X_CHECKPOINT_SLICE ? next - steps : HQ9X_CHECKPOINT_SLICE);
+		if(path && result != HQ9X_FINISHED && (hq9x_checkpoint_requested || hq9x_steps(state) >= next))
+		{
+			hq9x_checkpoint_requested = 0;
+			/* what the checkpoint has run so far must be out as well */
+			fflush(stdout);
+			if(hq9x_checkpoint(state, path) != 0)
+				fprintf(stderr, "Unable to write checkpoint to %s\n", path);
+			if(every)
+				next = hq9x_steps(state) + every;
+		}
+	}
+	return hq9x_finish(state);
+}
+
+/* Differential testing */
+
+#define HQ9X_DIFFERENTIAL_STEPS 100000 /* limits of the random programs, unless others are given */
+#define HQ9X_DIFFERENTIAL_OUTPUT 1048576
+#define HQ9X_DIFFERENTIAL_SIZE 64 /* longest random program and input */
+
+/* one program and its input, run by each engine in turn */
+typedef struct hq9x_case
+{
+	int dialect;
+	hq9x_options_t options;
+	const char * program;
+	size_t program_size;
+	const char * input;
+	size_t input_size;
+} hq9x_case_t;
+
+/* what a run left behind, for comparing with the naive run */
+typedef struct hq9x_outcome
+{
+	char * output;
+	size_t size, capacity;
+	int status;
+	int accumulator;
+	unsigned long long steps;
+} hq9x_outcome_t;
+
+static void hq9x_outcome_write(void * user, const char * data, size_t size)
+{
+	hq9x_outcome_t * outcome = user;
+	if(outcome->size + size > outcome->capacity)
+	{
+		outcome->capacity = 2 * outcome->capacity + size;
+		outcome->output = realloc(outcome->output, outcome->capacity);
+	}
+	memcpy(outcome->output + outcome->size, data, size);
+	outcome->size += size;
+}
+
+static void hq9x_outcome_start(hq9x_outcome_t * outcome, hq9x_record_t * record, const hq9x_case_t * test)
+{
+	outcome->size = 0;
+	record->data = test->input;
+	record->pos = 0;
+	record->size = test->input_size;
+	record->write = hq9x_outcome_write;
+	record->user = outcome;
+}
+
+static int hq9x_outcome_end(hq9x_outcome_t * outcome, hq9x_state_t * state, int status)
+{
+	outcome->status = status;
+	outcome->accumulator = state->accumulator;
+	outcome->steps = hq9x_steps(state);
+	hq9x_destroy(state);
+	return 1;
+}
+
+/* each engine runs the case a different way, returning 0 if that way does not apply to it */
+
+/* the reference: commands decoded from the text as they run, brackets matched by scanning */
+static int hq9x_engine_naive(const hq9x_case_t * test, const hq9x_outcome_t * reference, hq9x_outcome_t * outcome)
+{
+	hq9x_options_t options = test->options;
+	hq9x_state_t * state;
+	hq9x_record_t record;
+
+	options.naive = 1;
+	state = hq9x_create(test->dialect, &options);
+	hq9x_outcome_start(outcome, &record, test);
+	return hq9x_outcome_end(outcome, state, hq9x_run(state, test->program, test->program_size, hq9x_read_record, hq9x_write_record, &record));
+}
+
+/* the opcode stream and the jump table */
+static int hq9x_engine_compiled(const hq9x_case_t * test, const hq9x_outcome_t * reference, hq9x_outcome_t * outcome)
+{
+	hq9x_state_t * state = hq9x_create(test->dialect, &test->options);
+	hq9x_record_t record;
+
+	hq9x_outcome_start(outcome, &record, test);
+	return hq9x_outcome_end(outcome, state, hq9x_run(state, test->program, test->program_size, hq9x_read_record, hq9x_write_record, &record));
+}
+
+/* the inner loop specialized for the profiler */
+static int hq9x_engine_profiled(const hq9x_case_t * test, const hq9x_outcome_t * reference, hq9x_outcome_t * outcome)
+{
+	hq9x_options_t options = test->options;
+	hq9x_state_t * state;
+	hq9x_record_t record;
+
+	options.profile = 2;
+	state = hq9x_create(test->dialect, &options);
+	hq9x_outcome_start(outcome, &record, test);
+	return hq9x_outcome_end(outcome, state, hq9x_run(state, test->program, test->program_size, hq9x_read_record, hq9x_write_record, &record));
+}
+
+/* a few commands per hq9x_step, as the scheduler of --slice runs programs */
+static int hq9x_engine_sliced(const hq9x_case_t * test, const hq9x_outcome_t * reference, hq9x_outcome_t * outcome)
+{
+	hq9x_state_t * state = hq9x_create(test->dialect, &test->options);
+	hq9x_record_t record;
+	unsigned long slice = 1;
+	int result;
+
+	hq9x_outcome_start(outcome, &record, test);
+	result = hq9x_start(state, test->program, test->program_size, hq9x_read_record, hq9x_write_record, &record);
+	while(result != HQ9X_FINISHED)
+	{
+		result = hq9x_step(state, slice);
+		slice = slice % 7 + 1;
+	}
+	return hq9x_outcome_end(outcome, state, hq9x_finish(state));
+}
+
+/* the second run of a loaded program, after the first one has changed its grid, tape and stack */
+static int hq9x_engine_loaded(const hq9x_case_t * test, const hq9x_outcome_t * reference, hq9x_outcome_t * outcome)
+{
+	hq9x_state_t * state = hq9x_create(test->dialect, &test->options);
+	hq9x_record_t record;
+
+	hq9x_load(state, test->program, test->program_size);
+	hq9x_outcome_start(outcome, &record, test);
+	hq9x_rerun(state, hq9x_read_record, hq9x_write_record, &record);
+	hq9x_outcome_start(outcome, &record, test);
+	return hq9x_outcome_end(outcome, state, hq9x_rerun(state, hq9x_read_record, hq9x_write_record, &record));
+}
+
+/* a BF program in lockstep with a copy of itself, stopped by the same limits */
+static int hq9x_engine_lockstep(const hq9x_case_t * test, const hq9x_outcome_t * reference, hq9x_outcome_t * outcome)
+{
+	hq9x_state_t * state;
+	hq9x_outcome_t copy;
+	const char * inputs[2];
+	size_t sizes[2];
+	void * users[2];
+	int statuses[2];
+
+	if(test->dialect != HQ9X_BRAINF)
+		return 0;
+	state = hq9x_create(test->dialect, &test->options);
+	hq9x_load(state, test->program, test->program_size);
+	memset(&copy, 0, sizeof copy);
+	outcome->size = 0;
+	inputs[0] = inputs[1] = test->input;
+	sizes[0] = sizes[1] = test->input_size;
+	users[0] = &copy;
+	users[1] = outcome;
+	hq9x_rerun_lockstep(state, 2, inputs, sizes, hq9x_outcome_write, users, statuses);
+	free(copy.output);
+	return hq9x_outcome_end(outcome, state, statuses[1]);
+}
+
+/* stopped halfway, saved with hq9x_checkpoint and continued by a fresh state */
+static int hq9x_engine_resumed(const hq9x_case_t * test, const hq9x_outcome_t * reference, hq9x_outcome_t * outcome)
+{
+	char path[] = "/tmp/hq9x-differential-XXXXXX";
+	hq9x_state_t * state;
+	hq9x_record_t record;
+	int result, fd;
+
+	if(reference->steps < 2 || (fd = mkstemp(path)) < 0)
+		return 0;
+	close(fd);
+	state = hq9x_create(test->dialect, &test->options);
+	hq9x_outcome_start(outcome, &record, test);
+	result = hq9x_start(state, test->program, test->program_size, hq9x_read_record, hq9x_write_record, &record);
+	if(result != HQ9X_FINISHED)
+		result = hq9x_step(state, reference->steps / 2);
+	if(result == HQ9X_FINISHED || hq9x_checkpoint(state, path) != 0)
+	{
+		unlink(path);
+		hq9x_finish(state);
+		hq9x_destroy(state);
+		return 0;
 	}
-	else if(state->last_op == hq9x_inc)
+	hq9x_finish(state);
+	hq9x_destroy(state);
+
+	state = hq9x_create(test->dialect, &test->options);
+	result = hq9x_resume(state, path, hq9x_read_record, hq9x_write_record, &record);
+	unlink(path);
+	if(result < 0)
 	{
-		hq9x_divide_by_zero(state);
-		/* unreachable */
-		fprintf(stderr, "Division by zero\n");
-		exit(1);
+		hq9x_destroy(state);
+		return 0;
 	}
-	else if(state->last_op == hq9x_new)
+	while(result != HQ9X_FINISHED)
+		result = hq9x_step(state, ULONG_MAX);
+	return hq9x_outcome_end(outcome, state, hq9x_finish(state));
+}
+
+/* a second run with the caches, loading the program prepared by the first one or replaying its result */
+static int hq9x_engine_cached(const hq9x_case_t * test, const hq9x_outcome_t * reference, hq9x_outcome_t * outcome)
+{
+	char directory[] = "/tmp/hq9x-differential-XXXXXX";
+	hq9x_options_t options = test->options;
+	hq9x_state_t * state;
+	hq9x_record_t record;
+	struct dirent * entry;
+	DIR * dir;
+	int i, status = 0;
+
+	if(!mkdtemp(directory))
+		return 0;
+	options.cache_directory = directory;
+	options.cache_results = 1;
+	for(i = 0; i < 2; i++)
 	{
-		state->oo->current_object->isa->exception(state->oo->current_object, state);
-		/* unreachable */
-		fprintf(stderr, "Unhandled virtual exception\n");
-		exit(1);
+		state = hq9x_create(test->dialect, &options);
+		hq9x_outcome_start(outcome, &record, test);
+		status = hq9x_run(state, test->program, test->program_size, hq9x_read_record, hq9x_write_record, &record);
+		if(i == 0)
+			hq9x_destroy(state);
 	}
-	else
+	hq9x_outcome_end(outcome, state, status);
+
+	if((dir = opendir(directory)))
 	{
-		fprintf(stderr, "Unknown error, please contact the author of the software\n");
-		exit(1);
+		char path[PATH_MAX];
+		while((entry = readdir(dir)))
+		{
+			if(entry->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof path, "%s/%s", directory, entry->d_name);
+			unlink(path);
+		}
+		closedir(dir);
 	}
+	rmdir(directory);
+	return 1;
 }
 
-/* Deep Though API */
+static const struct
+{
+	const char * name;
+	int (*run)(const hq9x_case_t * test, const hq9x_outcome_t * reference, hq9x_outcome_t * outcome);
+} hq9x_engines[] =
+{
+	{ "compiled", hq9x_engine_compiled },
+	{ "profiled", hq9x_engine_profiled },
+	{ "sliced", hq9x_engine_sliced },
+	{ "loaded", hq9x_engine_loaded },
+	{ "lockstep", hq9x_engine_lockstep },
+	{ "resumed", hq9x_engine_resumed },
+	{ "cached", hq9x_engine_cached },
+};
 
-static void * dt_init(void)
+static void hq9x_describe_byte(const hq9x_outcome_t * outcome, size_t offset, char * buffer, size_t size)
 {
-	return malloc(sizeof(long));
+	if(offset < outcome->size)
+		snprintf(buffer, size, "0x%02x", (unsigned char)outcome->output[offset]);
+	else
+		snprintf(buffer, size, "the end");
 }
 
-static void dt_process(void * state)
+/* returns 0 if the outcome is the same as the reference, otherwise tells how they differ */
+static int hq9x_outcome_compare(FILE * report, const char * engine, const hq9x_outcome_t * reference, const hq9x_outcome_t * outcome)
 {
-	*(long *)state = 42;
+	size_t i;
+	int differs = 0;
+
+	for(i = 0; i < reference->size && i < outcome->size && reference->output[i] == outcome->output[i]; i++)
+		;
+	if(i < reference->size || i < outcome->size)
+	{
+		char expected[16], found[16];
+		hq9x_describe_byte(reference, i, expected, sizeof expected);
+		hq9x_describe_byte(outcome, i, found, sizeof found);
+		fprintf(report, "%s: output differs at byte %lu, %s instead of %s\n", engine, (unsigned long)i, found, expected);
+		differs = 1;
+	}
+	if(outcome->status != reference->status)
+	{
+		fprintf(report, "%s: exit status %d instead of %d\n", engine, outcome->status, reference->status);
+		differs = 1;
+	}
+	if(outcome->accumulator != reference->accumulator)
+	{
+		fprintf(report, "%s: accumulator %d instead of %d\n", engine, outcome->accumulator, reference->accumulator);
+		differs = 1;
+	}
+	return differs;
 }
 
-static void dt_log(void * state, FILE * file)
+static void hq9x_print_escaped(FILE * file, const char * data, size_t size)
 {
-	fprintf(file, "%ld\n", *(long *)state);
+	size_t i;
+	fputc('"', file);
+	for(i = 0; i < size; i++)
+	{
+		unsigned char c = data[i];
+		if(c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if(c == '\n')
+			fprintf(file, "\\n");
+		else if(isprint(c))
+			fputc(c, file);
+		else
+			fprintf(file, "\\%03o", c);
+	}
+	fputc('"', file);
 }
 
-static void dt_free(void * state)
+/* runs the case with every engine, returns the number of them that disagree with the naive run */
+static int hq9x_differential_case(FILE * report, const hq9x_case_t * test)
 {
-	free(state);
+	hq9x_outcome_t reference, outcome;
+	size_t i;
+	int failed = 0;
+
+	memset(&reference, 0, sizeof reference);
+	memset(&outcome, 0, sizeof outcome);
+	hq9x_engine_naive(test, NULL, &reference);
+	for(i = 0; i < sizeof hq9x_engines / sizeof hq9x_engines[0]; i++)
+	{
+		if(hq9x_engines[i].run(test, &reference, &outcome) && hq9x_outcome_compare(report, hq9x_engines[i].name, &reference, &outcome))
+			failed++;
+	}
+	free(reference.output);
+	free(outcome.output);
+	return failed;
 }
 
-/* H9F DT operator */
+/* the engines report the limits and errors of the programs on the standard error, which is not what is tested */
+static FILE * hq9x_differential_begin(const hq9x_options_t * options, hq9x_case_t * test, int dialect)
+{
+	FILE * report = fdopen(dup(2), "w");
+	int null = open("/dev/null", O_WRONLY);
+	if(null >= 0)
+	{
+		dup2(null, 2);
+		close(null);
+	}
+	memset(test, 0, sizeof *test);
+	test->dialect = dialect;
+	test->options = *options;
+	test->options.cache_directory = NULL;
+	test->options.cache_results = 0;
+	test->options.max_seconds = 0; /* the engines run at different speeds */
+	test->options.profile = 0;
+	test->options.sample_rate = 0;
+	test->options.naive = 0;
+	return report;
+}
 
-/* TODO: the interpreter should probably consider two-character operators, as this cannot be combined with any other preprocessed dialect */
+/* runs the program over the input with the naive interpreter and every other engine */
+static int hq9x_differential(int dialect, const hq9x_options_t * options, const char * program, const char * input)
+{
+	hq9x_case_t test;
+	FILE * report = hq9x_differential_begin(options, &test, dialect);
+	int failed;
+
+	test.program = program;
+	test.program_size = strlen(program);
+	test.input = input;
+	test.input_size = strlen(input);
+	if((failed = hq9x_differential_case(report, &test)) == 0)
+		fprintf(report, "all %lu engines agree with the naive run\n", (unsigned long)(sizeof hq9x_engines / sizeof hq9x_engines[0]));
+	fclose(report);
+	return failed ? 1 : 0;
+}
 
-static void hq9x_dt_d(hq9x_state_t * state)
+/* xorshift, for the same programs from the same seed everywhere */
+static uint64_t hq9x_differential_random(uint64_t * seed)
 {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
 }
 
-void hq9x_dt_invoke(hq9x_state_t * state)
+/* the characters the dialect has an operation for */
+static size_t hq9x_commands(int dialect, const hq9x_options_t * options, char * commands)
 {
-	void * dt_state = dt_init();
-	dt_process(dt_state);
-	dt_log(dt_state, stdout);
-	dt_free(dt_state);
+	hq9x_state_t * state = hq9x_create(dialect, options);
+	size_t count = 0;
+	int c;
+	for(c = 1; c < 256; c++)
+		if(state->ops[c] && state->ops[c] != hq9x_nop)
+			commands[count++] = c;
+	hq9x_destroy(state);
+	return count;
 }
 
-/* H9F preprocessor operator */
+/* mostly commands of the dialect in either case, with some newlines and other characters */
+static size_t hq9x_random_text(uint64_t * seed, const char * commands, size_t count, char * buffer, size_t length)
+{
+	size_t i;
+	for(i = 0; i < length; i++)
+	{
+		uint64_t random = hq9x_differential_random(seed);
+		unsigned char c;
+		if(random % 16 == 0)
+			c = '\n';
+		else if(random % 16 == 1 || count == 0)
+			c = ' ' + (random >> 8) % 95;
+		else
+			c = commands[(random >> 8) % count];
+		if((random >> 32) & 1)
+			c = toupper(c);
+		buffer[i] = c;
+	}
+	buffer[length] = '\0';
+	return length;
+}
 
-static void hq9x_check_dt(hq9x_state_t * state)
+/* runs count random programs and inputs, or until interrupted if 0 */
+/* the input is made of the same commands, since I and B run it as a program */
+static int hq9x_differential_random_programs(int dialect, const hq9x_options_t * options, unsigned long count, uint64_t seed)
 {
-	if(state->last_op == hq9x_dt_d)
+	char program[HQ9X_DIFFERENTIAL_SIZE + 1], input[HQ9X_DIFFERENTIAL_SIZE + 1];
+	char commands[256];
+	hq9x_case_t test;
+	FILE * report;
+	unsigned long n, failed = 0;
+	size_t count_commands = hq9x_commands(dialect, options, commands);
+
+	report = hq9x_differential_begin(options, &test, dialect);
+	if(!test.options.max_steps)
+		test.options.max_steps = HQ9X_DIFFERENTIAL_STEPS;
+	if(!test.options.max_output)
+		test.options.max_output = HQ9X_DIFFERENTIAL_OUTPUT;
+	if(!seed)
+		seed = time(NULL) ^ (uint64_t)getpid() << 32;
+	fprintf(report, "seed %llu\n", (unsigned long long)seed);
+	fflush(report);
+
+	for(n = 1; count == 0 || n <= count; n++)
 	{
-		if(state->opchar == 't')
+		test.program = program;
+		test.program_size = hq9x_random_text(&seed, commands, count_commands, program, 1 + hq9x_differential_random(&seed) % HQ9X_DIFFERENTIAL_SIZE);
+		test.input = input;
+		test.input_size = hq9x_random_text(&seed, commands, count_commands, input, hq9x_differential_random(&seed) % (HQ9X_DIFFERENTIAL_SIZE + 1));
+		if(hq9x_differential_case(report, &test))
 		{
-			state->op = hq9x_dt_invoke;
+			failed++;
+			fprintf(report, "program %lu: ", n);
+			hq9x_print_escaped(report, program, test.program_size);
+			fprintf(report, " input: ");
+			hq9x_print_escaped(report, input, test.input_size);
+			fprintf(report, "\n");
 		}
-		else
+		if(n % 10000 == 0)
 		{
-			int tmp = state->opchar;
-			state->opchar = 'd';
-			hq9x_unknown(state);
-			state->opchar = tmp;
+			fprintf(report, "%lu programs, %lu with differences\n", n, failed);
+			fflush(report);
 		}
 	}
+	fprintf(report, "%lu programs, %lu with differences\n", n - 1, failed);
+	fclose(report);
+	return failed ? 1 : 0;
 }
 
-/* initialization */
+/* Cliff search */
 
-static void hq9x_initialize_bf(hq9x_state_t * state)
+/* writes the program and the input that hit a cliff into directory, and a line to time them to its manifest for --bench */
+static void hq9x_cliff_save(const char * directory, const char * dialect_name, const char * program, size_t program_size,
+	const char * input, size_t input_size, int scale_input, size_t copies)
 {
-	state->ops['<'] = bf_left;
-	state->ops['>'] = bf_right;
-	state->ops['+'] = bf_inc;
-	state->ops['-'] = bf_dec;
-	state->ops['['] = bf_do;
-	state->ops[']'] = bf_loop;
-	state->ops['.'] = bf_write;
-	state->ops[','] = bf_read;
-	bf_init(state);
-	state->bf->enabled = 1;
+	char name[32], path[PATH_MAX], program_copies[32] = "", input_copies[32] = "";
+	uint64_t key = hq9x_hash(hq9x_hash(0xCBF29CE484222325ULL, program, program_size), input, input_size);
+	FILE * file;
+
+	mkdir(directory, 0777);
+	snprintf(name, sizeof name, "%016llx", (unsigned long long)key);
+	snprintf(scale_input ? input_copies : program_copies, sizeof program_copies, "*%lu", (unsigned long)copies);
+
+	snprintf(path, sizeof path, "%s/%s.prog", directory, name);
+	if((file = fopen(path, "wb")))
+	{
+		fwrite(program, 1, program_size, file);
+		fclose(file);
+	}
+	if(input_size)
+	{
+		snprintf(path, sizeof path, "%s/%s.in", directory, name);
+		if((file = fopen(path, "wb")))
+		{
+			fwrite(input, 1, input_size, file);
+			fclose(file);
+		}
+	}
+	snprintf(path, sizeof path, "%s/manifest", directory);
+	if(!(file = fopen(path, "a")))
+	{
+		fprintf(stderr, "Unable to open %s for writing\n", path);
+		return;
+	}
+	if(input_size)
+		fprintf(file, "%s.prog%s\t%s\t%s.in%s\n", name, program_copies, dialect_name, name, input_copies);
+	else
+		fprintf(file, "%s.prog%s\t%s\n", name, program_copies, dialect_name);
+	fclose(file);
 }
 
-void hq9x_initialize(hq9x_state_t * state, int version)
+/* tries count random programs and inputs of the dialect, or until interrupted if 0, */
+/* repeating each of them to see if the time grows much faster than the work, and saves those that do */
+static int hq9x_cliff_search(int dialect, const char * dialect_name, const hq9x_options_t * options, unsigned long count,
+	uint64_t seed, const char * directory)
 {
-	state->ops['\0'] = hq9x_nop; /* end of file */
-	switch(version)
+	char program[HQ9X_DIFFERENTIAL_SIZE + 1], input[HQ9X_DIFFERENTIAL_SIZE + 1];
+	char commands[256];
+	hq9x_options_t search_options = *options;
+	size_t count_commands = hq9x_commands(dialect, options, commands);
+	size_t program_size, input_size, copies;
+	unsigned long n, found = 0;
+	FILE * report;
+	int null, scale_input;
+
+	/* the limits the programs hit are not what is looked for */
+	report = fdopen(dup(2), "w");
+	if((null = open("/dev/null", O_WRONLY)) >= 0)
 	{
-	case HQ9X_DEFAULT:
-		state->ops['k'] = hq9x_kill;
-	case HQ9X_CHIQRSX9X:
-		state->ops['c'] = hq9x_copy;
-		state->ops['i'] = hq9x_interpret;
-		state->ops['r'] = hq9x_rot13;
-		state->ops['s'] = hq9x_sort;
-		state->ops['x'] = hq9x_turing;
-
-	/* Turing-completeness is enabled through BF-parsing */
-		bf_init(state);
-		state->bf->enabled = 0;
-	/* fallthru; */
-	case HQ9X_ORIGINAL:
-	case HQ9X_OO:
-	case HQ9X_HQ9XBF:
-	case HQ9X_H9F:
-	default:
-		state->ops['q'] = hq9x_quine;
-	case HQ9X_H9X:
-		state->ops['h'] = hq9x_hello;
-		state->ops['9'] = hq9x_bottles;
-	case HQ9X_PLUS:
-		state->ops['+'] = hq9x_inc;
-	case HQ9X_NIL:
-	break;
+		dup2(null, 2);
+		close(null);
+	}
+	search_options.max_seconds = 0;
+	if(!seed)
+		seed = time(NULL) ^ (uint64_t)getpid() << 32;
+	fprintf(report, "seed %llu\n", (unsigned long long)seed);
+	fflush(report);
 
-	case HQ9X_FISHQ9X:
-		state->ops['h'] = hq9x_hello;
-		state->ops['q'] = hq9x_quine;
-		state->ops['9'] = hq9x_bottles;
-		state->ops['+'] = hq9x_inc;
-	case HQ9X_DEADFISH:
-		state->ops['i'] = hq9x_inc;
-		state->ops['d'] = hq9x_dec;
-		state->ops['s'] = hq9x_square;
-		state->ops['o'] = hq9x_output;
-	break;
+	for(n = 1; count == 0 || n <= count; n++)
+	{
+		program_size = hq9x_random_text(&seed, commands, count_commands, program, 1 + hq9x_differential_random(&seed) % HQ9X_DIFFERENTIAL_SIZE);
+		input_size = hq9x_random_text(&seed, commands, count_commands, input, hq9x_differential_random(&seed) % (HQ9X_DIFFERENTIAL_SIZE + 1));
+		for(scale_input = 0; scale_input < 2; scale_input++)
+		{
+			double growth = hq9x_cliff(dialect, &search_options, program, program_size, input, input_size, scale_input, &copies);
+			if(growth <= HQ9X_CLIFF_GROWTH)
+				continue;
+			found++;
+			fprintf(report, "program %lu: the time grows %.1f times faster than the work with the size of the %s: ",
+				n, growth, scale_input ? "input" : "program");
+			hq9x_print_escaped(report, program, program_size);
+			fprintf(report, " input: ");
+			hq9x_print_escaped(report, input, input_size);
+			fprintf(report, "\n");
+			fflush(report);
+			hq9x_cliff_save(directory, dialect_name, program, program_size, input, input_size, scale_input, copies);
+		}
+		if(n % 100 == 0)
+		{
+			fprintf(report, "%lu programs, %lu cliffs\n", n, found);
+			fflush(report);
+		}
+	}
+	fprintf(report, "%lu programs, %lu cliffs\n", n - 1, found);
+	fclose(report);
+	return found ? 1 : 0;
+}
 
-	case HQ9X_BRAINF:
-		hq9x_initialize_bf(state);
-	break;
+/* Benchmark mode */
 
-	case HQ9X_BEFUNGE93:
-		state->ops['+'] = bef_add;
-		state->ops['-'] = bef_sub;
-		state->ops['*'] = bef_mul;
-		state->ops['/'] = bef_div;
-		state->ops['%'] = bef_mod;
-		state->ops['!'] = bef_not;
-		state->ops['`'] = bef_greater;
-		state->ops['>'] = bef_right;
-		state->ops['<'] = bef_left;
-		state->ops['^'] = bef_up;
-		state->ops['v'] = bef_down;
-		state->ops['?'] = bef_random;
-		state->ops['_'] = bef_h_if;
-		state->ops['|'] = bef_v_if;
-		state->ops['"'] = bef_string;
-		state->ops[':'] = bef_dup;
-		state->ops['\\'] = bef_swap;
-		state->ops['$'] = bef_drop;
-		state->ops['.'] = bef_print_int;
-		state->ops[','] = bef_print_char;
-		state->ops['#'] = bef_bridge;
-		state->ops['g'] = bef_get;
-		state->ops['p'] = bef_put;
-		state->ops['&'] = bef_scan_int;
-		state->ops['~'] = bef_scan_char;
-		state->ops['@'] = hq9x_kill;
-		state->ops['0'] = bef_push_digit;
-		state->ops['1'] = bef_push_digit;
-		state->ops['2'] = bef_push_digit;
-		state->ops['3'] = bef_push_digit;
-		state->ops['4'] = bef_push_digit;
-		state->ops['5'] = bef_push_digit;
-		state->ops['6'] = bef_push_digit;
-		state->ops['7'] = bef_push_digit;
-		state->ops['8'] = bef_push_digit;
-		state->ops['9'] = bef_push_digit;
-		state->ops[' '] = hq9x_nop;
-		bef_init(state);
-		state->bef->enabled = 1;
-	break;
-	}
+#define HQ9X_BENCH_RUNS 10
+#define HQ9X_BENCH_WARMUP 2
 
-	source_init(&state->source, stdin);
-	source_init(&state->input, stdin);
-	state->source.text = "";
-	state->accumulator = 0;
+/* a file of the corpus, relative to the manifest unless absolute, name*count being that many copies of it */
+static char * hq9x_bench_read(const char * directory, const char * name, size_t * size)
+{
+	char path[PATH_MAX];
+	char * star;
+	char * text;
+	char * copies;
+	size_t length, count = 1, i;
+	FILE * file;
 
-	if(version == HQ9X_H9F)
+	if(name[0] == '/')
+		snprintf(path, sizeof path, "%s", name);
+	else
+		snprintf(path, sizeof path, "%s/%s", directory, name);
+	if((star = strrchr(path, '*')))
 	{
-		hq9x_initialize_bf(state);
-		state->ops['d'] = hq9x_dt_d;
+		*star = '\0';
+		count = strtoul(star + 1, NULL, 10);
 	}
-	if(version == HQ9X_DEFAULT || version == HQ9X_OO || version == HQ9X_OO_QC)
-		state->ops['+'] = hq9x_inc_or_alloc;
-	if(version == HQ9X_DEFAULT || version == HQ9X_OO_QC)
-		state->ops['-'] = hq9x_quality_control;
-	if(version == HQ9X_DEFAULT || version == HQ9X_HQ9XBF)
-		state->ops['b'] = hq9x_interpret_bf;
-	if(version == HQ9X_DEFAULT || version == HQ9X_2D)
+	if(!(file = fopen(path, "r")))
 	{
-		state->ops['<'] = bef_left;
-		state->ops['>'] = bef_right;
-		state->ops['v'] = bef_down;
-		state->ops['^'] = bef_up;
+		fprintf(stderr, "Unable to open %s for reading\n", path);
+		return NULL;
 	}
+	text = readall(HQ9X_MEMORY_HOST, hq9x_read_file, file);
+	fclose(file);
+
+	length = strlen(text);
+	*size = length * count;
+	if(count == 1)
+		return text;
+	copies = hq9x_malloc(HQ9X_MEMORY_HOST, *size + 1);
+	for(i = 0; i < count; i++)
+		memcpy(copies + i * length, text, length);
+	copies[*size] = '\0';
+	hq9x_free(HQ9X_MEMORY_HOST, text);
+	return copies;
+}
 
-	if(version == HQ9X_DEADFISH || version == HQ9X_FISHQ9X)
-		state->pre_op = hq9x_force_bound;
-	else if(version == HQ9X_DEFAULT || version == HQ9X_CHIQRSX9X)
-		state->pre_op = hq9x_pre_alter_bf;
-	else if(version == HQ9X_BEFUNGE93)
-		state->pre_op = bef_preprocess;
-	else if(version == HQ9X_H9F)
-		state->pre_op = hq9x_check_dt;
-	else
-		state->pre_op = hq9x_nop;
+/* the output goes to /dev/null, the same way the standard output would */
+typedef struct hq9x_bench_output
+{
+	FILE * file;
+	size_t size;
+} hq9x_bench_output_t;
 
-	switch(version)
-	{
-	case HQ9X_ORIGINAL:
-	case HQ9X_CHIQRSX9X:
-	case HQ9X_OO:
-	case HQ9X_HQ9XBF:
-	case HQ9X_H9F:
-	case HQ9X_BEFUNGE93: /* it is treated so in the reference implementation */
-		state->default_op = hq9x_unknown;
-		state->on_error = ERROR_HALT;
-	break;
+static void hq9x_bench_write(void * user, const char * data, size_t size)
+{
+	hq9x_bench_output_t * output = user;
+	fwrite(data, 1, size, output->file);
+	output->size += size;
+}
 
-	case HQ9X_DEFAULT:
-	case HQ9X_BRAINF:
-	case HQ9X_OO_QC:
-	case HQ9X_FISHQ9X:
-	case HQ9X_H9X:
-	case HQ9X_PLUS:
-	case HQ9X_NIL:
-	default:
-		//state->default_op = hq9x_nop;
-		state->default_op = hq9x_unknown;
-		state->on_error = ERROR_QUIET;
-	break;
+/* runs one case in a child process, so that its peak memory is its own and a crash only loses that case */
+/* the child writes the JSON object of the case to the standard output */
+static void hq9x_bench_case(const char * directory, char ** fields, int dialect, int runs, int warmup, const hq9x_options_t * options)
+{
+	hq9x_options_t bench_options = *options;
+	hq9x_state_t * state;
+	hq9x_record_t record;
+	hq9x_bench_output_t output;
+	struct rusage usage;
+	char * program;
+	char * input = NULL;
+	double * seconds;
+	size_t program_size, input_size = 0;
+	int i, status = 0, saved_stderr;
+
+	if(!(program = hq9x_bench_read(directory, fields[0], &program_size)))
+		exit(1);
+	if(fields[2] && strcmp(fields[2], "-") != 0 && !(input = hq9x_bench_read(directory, fields[2], &input_size)))
+		exit(1);
 
-	case HQ9X_DEADFISH:
-		state->default_op = hq9x_newline;
-	break;
+	/* the output of a deterministic program would be replayed instead of measuring it */
+	bench_options.cache_results = 0;
+	if(fields[3])
+		bench_options.max_steps = strtoull(fields[3], NULL, 0);
+	state = hq9x_create(dialect, &bench_options);
+
+	seconds = malloc(runs * sizeof(double));
+	output.file = fopen("/dev/null", "w");
+	record.write = hq9x_bench_write;
+	record.user = &output;
+	saved_stderr = dup(2);
+	for(i = -warmup; i < runs; i++)
+	{
+		double start;
+		record.data = input;
+		record.pos = 0;
+		record.size = input_size;
+		output.size = 0;
+		start = hq9x_now();
+		status = hq9x_run(state, program, program_size, hq9x_read_record, hq9x_write_record, &record);
+		fflush(output.file);
+		if(i >= 0)
+			seconds[i] = hq9x_now() - start;
+		if(i == -warmup)
+		{
+			/* a limit being exceeded is reported once, not on every run */
+			int null = open("/dev/null", O_WRONLY);
+			if(null >= 0)
+			{
+				dup2(null, 2);
+				close(null);
+			}
+		}
 	}
+	dup2(saved_stderr, 2);
+	close(saved_stderr);
+	fclose(output.file);
+	qsort(seconds, runs, sizeof(double), hq9x_latency_compare);
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("{\"program\": ");
+	print_json_string(stdout, fields[0]);
+	printf(", \"dialect\": ");
+	print_json_string(stdout, fields[1]);
+	printf(", \"input\": ");
+	print_json_string(stdout, input ? fields[2] : "-");
+	printf(", \"status\": %d, \"steps\": %llu, \"output_bytes\": %lu, "
+		"\"median_s\": %.6f, \"p95_s\": %.6f, \"min_s\": %.6f, \"steps_per_s\": %.0f, \"output_mb_per_s\": %.3f, \"peak_rss_kb\": %ld}",
+		status, hq9x_steps(state), (unsigned long)output.size,
+		seconds[runs / 2], seconds[runs * 95 / 100], seconds[0],
+		seconds[runs / 2] > 0 ? hq9x_steps(state) / seconds[runs / 2] : 0.0,
+		seconds[runs / 2] > 0 ? output.size / seconds[runs / 2] / 1e6 : 0.0,
+		(long)usage.ru_maxrss);
+	fflush(stdout);
+	hq9x_destroy(state);
+	free(seconds);
+	hq9x_free(HQ9X_MEMORY_HOST, input);
+	hq9x_free(HQ9X_MEMORY_HOST, program);
+	exit(0);
+}
 
-	switch(version)
+/* each line of the manifest is: program dialect [input [max steps]], with - for no input */
+/* prints the timings of all cases as one JSON object */
+static int hq9x_bench(const char * manifest, int runs, int warmup, const hq9x_options_t * options)
+{
+	FILE * file;
+	char * text;
+	char * line;
+	char * next;
+	char * directory;
+	char * slash;
+	size_t lineno = 0, cases = 0;
+	int failed = 0;
+
+	if(!(file = fopen(manifest, "r")))
 	{
-	case HQ9X_ORIGINAL:
-	//case HQ9X_OO:
-	case HQ9X_DEADFISH:
-	case HQ9X_BEFUNGE93: /* it is treated so in the reference implementation */
-		state->charcase = 'a';
-	break;
+		fprintf(stderr, "Unable to open %s for reading\n", manifest);
+		return 1;
+	}
+	text = readall(HQ9X_MEMORY_HOST, hq9x_read_file, file);
+	fclose(file);
+	if(runs < 1)
+		runs = 1;
+	if(warmup < 0)
+		warmup = 0;
+
+	directory = strdup(manifest);
+	if((slash = strrchr(directory, '/')))
+		*slash = '\0';
+	else
+		strcpy(directory, ".");
 
-	case HQ9X_OO_QC:
-	case HQ9X_CHIQRSX9X:
-	case HQ9X_DEFAULT:
-	case HQ9X_FISHQ9X:
-	//case HQ9X_BRAINF:
-	//case HQ9X_HQ9:
-	//case HQ9X_HQ9XBF:
-	//case HQ9X_PLUS:
-	//case HQ9X_NIL:
-	default:
-		state->charcase = 0;
-	break;
+	/* just the name and number of the version */
+	printf("{\"version\": \"%.*s\", \"runs\": %d, \"warmup\": %d, \"cases\": [",
+		(int)(strstr(HQ9X_VERSION, " - ") - HQ9X_VERSION), HQ9X_VERSION, runs, warmup);
+	for(line = text; line; line = next)
+	{
+		char * fields[4] = { NULL };
+		char * save;
+		int count, dialect, status = 0;
+		pid_t child;
+
+		if((next = strchr(line, '\n')))
+			*next++ = '\0';
+		lineno++;
+		if(*line == '#')
+			continue;
+		for(count = 0; count < 4; count++)
+			if(!(fields[count] = strtok_r(count ? NULL : line, " \t\r", &save)))
+				break;
+		if(count == 0)
+			continue;
+		if(count < 2 || (dialect = hq9x_dialect_by_name(fields[1])) == -1)
+		{
+			fprintf(stderr, "%s:%lu: expected: program dialect [input [max steps]]\n", manifest, (unsigned long)lineno);
+			failed++;
+			continue;
+		}
 
-	case HQ9X_H9F: /* this is what the default implementation does */
-		state->charcase = 'A';
-	break;
+		printf("%s\n\t", cases++ ? "," : "");
+		fflush(stdout);
+		if((child = fork()) == 0)
+			hq9x_bench_case(directory, fields, dialect, runs, warmup, options);
+		if(child < 0 || waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			printf("{\"program\": ");
+			print_json_string(stdout, fields[0]);
+			printf(", \"dialect\": ");
+			print_json_string(stdout, fields[1]);
+			printf(", \"error\": ");
+			print_json_string(stdout, child < 0 ? strerror(errno) : WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) : "unable to run");
+			printf("}");
+			failed++;
+		}
 	}
+	printf("\n]}\n");
+	free(directory);
+	hq9x_free(HQ9X_MEMORY_HOST, text);
+	return failed ? 1 : 0;
 }
 
-void show_version(void)
-{
-	printf(HQ9X_VERSION);
-	exit(0);
-}
+/* Memory report */
 
-void usage(char * argv0)
+static int mem_report = 0; /* 1 for text, 2 for JSON */
+static pid_t mem_report_pid;
+
+/* printed on exit, so that every mode reports it however it returns */
+static void mem_report_at_exit(void)
 {
-	printf("Usage: %s <options>? <inputfile>?\n\
-Valid options:\n\
-\t-a\tOn exit, give accumulator as result\n\
-\t-c<chr>\tCase sensitivity, values:\n\
-\t\t0 - insensitive ('X' and 'x' are the same)\n\
-\t\ta - lower case ('X' and 'x' are different)\n\
-\t\tA - upper case ('x' is invalid)\n\
-\t\td - default for dialect\n\
-\t-h\tThis help page\n\
-\t-n<chr>\tOperation on newline:\n\
-\t\ti - ignore\n\
-\t\tu - unknown (signal if enabled)\n\
-\t\tw - as whitespace (default)\n\
-\t-m\tMessage to write on command H\n\
-\t-u<chr>\tOperation on unknown command:\n\
-\t\th - signal error and halt\n\
-\t\tn - insert newline (Deadfish)\n\
-\t\tq - quiet (comment)\n\
-\t\ts - signal error\n\
-\t-v\tCurrent version\n\
-\t-x\tChange dialect, currently supported:\n\
-\t\tall\t\t\tThe default dialect, a combination of several extensions\n\
-\t\tb hq9+ hq9x\t\tOriginal HQ9+ by Cliff L. Biffle\n\
-\t\t\thttp://web.archive.org/web/20090602074545/http://www.cliff.biffle.org/esoterica/hq9plus.html\n\
-\t\to chiqrsx9+ chiqrsx9x\tCHIQRSX9+, A Turing-complete extension by Ørjen Johansen\n\
-\t\t\thttp://oerjan.nvg.org/esoteric/chiqrsx9+.pl\n\
-\t\tm hq9++ hq9xx\t\tObject-oriented extension by David Morgan-Mar\n\
-\t\t\thttp://www.dangermouse.net/esoteric/hq9plusplus.html\n\
-\t\tz hq9+-\t\t\tObject-oriented extension with quality control by melikamp\n\
-\t\t\thttp://melikamp.com/features/hq9pm.shtml\n\
-\t\th9+ h9x\t\t\tA restriction, presumably by User:Phantom Hoover\n\
-\t\t\thttp://esolangs.org/wiki/H9%%2B\n\
-\t\thq9+b hq9xb\t\tAn extension that is ℒ-complete, by User:Oleg\n\
-\t\t\thttp://esolangs.org/wiki/HQ9%%2BB\n\
-\t\t2d hq9+2d hq9x2d\tAn extension where the program counter moves in 4 directions, by Kenner Gordon\n\
-\t\t\thttp://esolangs.org/wiki/HQ9%%2B2D\n\
-\t\tbf\t\t\tThe BrainF language by Urban Müller\n\
-\t\tdf deadfish\t\tThe Deadfish language, a HQ9+ derivative by Jonathan Todd Skinner\n\
-\t\t\thttp://web.archive.org/web/20100425075447/http://www.jonathantoddskinner.com/projects/deadfish.html\n\
-\t\tfishq9+ fishq9x\t\tA combination of Deadfish and HQ9+ by User:Erinius\n\
-\t\t\thttp://esolangs.org/wiki/FISHQ9%%2B\n\
-\t\tbf93\t\t\tThe Befunge-93 language by Chris Pressey\n\
-\t\t\thttp://catseye.tc/node/Befunge-93.html\n\
-\t\th9f\t\t\tThe Hq9eF language by Egor Promyshlennikov (2016)\n\
-\t\t\thttp://esolangs.org/wiki/Special:Search/H9F\n\
-\t\t+\t\t\tThe + language, possibly by User:HolyCloudNinja\n\
-\t\t\thttp://esolangs.org/wiki/%%2B\n\
-\t\tnil\t\t\tThe Nil language by Sascha René Leib\n\
-\t\t\thttp://esolangs.org/wiki/%%2B\n\
-\t-w<chr>\tOperation on whitespace:\n\
-\t\ti - ignore (default)\n\
-\t\tu - unknown (signal if enabled)\n\
-",
-	argv0);
-	/* melikamp is referred to as Ivan Grigoryevich Zaigralin in the sources */
-	exit(0);
+	if(getpid() != mem_report_pid)
+		return; /* a --bench case in its own process */
+	fflush(stdout);
+	hq9x_memory_report(hq9x_write_stderr, NULL, mem_report == 2);
+	if(mem_report == 2)
+		fprintf(stderr, "\n");
 }
 
 int main(int argc, char ** argv)
 {
 	int argp = 1;
 	FILE * source = stdin;
-	hq9x_state_t * state = clear_alloc(sizeof(hq9x_state_t));
+	hq9x_state_t * state;
+	hq9x_options_t options;
 	int version = HQ9X_DEFAULT;
-	int charcase = -1;
-	int defop = 0;
-	int on_nl = 'w', on_ws = 'i'; /* on newline, on whitespace */
+	int status;
+	char * program;
+	const char * manifest = NULL;
+	const char * bench = NULL;
+	int bench_runs = HQ9X_BENCH_RUNS;
+	int bench_warmup = HQ9X_BENCH_WARMUP;
+	int analyze = 0;
+	int differential = 0; /* 1 for the program given, 2 for random ones */
+	unsigned long differential_count = 0;
+	int cliffs = 0;
+	unsigned long cliffs_count = 0;
+	const char * cliffs_directory = "bench/cliffs";
+	uint64_t seed = 0;
+	const char * socket_path = NULL;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_inflight = 0;
+	size_t max_request = HQ9X_MAX_REQUEST;
+	unsigned long slice = 0;
+	int each_line = 0;
+	int lanes = 0;
+	hq9x_stage_t * stages = NULL;
+	int stage_count = 0;
+	int stage_threads = 0;
+	const char * checkpoint = NULL;
+	unsigned long long checkpoint_every = 0;
+	const char * resume = NULL;
+	const char * sample = NULL;
+	int perf_counters = 0; /* 1 for text, 2 for JSON */
+	const char * dialect_name = "all";
+	hq9x_counters_t counters;
+
+	hq9x_default_options(&options);
+	options.cache_directory = getenv("EHQI_CACHE_DIR");
 
 	while(argp < argc)
 	{
@@ -1537,22 +8086,22 @@ int main(int argc, char ** argv)
 			switch(argv[argp][1])
 			{
 			case 'a':
-				state->exit_with_accumulator = 1;
+				options.exit_with_accumulator = 1;
 			break;
 			case 'c':
 				switch(argv[argp][2])
 				{
 				case '0':
-					charcase = 0;
+					options.charcase = 0;
 				break;
 				case 'a':
-					charcase = 'a';
+					options.charcase = 'a';
 				break;
 				case 'A':
-					charcase = 'A';
+					options.charcase = 'A';
 				break;
 				case 'd':
-					charcase = -1;
+					options.charcase = -1;
 				break;
 				default:
 					fprintf(stderr, "Unknown case-sensitivity: %c\n", argv[argp][2]);
@@ -1565,7 +8114,7 @@ int main(int argc, char ** argv)
 				case 'q': /* HQ9+ C interpreter used -q */
 				case 's':
 				case 'h': /* HQ9+ C interpreter used -9 */
-					defop = argv[argp][2];
+					options.on_unknown = argv[argp][2];
 				break;
 				default:
 					fprintf(stderr, "Unknown default operation: %c\n", argv[argp][2]);
@@ -1576,7 +8125,7 @@ int main(int argc, char ** argv)
 				{
 				case 'u':
 				case 'i':
-					on_ws = argv[argp][2];
+					options.on_whitespace = argv[argp][2];
 				break;
 				default:
 					fprintf(stderr, "Unknown whitespace operation: %c\n", argv[argp][2]);
@@ -1588,21 +8137,350 @@ int main(int argc, char ** argv)
 				case 'w':
 				case 'u':
 				case 'i':
-					on_nl = argv[argp][2];
+					options.on_newline = argv[argp][2];
 				break;
 				default:
 					fprintf(stderr, "Unknown newline operation: %c\n", argv[argp][2]);
 				}
 			break;
+			case '-':
+				if(strcmp(argv[argp], "--cache") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: cache directory\n");
+						return 1;
+					}
+					options.cache_directory = argv[argp];
+				}
+				else if(strcmp(argv[argp], "--cache-limit") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: cache size limit\n");
+						return 1;
+					}
+					options.cache_limit = strtoull(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--no-cache") == 0)
+				{
+					options.cache_directory = NULL;
+				}
+				else if(strcmp(argv[argp], "--result-limit") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: result size limit\n");
+						return 1;
+					}
+					options.result_limit = strtoull(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--no-result-cache") == 0)
+				{
+					options.cache_results = 0;
+				}
+				else if(strcmp(argv[argp], "--each-line") == 0)
+				{
+					each_line = 1;
+				}
+				else if(strcmp(argv[argp], "--lanes") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of lanes\n");
+						return 1;
+					}
+					lanes = atoi(argv[argp]);
+				}
+				else if(strcmp(argv[argp], "--stage-threads") == 0)
+				{
+					stage_threads = 1;
+				}
+				else if(strcmp(argv[argp], "--max-steps") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of steps\n");
+						return 1;
+					}
+					options.max_steps = strtoull(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--max-time") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of seconds\n");
+						return 1;
+					}
+					options.max_seconds = strtod(argv[argp], NULL);
+				}
+				else if(strcmp(argv[argp], "--max-output") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: output size limit\n");
+						return 1;
+					}
+					options.max_output = strtoull(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--max-memory") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: memory size limit\n");
+						return 1;
+					}
+					options.max_memory = strtoull(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--checkpoint") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: checkpoint file\n");
+						return 1;
+					}
+					checkpoint = argv[argp];
+				}
+				else if(strcmp(argv[argp], "--checkpoint-every") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of steps\n");
+						return 1;
+					}
+					checkpoint_every = strtoull(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--resume") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: checkpoint file\n");
+						return 1;
+					}
+					resume = argv[argp];
+				}
+				else if(strcmp(argv[argp], "--sample") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: sample file\n");
+						return 1;
+					}
+					sample = argv[argp];
+					if(!options.sample_rate)
+						options.sample_rate = HQ9X_SAMPLE_RATE;
+				}
+				else if(strcmp(argv[argp], "--sample-rate") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: samples per second\n");
+						return 1;
+					}
+					options.sample_rate = strtol(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--perf-counters") == 0)
+				{
+					perf_counters = 1;
+				}
+				else if(strcmp(argv[argp], "--perf-counters-json") == 0)
+				{
+					perf_counters = 2;
+				}
+				else if(strcmp(argv[argp], "--stats-fd") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: file descriptor\n");
+						return 1;
+					}
+					hq9x_stats_fd = strtol(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--mem-report") == 0 || strcmp(argv[argp], "--mem-report-json") == 0)
+				{
+					if(!mem_report)
+					{
+						mem_report_pid = getpid();
+						atexit(mem_report_at_exit);
+					}
+					mem_report = strcmp(argv[argp], "--mem-report") == 0 ? 1 : 2;
+				}
+				else if(strcmp(argv[argp], "--detect-loops") == 0)
+				{
+					options.detect_loops = 1;
+				}
+				else if(strcmp(argv[argp], "--batch") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: manifest\n");
+						return 1;
+					}
+					manifest = argv[argp];
+				}
+				else if(strcmp(argv[argp], "--differential") == 0)
+				{
+					differential = 1;
+				}
+				else if(strcmp(argv[argp], "--differential-random") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of programs\n");
+						return 1;
+					}
+					differential = 2;
+					differential_count = strtoul(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--cliffs") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of programs\n");
+						return 1;
+					}
+					cliffs = 1;
+					cliffs_count = strtoul(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--cliffs-dir") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: directory\n");
+						return 1;
+					}
+					cliffs_directory = argv[argp];
+				}
+				else if(strcmp(argv[argp], "--seed") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: seed\n");
+						return 1;
+					}
+					seed = strtoull(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--analyze") == 0)
+				{
+					analyze = 1;
+				}
+				else if(strcmp(argv[argp], "--bench") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: manifest\n");
+						return 1;
+					}
+					bench = argv[argp];
+				}
+				else if(strcmp(argv[argp], "--bench-runs") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of runs\n");
+						return 1;
+					}
+					bench_runs = atoi(argv[argp]);
+				}
+				else if(strcmp(argv[argp], "--bench-warmup") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of runs\n");
+						return 1;
+					}
+					bench_warmup = atoi(argv[argp]);
+				}
+				else if(strcmp(argv[argp], "--slice") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of commands\n");
+						return 1;
+					}
+					slice = strtoul(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--serve") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: socket path\n");
+						return 1;
+					}
+					socket_path = argv[argp];
+				}
+				else if(strcmp(argv[argp], "--max-inflight") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of connections\n");
+						return 1;
+					}
+					max_inflight = atoi(argv[argp]);
+				}
+				else if(strcmp(argv[argp], "--max-request") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of bytes\n");
+						return 1;
+					}
+					max_request = strtoull(argv[argp], NULL, 0);
+				}
+				else if(strcmp(argv[argp], "--threads") == 0)
+				{
+					argp++;
+					if(argp >= argc)
+					{
+						fprintf(stderr, "Expected: number of threads\n");
+						return 1;
+					}
+					threads = atoi(argv[argp]);
+				}
+				else
+				{
+					fprintf(stderr, "Invalid option: %s\n", argv[argp]);
+					usage(argv[0]);
+				}
+			break;
 			default:
 				fprintf(stderr, "Invalid option: -%c\n", argv[argp][1]);
 			case 'h':
 				usage(argv[0]);
 			break;
+			case 'p':
+				options.profile = argv[argp][2] == 'c' ? 2 : 1;
+			break;
 			case 'm': /* HQ9+ C interpreter used -H to switch between two messages */
 				argp++;
 				if(argv[argp])
-					hq9x_hello_message = argv[argp];
+					options.hello_message = argv[argp];
 				else
 				{
 					fprintf(stderr, "Expected: message\n");
@@ -1619,43 +8497,37 @@ int main(int argc, char ** argv)
 					printf("Missing dialect\n");
 					return 1;
 				}
-				if(strcasecmp(argv[argp], "HQ9+") == 0 || strcasecmp(argv[argp], "HQ9X") == 0 || strcmp(argv[argp], "b") == 0)
-					version = HQ9X_ORIGINAL;
-				else if(strcasecmp(argv[argp], "CHIQRSX9+") == 0 || strcasecmp(argv[argp], "CHIQRSX9X") == 0 || strcmp(argv[argp], "o") == 0)
-					version = HQ9X_CHIQRSX9X;
-				else if(strcasecmp(argv[argp], "ALL") == 0)
-					version = HQ9X_DEFAULT;
-				else if(strcasecmp(argv[argp], "BF") == 0)
-					version = HQ9X_BRAINF;
-				else if(strcasecmp(argv[argp], "HQ9++") == 0 || strcasecmp(argv[argp], "HQ9XX") == 0 || strcmp(argv[argp], "m") == 0)
-					version = HQ9X_OO;
-				else if(strcasecmp(argv[argp], "HQ9+-") == 0 || strcmp(argv[argp], "z") == 0)
-					version = HQ9X_OO_QC;
-				else if(strcasecmp(argv[argp], "DF") == 0 || strcasecmp(argv[argp], "DEADFUSH") == 0)
-					version = HQ9X_DEADFISH;
-				else if(strcasecmp(argv[argp], "FISHQ9+") == 0 || strcasecmp(argv[argp], "FISHQ9X") == 0)
-					version = HQ9X_FISHQ9X;
-				else if(strcasecmp(argv[argp], "H9+") == 0 || strcasecmp(argv[argp], "H9X") == 0)
-					version = HQ9X_H9X;
-				else if(strcasecmp(argv[argp], "HQ9+B") == 0 || strcasecmp(argv[argp], "HQ9XB") == 0)
-					version = HQ9X_HQ9XBF;
-				else if(strcasecmp(argv[argp], "BF93") == 0)
-					version = HQ9X_BEFUNGE93;
-				else if(strcasecmp(argv[argp], "H9F") == 0)
-					version = HQ9X_H9F;
-				else if(strcasecmp(argv[argp], "NIL") == 0)
-					version = HQ9X_NIL;
-				else if(strcmp(argv[argp], "+") == 0)
-					version = HQ9X_PLUS;
-				else
+				if((version = hq9x_dialect_by_name(argv[argp])) == -1)
 				{
 					printf("Unrecognized dialect: %s\n", argv[argp]);
 					return 1;
 				}
+				dialect_name = argv[argp];
 			}
 		}
+		else if(argp + 1 < argc && strcmp(argv[argp + 1], "-|") == 0)
+		{
+			/* a pipeline stage, the options given so far carry over to the next one */
+			stages = realloc(stages, (stage_count + 1) * sizeof(hq9x_stage_t));
+			memset(&stages[stage_count], 0, sizeof(hq9x_stage_t));
+			stages[stage_count].dialect = version;
+			stages[stage_count].options = options;
+			stages[stage_count].path = argv[argp];
+			stage_count++;
+			argp++;
+		}
 		else
 		{
+			if(stage_count > 0)
+			{
+				stages = realloc(stages, (stage_count + 1) * sizeof(hq9x_stage_t));
+				memset(&stages[stage_count], 0, sizeof(hq9x_stage_t));
+				stages[stage_count].dialect = version;
+				stages[stage_count].options = options;
+				stages[stage_count].path = argv[argp];
+				stage_count++;
+				break;
+			}
 			source = fopen(argv[argp], "r");
 			if(!source)
 			{
@@ -1666,60 +8538,108 @@ int main(int argc, char ** argv)
 		}
 		argp++;
 	}
-	hq9x_initialize(state, version);
-	if(charcase != -1)
-		state->charcase = charcase;
-	switch(defop)
-	{
-	case 'n':
-		state->default_op = hq9x_newline;
-	break;
-	case 'q':
-		state->default_op = hq9x_unknown;
-		state->on_error = ERROR_QUIET;
-	break;
-	case 's':
-		state->default_op = hq9x_unknown;
-		state->on_error = ERROR_SIGNAL;
-	break;
-	case 'h':
-		state->default_op = hq9x_unknown;
-		state->on_error = ERROR_HALT;
-	break;
-	}
-	switch(on_ws)
+
+	/* samples are only taken to be written to the --sample file */
+	if(options.sample_rate > 0 && !sample)
 	{
-	case 'i':
-		state->ops[' '] = state->ops['\t'] = hq9x_nop;
-	break;
-	case 'u':
-		state->ops[' '] = state->ops['\t'] = hq9x_unknown;
-	break;
+		fprintf(stderr, "--sample-rate needs --sample <file>\n");
+		return 1;
 	}
-	switch(on_nl)
+
+	if(differential == 2)
+		return hq9x_differential_random_programs(version, &options, differential_count, seed);
+	if(cliffs)
+		return hq9x_cliff_search(version, dialect_name, &options, cliffs_count, seed, cliffs_directory);
+	if(bench)
+		return hq9x_bench(bench, bench_runs, bench_warmup, &options);
+	if(manifest)
+		return hq9x_batch(manifest, threads, slice, &options);
+	if(socket_path)
+		return hq9x_serve(socket_path, threads, max_inflight ? max_inflight : 4 * threads, max_request, &options);
+
+	if(stage_count > 0)
 	{
-	case 'w':
-		state->ops['\n'] = state->ops[' '];
-	break;
-	case 'i':
-		state->ops['\n'] = hq9x_nop;
-	break;
-	case 'u':
-		state->ops['\n'] = hq9x_unknown;
-	break;
+		if(argp >= argc)
+		{
+			fprintf(stderr, "Expected: program file after -|\n");
+			return 1;
+		}
+		status = hq9x_pipeline(stages, stage_count, stage_threads);
+		free(stages);
+		return status;
 	}
-	state->input.file = source;
-	source_get_text(&state->input);
-	state->input.file = NULL;
-	if(version == HQ9X_BEFUNGE93)
+
+	if(each_line && source == stdin)
 	{
-		source_ensure_grid(&state->input, 25, 80);
+		fprintf(stderr, "Expected: program file\n");
+		return 1;
 	}
 
+	/* a resumed program is in the checkpoint, the standard input is left for it */
+	program = resume ? NULL : readall(HQ9X_MEMORY_TEXT, hq9x_read_file, source);
 	if(source != stdin)
 		fclose(source);
-	hq9x_interpret(state);
-	source_free(&state->input);
-	return state->exit_with_accumulator ? state->accumulator : 0;
+
+	if(analyze)
+	{
+		state = hq9x_create(version, &options);
+		printf("{\"dialect\": \"%s\", \"size\": %zu, \"analysis\": ", dialect_name, strlen(program));
+		hq9x_analyze(state, program, strlen(program), hq9x_write_stdout, NULL);
+		printf("}\n");
+		hq9x_destroy(state);
+		hq9x_free(HQ9X_MEMORY_TEXT, program);
+		return 0;
+	}
+
+	if(differential)
+	{
+		char * input = readall(HQ9X_MEMORY_INPUT, hq9x_read_stdin, NULL);
+		status = hq9x_differential(version, &options, program, input);
+		hq9x_free(HQ9X_MEMORY_INPUT, input);
+		hq9x_free(HQ9X_MEMORY_TEXT, program);
+		return status;
+	}
+
+	state = hq9x_create(version, &options);
+	hq9x_stats_watch(state);
+	if(perf_counters)
+		hq9x_counters_start(&counters);
+	if(each_line)
+	{
+		hq9x_load(state, program, strlen(program));
+		status = hq9x_each_line(state, lanes);
+	}
+	else if(checkpoint || resume)
+		status = hq9x_run_checkpointed(state, program, resume, checkpoint, checkpoint_every);
+	else
+		status = hq9x_run(state, program, strlen(program), hq9x_read_stdin, hq9x_write_stdout, NULL);
+	if(perf_counters)
+	{
+		hq9x_counters_stop(&counters);
+		fflush(stdout);
+		/* the steps of --each-line are only known for the last line */
+		hq9x_counters_report(&counters, dialect_name, each_line ? 0 : hq9x_steps(state), perf_counters == 2);
+	}
+	hq9x_stats_watch(NULL);
+	if(options.profile)
+	{
+		fflush(stdout);
+		hq9x_profile_report(state, hq9x_write_stderr, NULL);
+	}
+	if(sample)
+	{
+		FILE * file = fopen(sample, "w");
+		if(file)
+		{
+			hq9x_profile_folded(state, hq9x_write_file, file);
+			fclose(file);
+		}
+		else
+			fprintf(stderr, "Unable to open %s for writing\n", sample);
+	}
+	hq9x_destroy(state);
+	hq9x_free(HQ9X_MEMORY_TEXT, program);
+	return status;
 }
 
+#endif /* HQ9X_LIBRARY */
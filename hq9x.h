@@ -0,0 +1,158 @@
+#ifndef HQ9X_H
+#define HQ9X_H
+
+/* EHQI as a library: compile hq9x.c with -DHQ9X_LIBRARY to leave out main */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern const char HQ9X_VERSION[];
+
+typedef struct hq9x_state hq9x_state_t;
+
+/* returns the number of bytes stored in buffer, 0 at the end of the input */
+/* or HQ9X_WOULD_BLOCK if nothing is available yet, to park the program when run by hq9x_step */
+typedef size_t (*hq9x_read_t)(void * user, char * buffer, size_t size);
+#define HQ9X_WOULD_BLOCK ((size_t)-1)
+typedef void (*hq9x_write_t)(void * user, const char * data, size_t size);
+
+enum
+{
+	HQ9X_ORIGINAL,
+	HQ9X_DEFAULT,
+	HQ9X_CHIQRSX9X,
+	HQ9X_BRAINF,
+	HQ9X_OO,
+	HQ9X_OO_QC,
+	HQ9X_H9X,
+	HQ9X_HQ9XBF,
+	HQ9X_DEADFISH,
+	HQ9X_FISHQ9X,
+	HQ9X_2D,
+	HQ9X_BEFUNGE93,
+	HQ9X_NIL,
+	HQ9X_PLUS,
+	HQ9X_H9F,
+};
+
+/* results of hq9x_start and hq9x_step */
+enum
+{
+	HQ9X_FINISHED,
+	HQ9X_RUNNING,
+	HQ9X_BLOCKED, /* waiting for input */
+};
+
+typedef struct hq9x_options
+{
+	int charcase; /* -1 for the dialect default, otherwise 0, 'a' or 'A' as with -c */
+	int on_unknown; /* 0 for the dialect default, otherwise 'n', 'q', 's' or 'h' as with -u */
+	int on_whitespace; /* 'i' or 'u' as with -w */
+	int on_newline; /* 'w', 'i' or 'u' as with -n */
+	int exit_with_accumulator; /* as with -a */
+	const char * hello_message; /* as with -m, must outlive the state */
+
+	const char * cache_directory; /* NULL to disable the program and result caches */
+	size_t cache_limit;
+	int cache_results;
+	size_t result_limit; /* 0 if unlimited */
+
+	/* limits of a single run, 0 for none, see HQ9X_EXIT_STEPS and on */
+	unsigned long long max_steps;
+	double max_seconds;
+	size_t max_output; /* bytes */
+	size_t max_memory; /* bytes of BF tape, Befunge stack and grid growth, objects and recursion, S sorts beyond it in temporary files */
+	int detect_loops; /* stop a program once it is back in the exact same state without any I/O */
+	int profile; /* 1 to count the commands run, 2 to also sample their cycles, see hq9x_profile_report */
+	int sample_rate; /* guest stacks sampled per second of processor time with SIGPROF, see hq9x_profile_folded */
+	int naive; /* run the program text as it is, without the opcode stream, the jump table or the caches, to check the other paths against */
+} hq9x_options_t;
+
+/* exit statuses of a run stopped by one of the limits or the loop detector */
+enum
+{
+	HQ9X_EXIT_STEPS = 120,
+	HQ9X_EXIT_TIME,
+	HQ9X_EXIT_OUTPUT,
+	HQ9X_EXIT_MEMORY,
+	HQ9X_EXIT_LOOP,
+};
+
+/* returns the dialect for a name accepted by -x, or -1 */
+int hq9x_dialect_by_name(const char * name);
+
+void hq9x_default_options(hq9x_options_t * options);
+
+/* options may be NULL for the defaults */
+hq9x_state_t * hq9x_create(int dialect, const hq9x_options_t * options);
+
+/* a fresh state with the same dialect and options, cheaper than hq9x_create */
+hq9x_state_t * hq9x_clone(const hq9x_state_t * prototype);
+
+/* runs a program, the state can be reused for further runs */
+/* returns the status the command line interpreter would exit with */
+int hq9x_run(hq9x_state_t * state, const char * program, size_t size, hq9x_read_t input, hq9x_write_t output, void * user);
+
+/* the same as hq9x_run, split up so that many programs can share a thread */
+/* hq9x_start returns HQ9X_FINISHED if the result could be replayed from the cache */
+int hq9x_start(hq9x_state_t * state, const char * program, size_t size, hq9x_read_t input, hq9x_write_t output, void * user);
+/* runs at most the given number of commands */
+int hq9x_step(hq9x_state_t * state, unsigned long steps);
+/* returns the exit status, once hq9x_start or hq9x_step returned HQ9X_FINISHED */
+/* called before that, it stops the program */
+int hq9x_finish(hq9x_state_t * state);
+
+/* prepares a program once, to run it over many inputs with hq9x_rerun */
+/* the grid, the tape and the stack are reset after each run instead of being prepared again */
+int hq9x_load(hq9x_state_t * state, const char * program, size_t size);
+int hq9x_rerun(hq9x_state_t * state, hq9x_read_t input, hq9x_write_t output, void * user);
+/* runs the loaded program once for each of count inputs, outputs going to output with users[i] */
+/* a BF program runs all of them at once while their control flow agrees, the others one by one */
+/* returns the number of inputs that could not be run in lockstep */
+size_t hq9x_rerun_lockstep(hq9x_state_t * state, size_t count, const char * const * inputs, const size_t * sizes,
+	hq9x_write_t output, void * const * users, int * statuses);
+/* the same as hq9x_start, for the loaded program */
+int hq9x_start_loaded(hq9x_state_t * state, hq9x_read_t input, hq9x_write_t output, void * user);
+
+/* saves a run stopped between two calls of hq9x_step to a file, returns 0 on success */
+int hq9x_checkpoint(hq9x_state_t * state, const char * path);
+/* the same as hq9x_start, continuing the saved run where it stopped, returns -1 if the file cannot be used */
+/* input already read by the saved run is in the file, the rest is read from input */
+int hq9x_resume(hq9x_state_t * state, const char * path, hq9x_read_t input, hq9x_write_t output, void * user);
+
+/* number of commands executed by the current or last run */
+unsigned long long hq9x_steps(const hq9x_state_t * state);
+
+/* a one-line snapshot of the run: steps, output and input bytes, BF tape cells used, */
+/* Befunge stack depth and position, returns its length */
+/* async-signal-safe, so a signal handler may call it while the state runs on the same thread */
+size_t hq9x_stats(const hq9x_state_t * state, char * buffer, size_t size);
+
+/* the bytes allocated now and at most for program text, grid lines, input, BF tapes, Befunge stacks, */
+/* HQ9++ objects and the frames of nested programs, summed over all the states of the process */
+/* as a table, or as a JSON object if json is set */
+void hq9x_memory_report(hq9x_write_t output, void * user, int json);
+
+/* writes what can be told about a program without running it, as one JSON object: */
+/* the exact output size, accumulator and steps of a program that runs straight through, */
+/* the loops, I/O commands and tape cells of a BF program, the cells a Befunge program can reach */
+/* and whether it can read input, put into the grid or halt, with a suggestion of how to run it */
+void hq9x_analyze(hq9x_state_t * state, const char * program, size_t size, hq9x_write_t output, void * user);
+
+/* ranks the commands, the loops and the grid cells of the runs so far, if profiling */
+void hq9x_profile_report(const hq9x_state_t * state, hq9x_write_t output, void * user);
+/* writes the sampled stacks of the guest programs, one "frame;frame;... count" line each, as flame graph tools read them */
+/* frames are the [ of BF loops and the I or B commands of nested programs, down to the command sampled, */
+/* each named after its command and offset, or its x,y in a grid */
+void hq9x_profile_folded(const hq9x_state_t * state, hq9x_write_t output, void * user);
+
+void hq9x_destroy(hq9x_state_t * state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HQ9X_H */